@@ -0,0 +1,76 @@
+// Minimal IOKit stand-in so hidkitd builds and runs off macOS.
+// The registry is an in-process table of services with property
+// dictionaries; devices are added and removed either by a scripted event
+// file (HIDKITD_STANDIN_EVENTS) or programmatically through the
+// IOStandIn* calls, and notifications are delivered on the run loop.
+#ifndef HIDKITD_STANDIN_IOKITLIB_H
+#define HIDKITD_STANDIN_IOKITLIB_H
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <time.h>
+
+#define HIDKITD_STANDIN 1   // The IOStandIn* calls below are available.
+
+typedef int kern_return_t;
+typedef kern_return_t IOReturn;
+typedef UInt32 mach_port_t;
+typedef UInt32 IOOptionBits;
+typedef mach_port_t io_object_t;
+typedef io_object_t io_iterator_t;
+typedef io_object_t io_service_t;
+typedef io_object_t io_registry_entry_t;
+typedef char io_name_t[128];
+typedef struct IONotificationPort *IONotificationPortRef;
+typedef void (*IOServiceMatchingCallback)(void *refcon, io_iterator_t iterator);
+
+#define KERN_SUCCESS 0
+#define kIOReturnSuccess 0
+#define kIOReturnError ((IOReturn)0xe00002bc)
+#define kIOReturnNoDevice ((IOReturn)0xe00002c0)
+#define kIOReturnBadArgument ((IOReturn)0xe00002c2)
+#define kIOReturnUnsupported ((IOReturn)0xe00002c7)
+#define kIOReturnNotOpen ((IOReturn)0xe00002cd)
+#define MACH_PORT_NULL ((mach_port_t)0)
+#define IO_OBJECT_NULL ((io_object_t)0)
+#define kIOMainPortDefault MACH_PORT_NULL
+#define kIOMasterPortDefault MACH_PORT_NULL
+#define kIOMatchedNotification "IOServiceMatched"
+#define kIOTerminatedNotification "IOServiceTerminate"
+#define kIOFirstMatchNotification "IOServiceFirstMatch"
+
+IONotificationPortRef IONotificationPortCreate(mach_port_t mainPort);
+void IONotificationPortDestroy(IONotificationPortRef notify);
+CFRunLoopSourceRef IONotificationPortGetRunLoopSource(IONotificationPortRef notify);
+
+CFMutableDictionaryRef IOServiceMatching(const char *name);
+kern_return_t IOServiceAddMatchingNotification(IONotificationPortRef notifyPort, const char *notificationType,
+                                               CFDictionaryRef matching, IOServiceMatchingCallback callback,
+                                               void *refCon, io_iterator_t *notification);
+kern_return_t IOServiceGetMatchingServices(mach_port_t mainPort, CFDictionaryRef matching, io_iterator_t *existing);
+
+io_object_t IOIteratorNext(io_iterator_t iterator);
+kern_return_t IOObjectRetain(io_object_t object);
+kern_return_t IOObjectRelease(io_object_t object);
+
+CFTypeRef IORegistryEntryCreateCFProperty(io_registry_entry_t entry, CFStringRef key, CFAllocatorRef allocator,
+                                          IOOptionBits options);
+kern_return_t IORegistryEntryGetRegistryEntryID(io_registry_entry_t entry, uint64_t *entryID);
+
+// Stand-in control surface. Devices added here behave exactly like scripted
+// ones: matching notifications are queued and delivered by
+// IOStandInDispatch() or by the run loop.
+io_service_t IOStandInAddDevice(CFDictionaryRef properties);
+void IOStandInRemoveDevice(io_service_t service);
+void IOStandInDispatch(void);
+
+// With HIDKITD_STANDIN_UEVENTS set on Linux, HID devices also come from the
+// kernel's uevent netlink socket. Once a histogram is registered here, each
+// notification of such a device adds the time from the kernel sending the
+// uevent (SO_TIMESTAMPNS) to its callback being entered: `counts` has
+// `bucketCount` buckets, the last +Inf, with upper `bounds` for the others.
+void IOStandInMeasureDelivery(const double *bounds, int bucketCount, unsigned long *counts, double *sum);
+// Kernel uevents received so far, and how many were lost on the way (gaps
+// in SEQNUM, which also covers socket buffer overruns).
+void IOStandInKernelEventStats(unsigned long *received, unsigned long *lost);
+
+#endif
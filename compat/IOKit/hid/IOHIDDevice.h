@@ -0,0 +1,33 @@
+// IOHIDDevice stand-in: report I/O against the stand-in registry. Reports
+// written to a service are kept per type and ID and read back as written;
+// a service with the StandInReportsReadOnly property accepts writes but
+// keeps nothing, which is how a device that ignores them looks.
+#ifndef HIDKITD_STANDIN_IOHIDDEVICE_H
+#define HIDKITD_STANDIN_IOHIDDEVICE_H
+
+#include <IOKit/IOKitLib.h>
+
+typedef struct __IOHIDDevice *IOHIDDeviceRef;
+
+typedef enum {
+    kIOHIDReportTypeInput = 0,
+    kIOHIDReportTypeOutput,
+    kIOHIDReportTypeFeature,
+    kIOHIDReportTypeCount
+} IOHIDReportType;
+
+enum {
+    kIOHIDOptionsTypeNone = 0,
+    kIOHIDOptionsTypeSeizeDevice = 1,
+};
+
+IOHIDDeviceRef IOHIDDeviceCreate(CFAllocatorRef allocator, io_service_t service);
+IOReturn IOHIDDeviceOpen(IOHIDDeviceRef device, IOOptionBits options);
+IOReturn IOHIDDeviceClose(IOHIDDeviceRef device, IOOptionBits options);
+// As in IOKit, a report with a nonzero ID starts with the ID byte.
+IOReturn IOHIDDeviceSetReport(IOHIDDeviceRef device, IOHIDReportType reportType, CFIndex reportID,
+                              const uint8_t *report, CFIndex reportLength);
+IOReturn IOHIDDeviceGetReport(IOHIDDeviceRef device, IOHIDReportType reportType, CFIndex reportID,
+                              uint8_t *report, CFIndex *pReportLength);
+
+#endif
@@ -0,0 +1,1223 @@
+// Implementation of the CoreFoundation/IOKit stand-in (see the headers in
+// this directory). On Linux, build hidkitd with
+//   cc -std=gnu11 -O2 -Icompat hidkitd.c compat/standin.c -o hidkitd -lpthread -lm
+// then drive it with HIDKITD_STANDIN_EVENTS, or time the real event paths
+// with `hidkitd --bench events`.
+#define _GNU_SOURCE
+#include <CoreFoundation/CoreFoundation.h>
+#include <IOKit/IOKitLib.h>
+#include <IOKit/hid/IOHIDDevice.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/netlink.h>
+#include <sys/socket.h>
+#endif
+
+// --- CF objects -----------------------------------------------------------
+
+enum {
+    CF_TYPE_STRING = 1,
+    CF_TYPE_NUMBER,
+    CF_TYPE_DATA,
+    CF_TYPE_BOOLEAN,
+    CF_TYPE_DICTIONARY,
+    CF_TYPE_SOURCE,
+    CF_TYPE_TIMER,
+    CF_TYPE_FILE_DESCRIPTOR,
+    CF_TYPE_HID_DEVICE,
+};
+
+#define CF_IMMORTAL (1L << 40)
+
+typedef struct {
+    CFTypeID type;
+    long refcount;
+} CFObject;
+
+struct __CFString { CFObject base; CFIndex length; char bytes[]; };
+struct __CFNumber { CFObject base; int isFloat; long long i; double d; };
+struct __CFData { CFObject base; CFIndex length; UInt8 bytes[]; };
+struct __CFBoolean { CFObject base; Boolean value; };
+struct __CFDictionary { CFObject base; CFIndex count, capacity; const void **keys; const void **values; };
+
+static struct __CFBoolean cfTrue = { { CF_TYPE_BOOLEAN, CF_IMMORTAL }, 1 };
+static struct __CFBoolean cfFalse = { { CF_TYPE_BOOLEAN, CF_IMMORTAL }, 0 };
+const CFBooleanRef kCFBooleanTrue = &cfTrue;
+const CFBooleanRef kCFBooleanFalse = &cfFalse;
+const CFDictionaryKeyCallBacks kCFTypeDictionaryKeyCallBacks = { 0 };
+const CFDictionaryValueCallBacks kCFTypeDictionaryValueCallBacks = { 0 };
+
+static void *cf_alloc(CFTypeID type, size_t size) {
+    CFObject *obj = calloc(1, size);
+    if (!obj) { fprintf(stderr, "STANDIN: out of memory\n"); abort(); }
+    obj->type = type;
+    obj->refcount = 1;
+    return obj;
+}
+
+static void cf_source_free(CFRunLoopSourceRef source);
+static void cf_timer_free(CFRunLoopTimerRef timer);
+static void cf_fd_free(CFFileDescriptorRef f);
+static void hid_device_free(IOHIDDeviceRef device);
+
+CFTypeRef CFRetain(CFTypeRef cf) {
+    if (cf) __atomic_fetch_add(&((CFObject *)cf)->refcount, 1, __ATOMIC_RELAXED);
+    return cf;
+}
+
+void CFRelease(CFTypeRef cf) {
+    CFObject *obj = (CFObject *)cf;
+    if (!obj || obj->refcount >= CF_IMMORTAL) return;
+    if (__atomic_sub_fetch(&obj->refcount, 1, __ATOMIC_ACQ_REL) > 0) return;
+    switch (obj->type) {
+    case CF_TYPE_DICTIONARY: {
+        CFMutableDictionaryRef dict = (CFMutableDictionaryRef)obj;
+        for (CFIndex i = 0; i < dict->count; i++) {
+            CFRelease(dict->keys[i]);
+            CFRelease(dict->values[i]);
+        }
+        free(dict->keys);
+        free(dict->values);
+        break;
+    }
+    case CF_TYPE_SOURCE: cf_source_free((CFRunLoopSourceRef)obj); return;
+    case CF_TYPE_TIMER: cf_timer_free((CFRunLoopTimerRef)obj); return;
+    case CF_TYPE_FILE_DESCRIPTOR: cf_fd_free((CFFileDescriptorRef)obj); return;
+    case CF_TYPE_HID_DEVICE: hid_device_free((IOHIDDeviceRef)obj); return;
+    default: break;
+    }
+    free(obj);
+}
+
+CFTypeID CFGetTypeID(CFTypeRef cf) { return cf ? ((const CFObject *)cf)->type : 0; }
+CFTypeID CFStringGetTypeID(void) { return CF_TYPE_STRING; }
+CFTypeID CFNumberGetTypeID(void) { return CF_TYPE_NUMBER; }
+CFTypeID CFDataGetTypeID(void) { return CF_TYPE_DATA; }
+CFTypeID CFBooleanGetTypeID(void) { return CF_TYPE_BOOLEAN; }
+CFTypeID CFDictionaryGetTypeID(void) { return CF_TYPE_DICTIONARY; }
+
+Boolean CFEqual(CFTypeRef a, CFTypeRef b) {
+    if (a == b) return TRUE;
+    if (!a || !b || CFGetTypeID(a) != CFGetTypeID(b)) return FALSE;
+    switch (CFGetTypeID(a)) {
+    case CF_TYPE_STRING: {
+        CFStringRef x = a, y = b;
+        return x->length == y->length && memcmp(x->bytes, y->bytes, (size_t)x->length) == 0;
+    }
+    case CF_TYPE_NUMBER: {
+        CFNumberRef x = a, y = b;
+        if (x->isFloat || y->isFloat) return x->d == y->d;
+        return x->i == y->i;
+    }
+    case CF_TYPE_DATA: {
+        CFDataRef x = a, y = b;
+        return x->length == y->length && memcmp(x->bytes, y->bytes, (size_t)x->length) == 0;
+    }
+    default:
+        return FALSE;
+    }
+}
+
+// --- Strings, numbers, data -----------------------------------------------
+
+static CFStringRef cf_string_create(const char *cStr, CFIndex length) {
+    struct __CFString *str = cf_alloc(CF_TYPE_STRING, sizeof(*str) + (size_t)length + 1);
+    str->length = length;
+    memcpy(str->bytes, cStr, (size_t)length);
+    str->bytes[length] = '\0';
+    return str;
+}
+
+CFStringRef __CFStringMakeConstantString(const char *cStr) {
+    // Constant strings are interned by address so CFSTR() in a hot path does
+    // not allocate after its first use. Lookups take no lock: a slot's key
+    // is published only after its string.
+    static struct { const char *key; CFStringRef str; } table[256];
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    unsigned start = (unsigned)(((uintptr_t)cStr >> 3) * 2654435761u) % 256;
+    for (int locked = 0; locked < 2; locked++) {
+        if (locked) pthread_mutex_lock(&lock);
+        unsigned h = start;
+        for (unsigned n = 0; n < 256; n++, h = (h + 1) % 256) {
+            const char *key = __atomic_load_n(&table[h].key, __ATOMIC_ACQUIRE);
+            if (key == cStr) {
+                if (locked) pthread_mutex_unlock(&lock);
+                return table[h].str;
+            }
+            if (key) continue;
+            if (!locked) break;
+            struct __CFString *str = (struct __CFString *)cf_string_create(cStr, (CFIndex)strlen(cStr));
+            str->base.refcount = CF_IMMORTAL;
+            table[h].str = str;
+            __atomic_store_n(&table[h].key, cStr, __ATOMIC_RELEASE);
+            pthread_mutex_unlock(&lock);
+            return str;
+        }
+    }
+    pthread_mutex_unlock(&lock);   // Table full: hand out an unshared copy.
+    struct __CFString *str = (struct __CFString *)cf_string_create(cStr, (CFIndex)strlen(cStr));
+    str->base.refcount = CF_IMMORTAL;
+    return str;
+}
+
+const CFRunLoopMode kCFRunLoopDefaultMode = (CFRunLoopMode)&(struct { CFObject base; CFIndex length; char bytes[32]; }){ { CF_TYPE_STRING, CF_IMMORTAL }, 21, "kCFRunLoopDefaultMode" };
+const CFRunLoopMode kCFRunLoopCommonModes = (CFRunLoopMode)&(struct { CFObject base; CFIndex length; char bytes[32]; }){ { CF_TYPE_STRING, CF_IMMORTAL }, 21, "kCFRunLoopCommonModes" };
+
+CFStringRef CFStringCreateWithCString(CFAllocatorRef alloc, const char *cStr, CFStringEncoding encoding) {
+    (void)alloc; (void)encoding;
+    if (!cStr) return NULL;
+    return cf_string_create(cStr, (CFIndex)strlen(cStr));
+}
+
+Boolean CFStringGetCString(CFStringRef theString, char *buffer, CFIndex bufferSize, CFStringEncoding encoding) {
+    (void)encoding;
+    if (!theString || bufferSize <= theString->length) return FALSE;
+    memcpy(buffer, theString->bytes, (size_t)theString->length + 1);
+    return TRUE;
+}
+
+const char *CFStringGetCStringPtr(CFStringRef theString, CFStringEncoding encoding) {
+    (void)encoding;
+    return theString ? theString->bytes : NULL;
+}
+
+CFIndex CFStringGetLength(CFStringRef theString) { return theString ? theString->length : 0; }
+
+static int number_type_is_float(CFNumberType type) {
+    return type == kCFNumberFloat32Type || type == kCFNumberFloat64Type || type == kCFNumberFloatType ||
+           type == kCFNumberDoubleType;
+}
+
+CFNumberRef CFNumberCreate(CFAllocatorRef allocator, CFNumberType theType, const void *valuePtr) {
+    (void)allocator;
+    struct __CFNumber *num = cf_alloc(CF_TYPE_NUMBER, sizeof(*num));
+    switch (theType) {
+    case kCFNumberSInt8Type: case kCFNumberCharType: num->i = *(const int8_t *)valuePtr; break;
+    case kCFNumberSInt16Type: case kCFNumberShortType: num->i = *(const int16_t *)valuePtr; break;
+    case kCFNumberSInt32Type: case kCFNumberIntType: num->i = *(const int32_t *)valuePtr; break;
+    case kCFNumberLongType: num->i = *(const long *)valuePtr; break;
+    case kCFNumberSInt64Type: case kCFNumberLongLongType: num->i = *(const long long *)valuePtr; break;
+    case kCFNumberFloat32Type: case kCFNumberFloatType: num->isFloat = 1; num->d = *(const float *)valuePtr; break;
+    case kCFNumberFloat64Type: case kCFNumberDoubleType: num->isFloat = 1; num->d = *(const double *)valuePtr; break;
+    }
+    if (num->isFloat) num->i = (long long)num->d;
+    else num->d = (double)num->i;
+    return num;
+}
+
+Boolean CFNumberGetValue(CFNumberRef number, CFNumberType theType, void *valuePtr) {
+    if (!number) return FALSE;
+    switch (theType) {
+    case kCFNumberSInt8Type: case kCFNumberCharType: *(int8_t *)valuePtr = (int8_t)number->i; break;
+    case kCFNumberSInt16Type: case kCFNumberShortType: *(int16_t *)valuePtr = (int16_t)number->i; break;
+    case kCFNumberSInt32Type: case kCFNumberIntType: *(int32_t *)valuePtr = (int32_t)number->i; break;
+    case kCFNumberLongType: *(long *)valuePtr = (long)number->i; break;
+    case kCFNumberSInt64Type: case kCFNumberLongLongType: *(long long *)valuePtr = number->i; break;
+    case kCFNumberFloat32Type: case kCFNumberFloatType: *(float *)valuePtr = (float)number->d; break;
+    case kCFNumberFloat64Type: case kCFNumberDoubleType: *(double *)valuePtr = number->d; break;
+    }
+    return number_type_is_float(theType) || !number->isFloat;
+}
+
+Boolean CFBooleanGetValue(CFBooleanRef boolean) { return boolean ? boolean->value : FALSE; }
+
+CFDataRef CFDataCreate(CFAllocatorRef allocator, const UInt8 *bytes, CFIndex length) {
+    (void)allocator;
+    struct __CFData *data = cf_alloc(CF_TYPE_DATA, sizeof(*data) + (size_t)length);
+    data->length = length;
+    if (length > 0) memcpy(data->bytes, bytes, (size_t)length);
+    return data;
+}
+
+const UInt8 *CFDataGetBytePtr(CFDataRef theData) { return theData ? theData->bytes : NULL; }
+CFIndex CFDataGetLength(CFDataRef theData) { return theData ? theData->length : 0; }
+
+// --- Dictionaries -----------------------------------------------------------
+
+CFMutableDictionaryRef CFDictionaryCreateMutable(CFAllocatorRef allocator, CFIndex capacity,
+                                                 const CFDictionaryKeyCallBacks *keyCallBacks,
+                                                 const CFDictionaryValueCallBacks *valueCallBacks) {
+    (void)allocator; (void)capacity; (void)keyCallBacks; (void)valueCallBacks;
+    return cf_alloc(CF_TYPE_DICTIONARY, sizeof(struct __CFDictionary));
+}
+
+static CFIndex dictionary_find(CFDictionaryRef dict, const void *key) {
+    for (CFIndex i = 0; i < dict->count; i++) {
+        if (CFEqual(dict->keys[i], key)) return i;
+    }
+    return -1;
+}
+
+void CFDictionarySetValue(CFMutableDictionaryRef theDict, const void *key, const void *value) {
+    CFIndex i = dictionary_find(theDict, key);
+    if (i >= 0) {
+        CFRetain(value);
+        CFRelease(theDict->values[i]);
+        theDict->values[i] = value;
+        return;
+    }
+    if (theDict->count == theDict->capacity) {
+        theDict->capacity = theDict->capacity ? theDict->capacity * 2 : 8;
+        theDict->keys = realloc(theDict->keys, sizeof(void *) * (size_t)theDict->capacity);
+        theDict->values = realloc(theDict->values, sizeof(void *) * (size_t)theDict->capacity);
+    }
+    theDict->keys[theDict->count] = CFRetain(key);
+    theDict->values[theDict->count] = CFRetain(value);
+    theDict->count++;
+}
+
+const void *CFDictionaryGetValue(CFDictionaryRef theDict, const void *key) {
+    if (!theDict) return NULL;
+    CFIndex i = dictionary_find(theDict, key);
+    return i >= 0 ? theDict->values[i] : NULL;
+}
+
+CFIndex CFDictionaryGetCount(CFDictionaryRef theDict) { return theDict ? theDict->count : 0; }
+
+void CFDictionaryGetKeysAndValues(CFDictionaryRef theDict, const void **keys, const void **values) {
+    for (CFIndex i = 0; i < theDict->count; i++) {
+        if (keys) keys[i] = theDict->keys[i];
+        if (values) values[i] = theDict->values[i];
+    }
+}
+
+// --- Run loop -----------------------------------------------------------------
+
+CFAbsoluteTime CFAbsoluteTimeGetCurrent(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (double)ts.tv_sec - 978307200.0 + (double)ts.tv_nsec / 1e9;
+}
+
+struct __CFRunLoopSource {
+    CFObject base;
+    CFFileDescriptorRef fd;                       // fd-backed source, or
+    double (*pump)(void *info, CFAbsoluteTime now); // polled source returning its next deadline
+    void *info;
+    int pollFd;                                   // Wakes the loop for the pump when readable; -1 if none.
+    int scheduled;
+};
+
+struct __CFRunLoopTimer {
+    CFObject base;
+    CFAbsoluteTime fireDate;
+    CFTimeInterval interval;
+    CFRunLoopTimerCallBack callout;
+    void *info;
+    int valid, scheduled;
+};
+
+struct __CFFileDescriptor {
+    CFObject base;
+    int fd;
+    Boolean closeOnInvalidate;
+    CFFileDescriptorCallBack callout;
+    void *info;
+    CFOptionFlags enabled;
+    int valid;
+};
+
+struct __CFRunLoop {
+    CFRunLoopSourceRef *sources;
+    size_t sourceCount, sourceCap;
+    CFRunLoopTimerRef *timers;
+    size_t timerCount, timerCap;
+    int stopped;
+};
+
+static struct __CFRunLoop mainLoop;
+
+CFRunLoopRef CFRunLoopGetCurrent(void) { return &mainLoop; }
+CFRunLoopRef CFRunLoopGetMain(void) { return &mainLoop; }
+void CFRunLoopStop(CFRunLoopRef rl) { rl->stopped = 1; }
+
+static CFRunLoopSourceRef standin_source_create(double (*pump)(void *, CFAbsoluteTime), void *info) {
+    struct __CFRunLoopSource *source = cf_alloc(CF_TYPE_SOURCE, sizeof(*source));
+    source->pump = pump;
+    source->info = info;
+    source->pollFd = -1;
+    return source;
+}
+
+static void cf_source_free(CFRunLoopSourceRef source) {
+    if (source->fd) CFRelease(source->fd);
+    free(source);
+}
+
+void CFRunLoopAddSource(CFRunLoopRef rl, CFRunLoopSourceRef source, CFRunLoopMode mode) {
+    (void)mode;
+    if (!source || source->scheduled) return;
+    if (rl->sourceCount == rl->sourceCap) {
+        rl->sourceCap = rl->sourceCap ? rl->sourceCap * 2 : 8;
+        rl->sources = realloc(rl->sources, sizeof(*rl->sources) * rl->sourceCap);
+    }
+    rl->sources[rl->sourceCount++] = (CFRunLoopSourceRef)CFRetain(source);
+    source->scheduled = 1;
+}
+
+void CFRunLoopRemoveSource(CFRunLoopRef rl, CFRunLoopSourceRef source, CFRunLoopMode mode) {
+    (void)mode;
+    for (size_t i = 0; i < rl->sourceCount; i++) {
+        if (rl->sources[i] != source) continue;
+        memmove(&rl->sources[i], &rl->sources[i + 1], sizeof(*rl->sources) * (rl->sourceCount - i - 1));
+        rl->sourceCount--;
+        source->scheduled = 0;
+        CFRelease(source);
+        return;
+    }
+}
+
+CFRunLoopTimerRef CFRunLoopTimerCreate(CFAllocatorRef allocator, CFAbsoluteTime fireDate, CFTimeInterval interval,
+                                       CFOptionFlags flags, CFIndex order, CFRunLoopTimerCallBack callout,
+                                       CFRunLoopTimerContext *context) {
+    (void)allocator; (void)flags; (void)order;
+    struct __CFRunLoopTimer *timer = cf_alloc(CF_TYPE_TIMER, sizeof(*timer));
+    timer->fireDate = fireDate;
+    timer->interval = interval;
+    timer->callout = callout;
+    timer->info = context ? context->info : NULL;
+    timer->valid = 1;
+    return timer;
+}
+
+static void cf_timer_free(CFRunLoopTimerRef timer) { free(timer); }
+
+void CFRunLoopAddTimer(CFRunLoopRef rl, CFRunLoopTimerRef timer, CFRunLoopMode mode) {
+    (void)mode;
+    if (!timer || timer->scheduled || !timer->valid) return;
+    if (rl->timerCount == rl->timerCap) {
+        rl->timerCap = rl->timerCap ? rl->timerCap * 2 : 8;
+        rl->timers = realloc(rl->timers, sizeof(*rl->timers) * rl->timerCap);
+    }
+    rl->timers[rl->timerCount++] = (CFRunLoopTimerRef)CFRetain(timer);
+    timer->scheduled = 1;
+}
+
+void CFRunLoopTimerSetNextFireDate(CFRunLoopTimerRef timer, CFAbsoluteTime fireDate) { timer->fireDate = fireDate; }
+CFAbsoluteTime CFRunLoopTimerGetNextFireDate(CFRunLoopTimerRef timer) { return timer->fireDate; }
+
+void CFRunLoopTimerInvalidate(CFRunLoopTimerRef timer) {
+    if (!timer->valid) return;
+    timer->valid = 0;
+    CFRunLoopRef rl = &mainLoop;
+    for (size_t i = 0; i < rl->timerCount; i++) {
+        if (rl->timers[i] != timer) continue;
+        memmove(&rl->timers[i], &rl->timers[i + 1], sizeof(*rl->timers) * (rl->timerCount - i - 1));
+        rl->timerCount--;
+        timer->scheduled = 0;
+        CFRelease(timer);
+        return;
+    }
+}
+
+CFFileDescriptorRef CFFileDescriptorCreate(CFAllocatorRef allocator, CFFileDescriptorNativeDescriptor fd,
+                                           Boolean closeOnInvalidate, CFFileDescriptorCallBack callout,
+                                           const CFFileDescriptorContext *context) {
+    (void)allocator;
+    struct __CFFileDescriptor *f = cf_alloc(CF_TYPE_FILE_DESCRIPTOR, sizeof(*f));
+    f->fd = fd;
+    f->closeOnInvalidate = closeOnInvalidate;
+    f->callout = callout;
+    f->info = context ? context->info : NULL;
+    f->valid = 1;
+    return f;
+}
+
+static void cf_fd_free(CFFileDescriptorRef f) {
+    CFFileDescriptorInvalidate(f);
+    free(f);
+}
+
+CFFileDescriptorNativeDescriptor CFFileDescriptorGetNativeDescriptor(CFFileDescriptorRef f) { return f->fd; }
+void CFFileDescriptorEnableCallBacks(CFFileDescriptorRef f, CFOptionFlags callBackTypes) { f->enabled |= callBackTypes; }
+void CFFileDescriptorDisableCallBacks(CFFileDescriptorRef f, CFOptionFlags callBackTypes) { f->enabled &= ~callBackTypes; }
+
+CFRunLoopSourceRef CFFileDescriptorCreateRunLoopSource(CFAllocatorRef allocator, CFFileDescriptorRef f, CFIndex order) {
+    (void)allocator; (void)order;
+    struct __CFRunLoopSource *source = cf_alloc(CF_TYPE_SOURCE, sizeof(*source));
+    source->fd = (CFFileDescriptorRef)CFRetain(f);
+    source->pollFd = -1;
+    return source;
+}
+
+void CFFileDescriptorInvalidate(CFFileDescriptorRef f) {
+    if (!f->valid) return;
+    f->valid = 0;
+    f->enabled = 0;
+    if (f->closeOnInvalidate && f->fd >= 0) close(f->fd);
+    CFRunLoopRef rl = &mainLoop;
+    for (size_t i = 0; i < rl->sourceCount; i++) {
+        if (rl->sources[i]->fd == f) { CFRunLoopRemoveSource(rl, rl->sources[i], kCFRunLoopDefaultMode); break; }
+    }
+}
+
+static void run_loop_fire_timers(CFRunLoopRef rl) {
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    for (size_t i = 0; i < rl->timerCount && !rl->stopped; i++) {
+        CFRunLoopTimerRef timer = rl->timers[i];
+        if (timer->fireDate > now) continue;
+        CFRetain(timer);
+        if (timer->interval > 0) {
+            // Like CF, missed firings are skipped rather than replayed.
+            while (timer->fireDate <= now) timer->fireDate += timer->interval;
+        }
+        timer->callout(timer, timer->info);
+        if (timer->interval <= 0 && timer->valid && timer->fireDate <= now) CFRunLoopTimerInvalidate(timer);
+        CFRelease(timer);
+        if (i >= rl->timerCount || rl->timers[i] != timer) i--;
+    }
+}
+
+void CFRunLoopRun(void) {
+    CFRunLoopRef rl = &mainLoop;
+    rl->stopped = 0;
+    struct pollfd *fds = NULL;
+    CFRunLoopSourceRef *ready = NULL;
+    size_t cap = 0;
+    while (!rl->stopped) {
+        CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+        double deadline = -1;
+        for (size_t i = 0; i < rl->sourceCount && !rl->stopped; i++) {
+            CFRunLoopSourceRef source = rl->sources[i];
+            if (!source->pump) continue;
+            double next = source->pump(source->info, now);
+            if (next >= 0 && (deadline < 0 || next < deadline)) deadline = next;
+        }
+        if (rl->stopped) break;
+        for (size_t i = 0; i < rl->timerCount; i++) {
+            if (deadline < 0 || rl->timers[i]->fireDate < deadline) deadline = rl->timers[i]->fireDate;
+        }
+        if (cap < rl->sourceCount) {   // At most one pollfd per source.
+            cap = rl->sourceCount;
+            fds = realloc(fds, sizeof(*fds) * cap);
+            ready = realloc(ready, sizeof(*ready) * cap);
+        }
+        nfds_t nfds = 0;
+        for (size_t i = 0; i < rl->sourceCount; i++) {
+            if (rl->sources[i]->pollFd >= 0) {
+                // Readable just means the pump has work on the next pass.
+                fds[nfds].fd = rl->sources[i]->pollFd;
+                fds[nfds].events = POLLIN;
+                fds[nfds].revents = 0;
+                ready[nfds++] = (CFRunLoopSourceRef)CFRetain(rl->sources[i]);
+                continue;
+            }
+            CFFileDescriptorRef f = rl->sources[i]->fd;
+            if (!f || !f->valid || !f->enabled) continue;
+            fds[nfds].fd = f->fd;
+            fds[nfds].events = (short)(((f->enabled & kCFFileDescriptorReadCallBack) ? POLLIN : 0) |
+                                       ((f->enabled & kCFFileDescriptorWriteCallBack) ? POLLOUT : 0));
+            fds[nfds].revents = 0;
+            ready[nfds++] = (CFRunLoopSourceRef)CFRetain(rl->sources[i]);
+        }
+        int timeout = -1;
+        if (deadline >= 0) {
+            double ms = (deadline - CFAbsoluteTimeGetCurrent()) * 1000.0;
+            timeout = ms <= 0 ? 0 : (int)(ms + 1);
+        }
+        int n = poll(fds, nfds, timeout);
+        if (n < 0 && errno != EINTR) { perror("STANDIN: poll"); abort(); }
+        for (nfds_t i = 0; i < nfds; i++) {
+            CFFileDescriptorRef f = ready[i]->fd;
+            if (f && n > 0 && fds[i].revents && f->valid && !rl->stopped) {
+                CFOptionFlags types = 0;
+                if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) types |= kCFFileDescriptorReadCallBack;
+                if (fds[i].revents & POLLOUT) types |= kCFFileDescriptorWriteCallBack;
+                types &= f->enabled;
+                f->enabled &= ~types; // Callbacks are one-shot, as in CF.
+                if (types) f->callout(f, types, f->info);
+            }
+            CFRelease(ready[i]);
+        }
+        if (!rl->stopped) run_loop_fire_timers(rl);
+    }
+    free(fds);
+    free(ready);
+}
+
+// --- IOKit registry ---------------------------------------------------------
+
+enum { IO_KIND_SERVICE = 1, IO_KIND_ITERATOR };
+
+typedef struct {
+    int kind;
+    long refcount;
+    // Services.
+    CFMutableDictionaryRef properties;
+    uint64_t entryID;
+    int present;
+    struct timespec kernelTime;   // Of the uevent that last added or removed it, if any.
+    uint64_t seqnum;
+    CFMutableDictionaryRef reports;   // Written reports by (type << 8 | ID).
+    // Iterators.
+    io_object_t *queue;
+    size_t head, count, cap;
+} IOObject;
+
+struct IONotificationPort {
+    CFRunLoopSourceRef source;
+};
+
+typedef struct {
+    IONotificationPortRef port;
+    int terminated;
+    CFDictionaryRef matching;
+    IOServiceMatchingCallback callback;
+    void *refCon;
+    io_iterator_t iterator;
+    int pending;
+} Notification;
+
+static IOObject **objects;       // Handle table; handle n lives at objects[n].
+static size_t objectCap;
+static Notification *notifications;
+static size_t notificationCount;
+static uint64_t nextEntryID = 0x100000100;
+static FILE *eventScript;
+static double scriptResumeAt;
+
+static IOObject *io_lookup(io_object_t handle) {
+    return handle && handle < objectCap ? objects[handle] : NULL;
+}
+
+static io_object_t io_new(int kind) {
+    size_t handle = 1;
+    while (handle < objectCap && objects[handle]) handle++;
+    if (handle >= objectCap) {
+        size_t cap = objectCap ? objectCap * 2 : 64;
+        objects = realloc(objects, sizeof(*objects) * cap);
+        memset(objects + objectCap, 0, sizeof(*objects) * (cap - objectCap));
+        objectCap = cap;
+    }
+    IOObject *obj = calloc(1, sizeof(*obj));
+    obj->kind = kind;
+    obj->refcount = 1;
+    objects[handle] = obj;
+    return (io_object_t)handle;
+}
+
+kern_return_t IOObjectRetain(io_object_t object) {
+    IOObject *obj = io_lookup(object);
+    if (!obj) return kIOReturnBadArgument;
+    obj->refcount++;
+    return KERN_SUCCESS;
+}
+
+kern_return_t IOObjectRelease(io_object_t object) {
+    IOObject *obj = io_lookup(object);
+    if (!obj) return kIOReturnBadArgument;
+    if (--obj->refcount > 0) return KERN_SUCCESS;
+    for (size_t i = 0; i < obj->count; i++) IOObjectRelease(obj->queue[(obj->head + i) % obj->cap]);
+    free(obj->queue);
+    if (obj->properties) CFRelease(obj->properties);
+    if (obj->reports) CFRelease(obj->reports);
+    free(obj);
+    objects[object] = NULL;
+    return KERN_SUCCESS;
+}
+
+static void iterator_push(io_iterator_t iterator, io_object_t object) {
+    IOObject *it = io_lookup(iterator);
+    if (it->count == it->cap) {
+        size_t cap = it->cap ? it->cap * 2 : 16;
+        io_object_t *queue = malloc(sizeof(*queue) * cap);
+        for (size_t i = 0; i < it->count; i++) queue[i] = it->queue[(it->head + i) % it->cap];
+        free(it->queue);
+        it->queue = queue;
+        it->head = 0;
+        it->cap = cap;
+    }
+    IOObjectRetain(object);
+    it->queue[(it->head + it->count++) % it->cap] = object;
+}
+
+io_object_t IOIteratorNext(io_iterator_t iterator) {
+    IOObject *it = io_lookup(iterator);
+    if (!it || it->kind != IO_KIND_ITERATOR || it->count == 0) return IO_OBJECT_NULL;
+    io_object_t object = it->queue[it->head];
+    it->head = (it->head + 1) % it->cap;
+    it->count--;
+    return object; // The reference taken by iterator_push passes to the caller.
+}
+
+CFMutableDictionaryRef IOServiceMatching(const char *name) {
+    CFMutableDictionaryRef dict = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks,
+                                                            &kCFTypeDictionaryValueCallBacks);
+    CFStringRef cls = CFStringCreateWithCString(kCFAllocatorDefault, name, kCFStringEncodingUTF8);
+    CFDictionarySetValue(dict, CFSTR("IOProviderClass"), cls);
+    CFRelease(cls);
+    return dict;
+}
+
+static int service_matches(IOObject *service, CFDictionaryRef matching) {
+    for (CFIndex i = 0; i < matching->count; i++) {
+        CFTypeRef key = matching->keys[i];
+        CFTypeRef want = matching->values[i];
+        CFTypeRef have = CFDictionaryGetValue(service->properties, key);
+        if (CFEqual(key, CFSTR("IOProviderClass"))) {
+            // IOHIDDevice and IOService are superclasses of every stand-in device.
+            if (CFEqual(want, CFSTR("IOService")) || CFEqual(want, CFSTR("IOHIDDevice"))) continue;
+            if (!have) have = CFSTR("IOHIDUserDevice");
+        }
+        if (!CFEqual(want, have)) return 0;
+    }
+    return 1;
+}
+
+static void queue_notifications(io_service_t handle, int terminated) {
+    IOObject *service = io_lookup(handle);
+    for (size_t i = 0; i < notificationCount; i++) {
+        Notification *n = &notifications[i];
+        if (n->terminated != terminated || !service_matches(service, n->matching)) continue;
+        iterator_push(n->iterator, handle);
+        n->pending = 1;
+    }
+}
+
+static struct {
+    const double *bounds;
+    int bucketCount;
+    unsigned long *counts;
+    double *sum;
+} deliveryHistogram;
+
+void IOStandInMeasureDelivery(const double *bounds, int bucketCount, unsigned long *counts, double *sum) {
+    deliveryHistogram.bounds = bounds;
+    deliveryHistogram.bucketCount = bucketCount;
+    deliveryHistogram.counts = counts;
+    deliveryHistogram.sum = sum;
+}
+
+// Adds the delivery time of each kernel-sourced service waiting in
+// `iterator`. The clock is read once, as the callback is entered, so a
+// sample is delivery and run loop wake-up, not earlier devices' work.
+static void delivery_measure(io_iterator_t iterator) {
+    if (!deliveryHistogram.counts) return;
+    IOObject *it = io_lookup(iterator);
+    struct timespec entry;
+    clock_gettime(CLOCK_REALTIME, &entry);
+    for (size_t i = 0; i < it->count; i++) {
+        IOObject *service = io_lookup(it->queue[(it->head + i) % it->cap]);
+        if (!service || !service->seqnum) continue;
+        double seconds = (double)(entry.tv_sec - service->kernelTime.tv_sec) +
+                         (double)(entry.tv_nsec - service->kernelTime.tv_nsec) / 1e9;
+        if (seconds < 0) seconds = 0;   // The wall clock stepped back.
+        int b = 0;
+        while (b < deliveryHistogram.bucketCount - 1 && seconds > deliveryHistogram.bounds[b]) b++;
+        deliveryHistogram.counts[b]++;
+        *deliveryHistogram.sum += seconds;
+    }
+}
+
+void IOStandInDispatch(void) {
+    for (size_t i = 0; i < notificationCount; i++) {
+        if (!notifications[i].pending) continue;
+        notifications[i].pending = 0;
+        delivery_measure(notifications[i].iterator);
+        notifications[i].callback(notifications[i].refCon, notifications[i].iterator);
+    }
+}
+
+io_service_t IOStandInAddDevice(CFDictionaryRef properties) {
+    io_service_t handle = io_new(IO_KIND_SERVICE);
+    IOObject *service = io_lookup(handle);
+    service->properties = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks,
+                                                    &kCFTypeDictionaryValueCallBacks);
+    for (CFIndex i = 0; properties && i < properties->count; i++) {
+        CFDictionarySetValue(service->properties, properties->keys[i], properties->values[i]);
+    }
+    service->entryID = nextEntryID++;
+    service->present = 1;
+    queue_notifications(handle, 0);
+    return handle;
+}
+
+void IOStandInRemoveDevice(io_service_t handle) {
+    IOObject *service = io_lookup(handle);
+    if (!service || service->kind != IO_KIND_SERVICE || !service->present) return;
+    service->present = 0;
+    queue_notifications(handle, 1);
+    IOObjectRelease(handle); // Drop the registry's own reference.
+}
+
+CFTypeRef IORegistryEntryCreateCFProperty(io_registry_entry_t entry, CFStringRef key, CFAllocatorRef allocator,
+                                          IOOptionBits options) {
+    (void)allocator; (void)options;
+    IOObject *service = io_lookup(entry);
+    if (!service || service->kind != IO_KIND_SERVICE) return NULL;
+    return CFRetain(CFDictionaryGetValue(service->properties, key));
+}
+
+kern_return_t IORegistryEntryGetRegistryEntryID(io_registry_entry_t entry, uint64_t *entryID) {
+    IOObject *service = io_lookup(entry);
+    if (!service || service->kind != IO_KIND_SERVICE) return kIOReturnBadArgument;
+    *entryID = service->entryID;
+    return KERN_SUCCESS;
+}
+
+// --- IOHIDDevice ------------------------------------------------------------
+
+struct __IOHIDDevice { CFObject base; io_service_t service; int open; };
+
+IOHIDDeviceRef IOHIDDeviceCreate(CFAllocatorRef allocator, io_service_t service) {
+    (void)allocator;
+    IOObject *obj = io_lookup(service);
+    if (!obj || obj->kind != IO_KIND_SERVICE) return NULL;
+    IOHIDDeviceRef device = cf_alloc(CF_TYPE_HID_DEVICE, sizeof(*device));
+    IOObjectRetain(service);
+    device->service = service;
+    return device;
+}
+
+static void hid_device_free(IOHIDDeviceRef device) {
+    IOObjectRelease(device->service);
+    free(device);
+}
+
+IOReturn IOHIDDeviceOpen(IOHIDDeviceRef device, IOOptionBits options) {
+    (void)options;
+    IOObject *obj = io_lookup(device->service);
+    if (!obj->present) return kIOReturnNoDevice;
+    device->open = 1;
+    return kIOReturnSuccess;
+}
+
+IOReturn IOHIDDeviceClose(IOHIDDeviceRef device, IOOptionBits options) {
+    (void)options;
+    if (!device->open) return kIOReturnNotOpen;
+    device->open = 0;
+    return kIOReturnSuccess;
+}
+
+// The device's open service, or NULL with the reason in *result.
+static IOObject *hid_device_service(IOHIDDeviceRef device, IOReturn *result) {
+    IOObject *obj = io_lookup(device->service);
+    *result = !device->open ? kIOReturnNotOpen : !obj->present ? kIOReturnNoDevice : kIOReturnSuccess;
+    return *result == kIOReturnSuccess ? obj : NULL;
+}
+
+static CFNumberRef hid_report_key(IOHIDReportType reportType, CFIndex reportID) {
+    long key = (long)reportType << 8 | (reportID & 0xff);
+    return CFNumberCreate(kCFAllocatorDefault, kCFNumberLongType, &key);
+}
+
+IOReturn IOHIDDeviceSetReport(IOHIDDeviceRef device, IOHIDReportType reportType, CFIndex reportID,
+                              const uint8_t *report, CFIndex reportLength) {
+    IOReturn result;
+    IOObject *obj = hid_device_service(device, &result);
+    if (!obj) return result;
+    if (reportType == kIOHIDReportTypeInput || reportType >= kIOHIDReportTypeCount || reportLength < 1 ||
+        (reportID && report[0] != reportID)) {
+        return kIOReturnBadArgument;
+    }
+    if (CFDictionaryGetValue(obj->properties, CFSTR("StandInReportsReadOnly"))) return kIOReturnSuccess;
+    if (!obj->reports) {
+        obj->reports = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks,
+                                                 &kCFTypeDictionaryValueCallBacks);
+    }
+    CFNumberRef key = hid_report_key(reportType, reportID);
+    CFDataRef data = CFDataCreate(kCFAllocatorDefault, report, reportLength);
+    CFDictionarySetValue(obj->reports, key, data);
+    CFRelease(key);
+    CFRelease(data);
+    return kIOReturnSuccess;
+}
+
+// Reads back what was last written, or zeros (after the ID byte) for a
+// report never written.
+IOReturn IOHIDDeviceGetReport(IOHIDDeviceRef device, IOHIDReportType reportType, CFIndex reportID,
+                              uint8_t *report, CFIndex *pReportLength) {
+    IOReturn result;
+    IOObject *obj = hid_device_service(device, &result);
+    if (!obj) return result;
+    if (reportType >= kIOHIDReportTypeCount || *pReportLength < 1) return kIOReturnBadArgument;
+    CFNumberRef key = hid_report_key(reportType, reportID);
+    CFDataRef data = obj->reports ? CFDictionaryGetValue(obj->reports, key) : NULL;
+    CFRelease(key);
+    if (data) {
+        CFIndex length = CFDataGetLength(data) < *pReportLength ? CFDataGetLength(data) : *pReportLength;
+        memcpy(report, CFDataGetBytePtr(data), (size_t)length);
+        *pReportLength = length;
+    } else {
+        memset(report, 0, (size_t)*pReportLength);
+        if (reportID) report[0] = (uint8_t)reportID;
+    }
+    return kIOReturnSuccess;
+}
+
+static void script_open(void);
+
+kern_return_t IOServiceGetMatchingServices(mach_port_t mainPort, CFDictionaryRef matching, io_iterator_t *existing) {
+    (void)mainPort;
+    script_open();
+    io_iterator_t iterator = io_new(IO_KIND_ITERATOR);
+    for (size_t h = 1; h < objectCap; h++) {
+        IOObject *obj = objects[h];
+        if (obj && obj->kind == IO_KIND_SERVICE && obj->present && service_matches(obj, matching)) {
+            iterator_push(iterator, (io_object_t)h);
+        }
+    }
+    CFRelease(matching);
+    *existing = iterator;
+    return KERN_SUCCESS;
+}
+
+// --- Scripted event source ------------------------------------------------
+//
+// HIDKITD_STANDIN_EVENTS names a text file of commands, one per line:
+//   present <tag> Key=value ...   device already attached at startup
+//   add <tag> Key=value ...       attach a device
+//   remove <tag>                  detach the device added under <tag>
+//   wait <ms>                     pause the script
+//   stop                          stop the run loop
+// Values are numbers (decimal or 0x), quoted strings, bare strings, or
+// hex:<bytes> for data properties such as ReportDescriptor.
+
+typedef struct { char tag[256]; io_service_t service; } ScriptDevice;
+static ScriptDevice *scriptDevices;
+static size_t scriptDeviceCount, scriptDeviceCap;
+
+static void device_track(const char *tag, io_service_t service) {
+    if (scriptDeviceCount == scriptDeviceCap) {
+        scriptDeviceCap = scriptDeviceCap ? scriptDeviceCap * 2 : 16;
+        scriptDevices = realloc(scriptDevices, sizeof(*scriptDevices) * scriptDeviceCap);
+    }
+    ScriptDevice *dev = &scriptDevices[scriptDeviceCount++];
+    snprintf(dev->tag, sizeof(dev->tag), "%s", tag);
+    dev->service = service;
+}
+
+// Forgets the newest device added under `tag` and returns it, or 0.
+static io_service_t device_untrack(const char *tag) {
+    for (size_t i = scriptDeviceCount; i-- > 0;) {
+        if (strcmp(scriptDevices[i].tag, tag) != 0) continue;
+        io_service_t service = scriptDevices[i].service;
+        scriptDevices[i] = scriptDevices[--scriptDeviceCount];
+        return service;
+    }
+    return 0;
+}
+
+static CFTypeRef parse_value(const char *text) {
+    if (strncmp(text, "hex:", 4) == 0) {
+        size_t len = strlen(text + 4) / 2;
+        UInt8 *bytes = malloc(len ? len : 1);
+        for (size_t i = 0; i < len; i++) sscanf(text + 4 + 2 * i, "%2hhx", &bytes[i]);
+        CFDataRef data = CFDataCreate(kCFAllocatorDefault, bytes, (CFIndex)len);
+        free(bytes);
+        return data;
+    }
+    char *end;
+    errno = 0;
+    long long n = strtoll(text, &end, 0);
+    if (*text && !*end && errno == 0) return CFNumberCreate(kCFAllocatorDefault, kCFNumberLongLongType, &n);
+    return CFStringCreateWithCString(kCFAllocatorDefault, text, kCFStringEncodingUTF8);
+}
+
+static char *next_token(char **cursor) {
+    char *p = *cursor;
+    while (isspace((unsigned char)*p)) p++;
+    if (!*p) return NULL;
+    char *start = p, *out = p;
+    int quoted = 0;
+    for (; *p && (quoted || !isspace((unsigned char)*p)); p++) {
+        if (*p == '"') { quoted = !quoted; continue; }
+        *out++ = *p;
+    }
+    if (*p) p++;
+    *out = '\0';
+    *cursor = p;
+    return start;
+}
+
+static void script_add(char *tag, char *cursor) {
+    CFMutableDictionaryRef props = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks,
+                                                             &kCFTypeDictionaryValueCallBacks);
+    char *token;
+    while ((token = next_token(&cursor))) {
+        char *eq = strchr(token, '=');
+        if (!eq) continue;
+        *eq = '\0';
+        CFStringRef key = CFStringCreateWithCString(kCFAllocatorDefault, token, kCFStringEncodingUTF8);
+        CFTypeRef value = parse_value(eq + 1);
+        CFDictionarySetValue(props, key, value);
+        CFRelease(key);
+        CFRelease(value);
+    }
+    device_track(tag, IOStandInAddDevice(props));
+    CFRelease(props);
+}
+
+static void script_remove(const char *tag) {
+    io_service_t service = device_untrack(tag);
+    if (service) IOStandInRemoveDevice(service);
+    else fprintf(stderr, "STANDIN: remove of unknown device '%s'\n", tag);
+}
+
+// Runs script lines until a wait or the end of the file. With presentOnly,
+// stops at the first line that is not a `present` line.
+static void script_run(int presentOnly) {
+    char line[4096];
+    while (eventScript) {
+        long pos = ftell(eventScript);
+        if (!fgets(line, sizeof(line), eventScript)) { fclose(eventScript); eventScript = NULL; break; }
+        char *cursor = line;
+        char *cmd = next_token(&cursor);
+        if (!cmd || cmd[0] == '#') continue;
+        if (presentOnly && strcmp(cmd, "present") != 0) { fseek(eventScript, pos, SEEK_SET); break; }
+        if (strcmp(cmd, "present") == 0 || strcmp(cmd, "add") == 0) {
+            char *tag = next_token(&cursor);
+            if (tag) script_add(tag, cursor);
+        } else if (strcmp(cmd, "remove") == 0) {
+            char *tag = next_token(&cursor);
+            if (tag) script_remove(tag);
+        } else if (strcmp(cmd, "wait") == 0) {
+            char *ms = next_token(&cursor);
+            scriptResumeAt = CFAbsoluteTimeGetCurrent() + (ms ? atof(ms) : 0) / 1000.0;
+            break;
+        } else if (strcmp(cmd, "stop") == 0) {
+            IOStandInDispatch();
+            CFRunLoopStop(CFRunLoopGetCurrent());
+            fclose(eventScript);
+            eventScript = NULL;
+            return;
+        } else {
+            fprintf(stderr, "STANDIN: unknown script command '%s'\n", cmd);
+        }
+    }
+}
+
+// Opens the event script on first use and attaches its `present` devices.
+static void script_open(void) {
+    static int opened;
+    const char *path = getenv("HIDKITD_STANDIN_EVENTS");
+    if (opened || !path) return;
+    opened = 1;
+    eventScript = fopen(path, "r");
+    if (!eventScript) perror("STANDIN: HIDKITD_STANDIN_EVENTS");
+    script_run(1);
+}
+
+// --- Kernel uevents (Linux) ---------------------------------------------------
+//
+// With HIDKITD_STANDIN_UEVENTS set, HID devices the kernel adds and removes
+// are mirrored into the registry from the NETLINK_KOBJECT_UEVENT socket:
+//   HID_ID=0003:0000046D:0000C52B      bus, VendorID, ProductID
+//   HID_NAME, HID_UNIQ                  Product, SerialNumber
+//   /sys/DEVPATH/report_descriptor      ReportDescriptor
+//   DEVPATH=.../usb1/1-2/1-2.3/1-2.3:1.0/...   LocationID 0x01230000
+// Every datagram carries the kernel's timestamp (SO_TIMESTAMPNS) and a
+// SEQNUM. The kernel numbers all uevents in one sequence, so a jump in it
+// counts lost events without any extra syscall.
+
+static unsigned long ueventReceived, ueventLost;
+
+#ifdef __linux__
+static int ueventFd = -1;
+static uint64_t ueventSeqnum;
+
+static void uevent_open(void) {
+    if (!getenv("HIDKITD_STANDIN_UEVENTS")) return;
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+    struct sockaddr_nl addr = { .nl_family = AF_NETLINK, .nl_groups = 1 };
+    int on = 1, size = 1 << 20;
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) != 0) {
+        perror("STANDIN: uevent socket");
+        if (fd >= 0) close(fd);
+        return;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    ueventFd = fd;
+}
+
+// The LocationID IOKit would give the USB device whose interface is in
+// `devpath`: the bus in the top byte, then one nibble per port.
+static long uevent_location(const char *devpath) {
+    for (const char *p = devpath; (p = strchr(p, '/')); ) {
+        p++;
+        char *q;
+        long bus = strtol(p, &q, 10);
+        if (q == p || *q != '-' || !isdigit((unsigned char)q[1])) continue;
+        long location = (bus & 0xff) << 24;
+        for (int shift = 20; isdigit((unsigned char)*++q); shift -= 4) {
+            long port = strtol(q, &q, 10);
+            if (shift >= 0) location |= (port & 0xf) << shift;
+            if (*q != '.') break;
+        }
+        if (*q == ':') return location;   // The interface, e.g. 1-2.3:1.0.
+    }
+    return 0;
+}
+
+static void uevent_set_number(CFMutableDictionaryRef props, CFStringRef key, long value) {
+    CFNumberRef num = CFNumberCreate(kCFAllocatorDefault, kCFNumberLongType, &value);
+    CFDictionarySetValue(props, key, num);
+    CFRelease(num);
+}
+
+// Sets `key` to the contents of a sysfs attribute such as report_descriptor.
+static void uevent_set_file(CFMutableDictionaryRef props, CFStringRef key, const char *path) {
+    UInt8 bytes[4096];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    ssize_t n = read(fd, bytes, sizeof(bytes));
+    close(fd);
+    if (n <= 0) return;
+    CFDataRef data = CFDataCreate(kCFAllocatorDefault, bytes, n);
+    CFDictionarySetValue(props, key, data);
+    CFRelease(data);
+}
+
+static void uevent_set_string(CFMutableDictionaryRef props, CFStringRef key, const char *value) {
+    if (!value || !*value) return;
+    CFStringRef str = CFStringCreateWithCString(kCFAllocatorDefault, value, kCFStringEncodingUTF8);
+    CFDictionarySetValue(props, key, str);
+    CFRelease(str);
+}
+
+// Applies one uevent: `message` holds NUL-separated KEY=value pairs after
+// an action@devpath header.
+static void uevent_handle(const char *message, size_t length, const struct timespec *when) {
+    const char *action = NULL, *subsystem = NULL, *devpath = NULL, *hidID = NULL, *name = NULL, *uniq = NULL;
+    uint64_t seqnum = 0;
+    for (const char *p = message; p < message + length; p += strlen(p) + 1) {
+        if (strncmp(p, "ACTION=", 7) == 0) action = p + 7;
+        else if (strncmp(p, "SUBSYSTEM=", 10) == 0) subsystem = p + 10;
+        else if (strncmp(p, "DEVPATH=", 8) == 0) devpath = p + 8;
+        else if (strncmp(p, "HID_ID=", 7) == 0) hidID = p + 7;
+        else if (strncmp(p, "HID_NAME=", 9) == 0) name = p + 9;
+        else if (strncmp(p, "HID_UNIQ=", 9) == 0) uniq = p + 9;
+        else if (strncmp(p, "SEQNUM=", 7) == 0) seqnum = strtoull(p + 7, NULL, 10);
+    }
+    if (!seqnum) return;
+    ueventReceived++;
+    if (ueventSeqnum && seqnum > ueventSeqnum + 1) ueventLost += seqnum - ueventSeqnum - 1;
+    ueventSeqnum = seqnum;
+    if (!action || !devpath || !subsystem || strcmp(subsystem, "hid") != 0) return;
+
+    if (strcmp(action, "add") == 0) {
+        unsigned bus;
+        unsigned long vendorID, productID;
+        if (!hidID || sscanf(hidID, "%x:%lx:%lx", &bus, &vendorID, &productID) != 3) return;
+        CFMutableDictionaryRef props = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks,
+                                                                 &kCFTypeDictionaryValueCallBacks);
+        uevent_set_number(props, CFSTR("VendorID"), (long)vendorID);
+        uevent_set_number(props, CFSTR("ProductID"), (long)productID);
+        uevent_set_number(props, CFSTR("LocationID"), uevent_location(devpath));
+        uevent_set_string(props, CFSTR("Product"), name);
+        uevent_set_string(props, CFSTR("SerialNumber"), uniq);
+        uevent_set_string(props, CFSTR("Transport"), bus == 3 ? "USB" : bus == 5 ? "Bluetooth" : NULL);
+        char path[512];
+        snprintf(path, sizeof(path), "/sys%s/report_descriptor", devpath);
+        uevent_set_file(props, CFSTR("ReportDescriptor"), path);
+        io_service_t service = IOStandInAddDevice(props);
+        CFRelease(props);
+        device_track(devpath, service);
+        io_lookup(service)->kernelTime = *when;
+        io_lookup(service)->seqnum = seqnum;
+    } else if (strcmp(action, "remove") == 0) {
+        io_service_t service = device_untrack(devpath);
+        if (!service) return;
+        io_lookup(service)->kernelTime = *when;
+        io_lookup(service)->seqnum = seqnum;
+        IOStandInRemoveDevice(service);
+    }
+}
+
+static void uevent_drain(void) {
+    char message[8192];
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(struct timespec))];
+    } control;
+    for (;;) {
+        struct sockaddr_nl sender;
+        struct iovec iov = { message, sizeof(message) - 1 };
+        struct msghdr msg = { .msg_name = &sender, .msg_namelen = sizeof(sender), .msg_iov = &iov, .msg_iovlen = 1,
+                              .msg_control = &control, .msg_controllen = sizeof(control) };
+        ssize_t n = recvmsg(ueventFd, &msg, MSG_DONTWAIT);
+        if (n < 0 && (errno == ENOBUFS || errno == EINTR)) continue;   // Overruns show up as SEQNUM gaps.
+        if (n < 0) break;
+        if (sender.nl_pid != 0) continue;   // Only the kernel's own messages.
+        struct timespec when = { 0, 0 };
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+            if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS) memcpy(&when, CMSG_DATA(c), sizeof(when));
+        }
+        if (!when.tv_sec) clock_gettime(CLOCK_REALTIME, &when);
+        message[n] = '\0';
+        uevent_handle(message, (size_t)n, &when);
+    }
+}
+#endif
+
+void IOStandInKernelEventStats(unsigned long *received, unsigned long *lost) {
+    *received = ueventReceived;
+    *lost = ueventLost;
+}
+
+static double notification_port_pump(void *info, CFAbsoluteTime now) {
+    (void)info;
+#ifdef __linux__
+    if (ueventFd >= 0) uevent_drain();
+#endif
+    if (eventScript && now >= scriptResumeAt) script_run(0);
+    IOStandInDispatch();
+    return eventScript ? scriptResumeAt : -1;
+}
+
+IONotificationPortRef IONotificationPortCreate(mach_port_t mainPort) {
+    (void)mainPort;
+    IONotificationPortRef port = calloc(1, sizeof(*port));
+    port->source = standin_source_create(notification_port_pump, port);
+    script_open();
+#ifdef __linux__
+    uevent_open();
+    port->source->pollFd = ueventFd;
+#endif
+    return port;
+}
+
+void IONotificationPortDestroy(IONotificationPortRef notify) {
+    CFRunLoopRemoveSource(CFRunLoopGetCurrent(), notify->source, kCFRunLoopDefaultMode);
+    CFRelease(notify->source);
+    free(notify);
+}
+
+CFRunLoopSourceRef IONotificationPortGetRunLoopSource(IONotificationPortRef notify) { return notify->source; }
+
+kern_return_t IOServiceAddMatchingNotification(IONotificationPortRef notifyPort, const char *notificationType,
+                                               CFDictionaryRef matching, IOServiceMatchingCallback callback,
+                                               void *refCon, io_iterator_t *notification) {
+    if (!notifyPort || !matching) return kIOReturnBadArgument;
+    notifications = realloc(notifications, sizeof(*notifications) * (notificationCount + 1));
+    Notification *n = &notifications[notificationCount++];
+    memset(n, 0, sizeof(*n));
+    n->port = notifyPort;
+    n->terminated = strcmp(notificationType, kIOTerminatedNotification) == 0;
+    n->matching = matching; // Consumed, as in IOKit.
+    n->callback = callback;
+    n->refCon = refCon;
+    n->iterator = io_new(IO_KIND_ITERATOR);
+    IOObjectRetain(n->iterator);
+    if (!n->terminated) {
+        for (size_t h = 1; h < objectCap; h++) {
+            IOObject *obj = objects[h];
+            if (obj && obj->kind == IO_KIND_SERVICE && obj->present && service_matches(obj, matching)) {
+                iterator_push(n->iterator, (io_object_t)h);
+            }
+        }
+    }
+    *notification = n->iterator;
+    return KERN_SUCCESS;
+}
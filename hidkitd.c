@@ -1,53 +1,3791 @@
+#ifndef __APPLE__
+#define _GNU_SOURCE   // struct ucred, for the control socket's peer check.
+#endif
+
 #include <CoreFoundation/CoreFoundation.h>
 #include <IOKit/IOKitLib.h>
+#include <IOKit/hid/IOHIDDevice.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __APPLE__
+#include <sys/sysctl.h>
+#endif
+
+extern char **environ;
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0   // macOS uses SO_NOSIGPIPE on the socket instead.
+#endif
+
+// Relative importance of a rule's actions when the daemon is overloaded.
+typedef enum {
+    PRIORITY_NORMAL = 0,
+    PRIORITY_LOW,
+    PRIORITY_HIGH,
+} ActionPriority;
+
+typedef struct Condition Condition;
+typedef struct PortNode PortNode;
+
+// A set of numeric filter values as sorted, disjoint, non-adjacent ranges.
+typedef struct {
+    long low;
+    long high;
+} NumericRange;
+
+typedef struct {
+    NumericRange *ranges;
+    size_t count, capacity;
+} NumericSet;
+
+#define MAX_ATTRIBUTES 16
+
+// An --attr predicate: a registry property that must have a given value.
+typedef struct {
+    int attribute;   // Index into the attribute name table.
+    const char *value;
+} AttributeFilter;
+
+#define MAX_REPORTS 16
+#define MAX_REPORT_BYTES 64
+
+// A --set-report action: one output or feature report written on connect.
+typedef struct {
+    int feature;                            // Feature report, read back; otherwise output.
+    long reportID;                          // 0 for a device without report IDs.
+    uint8_t bytes[MAX_REPORT_BYTES + 1];    // Led by the ID byte when reportID is set.
+    long length;
+    const char *spec;
+} ReportWrite;
+
+// This struct will hold our parsed command-line arguments.
+typedef struct {
+    long vendorID;              // Single values, matched by IOKit; 0 if unset.
+    long productID;
+    long usagePage;
+    long usage;
+    NumericSet vendorIDs;       // Ranges and sets, matched by the daemon.
+    NumericSet productIDs;
+    NumericSet usagePages;
+    NumericSet usages;
+    const char *productName;
+    const char *deviceAddress;
+    PortNode *ports;            // --port patterns; NULL when not filtering on topology.
+    int portCount;
+    long portLocationID;        // Set when the only pattern names one exact port.
+    const char *onConnectScript;
+    const char *onDisconnectScript;
+    uint64_t onConnectKey;      // action_key() of each script.
+    uint64_t onDisconnectKey;
+    ActionPriority priority;
+    long maxEventRate;
+    long maxSpawnRate;
+    const char *onOverloadScript;
+    const char *condition;
+    Condition *compiledCondition;
+    AttributeFilter attributeFilters[MAX_ATTRIBUTES];
+    int attributeFilterCount;
+    ReportWrite reports[MAX_REPORTS];   // Written in order on connect.
+    int reportCount;
+    const char *rulesPath;
+    int ruleThreads;
+    const char *controlSocketPath;
+    const char *rollupExportPath;
+    long rollupExportSeconds;
+} AppConfig;
+
+// Degradation levels of the overload controller, from normal operation to
+// only counting events. Each level keeps the behavior of the ones below it.
+typedef enum {
+    LEVEL_NORMAL = 0,   // Every event runs its action.
+    LEVEL_COALESCE,     // A burst of events delivered together runs its action once.
+    LEVEL_SHED_LOW,     // Low-priority actions are dropped.
+    LEVEL_COUNT_ONLY,   // Events are counted; only high-priority actions still run.
+    LEVEL_COUNT
+} OverloadLevel;
+
+static const char *const levelNames[LEVEL_COUNT] = { "normal", "coalesce", "shed-low", "count-only" };
+
+#define OVERLOAD_TICK_SECONDS 1.0
+#define OVERLOAD_RECOVERY_TICKS 5   // Calm ticks required before stepping down one level.
+#define DEFAULT_MAX_EVENT_RATE 20   // Events per second before coalescing starts.
+#define DEFAULT_MAX_SPAWN_RATE 10   // Script launches per second before coalescing starts.
+#define MAX_PENDING_ACTIONS 64      // Distinct scripts one degraded callback can defer.
+
+// Signals the overload controller watches, accumulated over one tick.
+typedef struct {
+    OverloadLevel level;
+    double windowStart;
+    long eventsInWindow;
+    long spawnsInWindow;
+    long burstDepth;      // Events delivered by the current notification callback.
+    long maxBurstDepth;   // Largest callback backlog seen this window.
+    double loopLagMs;     // How late the last tick fired.
+    double nextTick;
+    int calmTicks;
+    unsigned long transitions;
+    unsigned long coalescedEvents;
+    unsigned long droppedActions;
+    struct {
+        const char *scriptPath;
+        long events;
+        uint64_t correlation;   // The first event that wanted it.
+        ActionPriority priority;   // The highest of the rules that wanted it.
+    } pending[MAX_PENDING_ACTIONS];   // Actions deferred by the current callback.
+    int pendingCount;
+    int hookPending;      // A level change the --on-overload hook has not been told about.
+    pid_t hookPid;        // The running hook, 0 if none.
+} OverloadState;
+
+static OverloadState overload;
+
+// Lifetime totals, exported by the control socket's metrics command.
+static struct {
+    unsigned long connects;
+    unsigned long disconnects;
+    unsigned long spawns;
+    double startupSeconds;   // From exec until the last startup step that can fail.
+} counters;
+
+// --- Memory accounting ------------------------------------------------------
+//
+// The daemon allocates through these wrappers, tagged with the subsystem
+// that owns each block, so the metrics show where its memory goes. A header
+// in front of every block keeps its size and tag. Counters are relaxed
+// atomics because rule workers allocate too.
+
+typedef enum {
+    MEM_REGISTRY,
+    MEM_CONDITIONS,
+    MEM_RULES,
+    MEM_ROLLUPS,
+    MEM_DBUS,
+    MEM_ACTIONS,
+    MEM_OTHER,
+    MEM_TAG_COUNT
+} MemTag;
+
+static const char *const memTagNames[MEM_TAG_COUNT] = {
+    "registry", "conditions", "rules", "rollups", "dbus", "actions", "other"
+};
+
+static struct {
+    size_t live;
+    size_t peak;
+    unsigned long allocations;
+} memStats[MEM_TAG_COUNT];
+
+typedef union {
+    struct {
+        size_t size;
+        MemTag tag;
+    } info;
+    max_align_t align;
+} MemHeader;
+
+static void mem_account(MemTag tag, size_t added, size_t removed) {
+    size_t live = __atomic_add_fetch(&memStats[tag].live, added - removed, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&memStats[tag].allocations, 1, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&memStats[tag].peak, __ATOMIC_RELAXED);
+    while (live > peak && !__atomic_compare_exchange_n(&memStats[tag].peak, &peak, live, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// realloc() for tagged blocks. A block stays charged to the tag it was
+// first allocated with.
+static void *mem_realloc(MemTag tag, void *p, size_t size) {
+    MemHeader *header = p ? (MemHeader *)p - 1 : NULL;
+    size_t old = header ? header->info.size : 0;
+    if (header) tag = header->info.tag;
+    header = realloc(header, sizeof(MemHeader) + size);
+    if (!header) return NULL;
+    header->info.size = size;
+    header->info.tag = tag;
+    mem_account(tag, size, old);
+    return header + 1;
+}
+
+static void *mem_alloc(MemTag tag, size_t size) {
+    return mem_realloc(tag, NULL, size);
+}
+
+static void *mem_calloc(MemTag tag, size_t count, size_t size) {
+    if (size && count > SIZE_MAX / size) return NULL;
+    void *p = mem_alloc(tag, count * size);
+    if (p) memset(p, 0, count * size);
+    return p;
+}
+
+static void mem_free(void *p) {
+    if (!p) return;
+    MemHeader *header = (MemHeader *)p - 1;
+    __atomic_fetch_sub(&memStats[header->info.tag].live, header->info.size, __ATOMIC_RELAXED);
+    free(header);
+}
+
+static char *mem_strndup(MemTag tag, const char *s, size_t n) {
+    size_t len = strnlen(s, n);
+    char *copy = mem_alloc(tag, len + 1);
+    if (!copy) return NULL;
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+static char *mem_strdup(MemTag tag, const char *s) {
+    return mem_strndup(tag, s, strlen(s));
+}
+
+// --- Clock and timers -------------------------------------------------------
+//
+// Everything time-dependent reads the clock and schedules work through
+// here. Normally that is the system clock and run-loop timers; under
+// --simulate the clock is virtual and timers fire when a trace advances it.
+
+#define MAX_TIMERS 8
+
+typedef struct {
+    CFRunLoopTimerCallBack callback;
+    void *info;
+    double interval;         // 0 for a timer that only fires when armed.
+    int armed;               // Virtual clock: whether `due` is pending.
+    double due;
+    CFRunLoopTimerRef cf;    // Real clock.
+} DaemonTimer;
+
+static struct {
+    int isVirtual;
+    double now;              // Virtual time, in seconds since the Unix epoch.
+    DaemonTimer timers[MAX_TIMERS];
+    int timerCount;
+} daemonClock;
+
+// Seconds on a monotonic clock, for rates and intervals.
+static double now_seconds(void) {
+    if (daemonClock.isVirtual) return daemonClock.now;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// A cheap, unscaled timestamp for sampling short code paths: the cycle
+// counter where there is one. Convert with ticks_per_ns().
+static uint64_t cheap_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    uint64_t ticks;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+// Measured once, against the monotonic clock over 10 ms.
+static double ticks_per_ns(void) {
+    static double ratio;
+    if (ratio > 0) return ratio;
+    struct timespec a, b;
+    clock_gettime(CLOCK_MONOTONIC, &a);
+    uint64_t start = cheap_ticks();
+    double elapsed;
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &b);
+        elapsed = (double)(b.tv_sec - a.tv_sec) * 1e9 + (double)(b.tv_nsec - a.tv_nsec);
+    } while (elapsed < 1e7);
+    ratio = (double)(cheap_ticks() - start) / elapsed;
+    return ratio;
+}
+
+// Calendar time, for rollup buckets and time-of-day conditions.
+static time_t wall_time(void) {
+    return daemonClock.isVirtual ? (time_t)daemonClock.now : time(NULL);
+}
+
+// Calls `callback` after `first` seconds and then every `interval` seconds,
+// or, with an interval of 0, only whenever timer_arm() asks for it.
+static DaemonTimer *timer_add(double first, double interval, CFRunLoopTimerCallBack callback, void *info) {
+    if (daemonClock.timerCount == MAX_TIMERS) return NULL;
+    DaemonTimer *t = &daemonClock.timers[daemonClock.timerCount++];
+    *t = (DaemonTimer){ callback, info, interval, interval > 0, now_seconds() + first, NULL };
+    if (daemonClock.isVirtual) return t;
+    if (interval <= 0) first = interval = 1e9;   // Parked until armed.
+    CFRunLoopTimerContext context = { 0, info, NULL, NULL, NULL };
+    t->cf = CFRunLoopTimerCreate(kCFAllocatorDefault, CFAbsoluteTimeGetCurrent() + first, interval, 0, 0, callback, &context);
+    CFRunLoopAddTimer(CFRunLoopGetCurrent(), t->cf, kCFRunLoopDefaultMode);
+    return t;
+}
+
+// (Re)schedules the next call of `t` to `delay` seconds from now.
+static void timer_arm(DaemonTimer *t, double delay) {
+    if (daemonClock.isVirtual) {
+        t->armed = 1;
+        t->due = daemonClock.now + delay;
+    } else {
+        CFRunLoopTimerSetNextFireDate(t->cf, CFAbsoluteTimeGetCurrent() + delay);
+    }
+}
+
+// Moves the virtual clock to `until`, firing every timer due on the way in
+// time order (ties in creation order).
+static void clock_advance(double until) {
+    for (;;) {
+        DaemonTimer *next = NULL;
+        for (int i = 0; i < daemonClock.timerCount; i++) {
+            DaemonTimer *t = &daemonClock.timers[i];
+            if (t->armed && t->due <= until && (!next || t->due < next->due)) next = t;
+        }
+        if (!next) break;
+        if (next->due > daemonClock.now) daemonClock.now = next->due;
+        if (next->interval > 0) next->due += next->interval;
+        else next->armed = 0;
+        next->callback(NULL, next->info);
+    }
+    if (until > daemonClock.now) daemonClock.now = until;
+}
+
+// --- Correlation IDs --------------------------------------------------------
+//
+// Each event gets a 64-bit ID as it is read from IOKit. The ID follows the
+// event's actions through overload deferral and the write-ahead log, reaches
+// their scripts as $HIDKITD_CORRELATION_ID and is stamped on the event's log
+// lines, flight records and exemplars. Events are only ever read on the run
+// loop thread, so the generator is that thread's plain counter: no lock, no
+// atomic, no syscall. The high half is seeded once from the start time and
+// pid so IDs stay distinct across restarts and upgrades; simulations count
+// from 0 so their output is reproducible.
+
+static struct {
+    uint64_t last;
+} correlation;
+
+static void correlation_seed(void) {
+    uint32_t seed = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16);
+    // Below 2^63, so the flight dump's signed formatter prints it as is.
+    correlation.last = (uint64_t)(seed & 0x7fffffff) << 32;
+}
+
+static uint64_t correlation_next(void) {
+    return ++correlation.last;
+}
+
+// --- Flight recorder --------------------------------------------------------
+//
+// The last FLIGHT_RECORDS events are always kept in a fixed ring, in full:
+// device properties, condition and rule decisions, and each action's pid,
+// exit status and duration. Writing a record is a few stores and two short
+// copies. The ring is dumped to a file on SIGUSR1, by the `flight` control
+// command and from the crash handler, so the dump is formatted with
+// async-signal-safe calls only (no stdio, no allocation).
+
+#define FLIGHT_RECORDS 1024
+#define FLIGHT_TEXT 64
+
+typedef enum {
+    FLIGHT_CONNECT,
+    FLIGHT_DISCONNECT,
+    FLIGHT_SKIPPED,      // Condition or attribute filter failed; text: why.
+    FLIGHT_RULE,         // text: the rule's pattern.
+    FLIGHT_DEFERRED,     // Held back by overload handling; text: script.
+    FLIGHT_ACTION,       // text: script.
+    FLIGHT_REPORT,       // text: the --set-report spec.
+} FlightKind;
+
+static const char *const flightKindNames[] = { "connect", "disconnect", "skipped", "rule", "deferred", "action", "report" };
+
+typedef struct {
+    int64_t timeUs;             // Wall clock (virtual under --simulate).
+    uint64_t event;             // Correlation ID of its event; 0 outside events.
+    FlightKind kind;
+    union {
+        struct { long vendorID, productID, usagePage, usage, locationID; } device;
+        struct { int index, ran; } rule;
+        struct { int pid, status; int64_t durationUs; } action;   // pid 0: not started.
+        struct { int result, readBack; int64_t durationUs; } report;   // readBack: 0 none, 1 same, 2 differed.
+    };
+    char text[2][FLIGHT_TEXT];  // Connect/disconnect: serial and product.
+} FlightRecord;
+
+static struct {
+    FlightRecord records[FLIGHT_RECORDS];
+    unsigned long next;         // Records written so far.
+    uint64_t event;             // Correlation ID of the current event.
+    int64_t timeUs;             // Stamped at each event and action, not per record.
+    char path[PATH_MAX];
+} flight;
+
+static int64_t flight_clock_us(void) {
+    if (daemonClock.isVirtual) return (int64_t)(daemonClock.now * 1e6);
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Claims the next slot, overwriting the oldest record once the ring is full.
+// Records carry the time of the last flight_stamp(): reading the clock costs
+// more than the rest of a record, and decisions share their event's time.
+static FlightRecord *flight_next(FlightKind kind) {
+    FlightRecord *record = &flight.records[flight.next++ % FLIGHT_RECORDS];
+    record->timeUs = flight.timeUs;
+    record->event = flight.event;
+    record->kind = kind;
+    record->text[0][0] = record->text[1][0] = '\0';
+    return record;
+}
+
+static void flight_copy(char *dst, const char *src) {
+    size_t i = 0;
+    if (src) {
+        for (; i < FLIGHT_TEXT - 1 && src[i]; i++) dst[i] = src[i];
+    }
+    dst[i] = '\0';
+}
+
+// Async-signal-safe line formatting for the dump.
+typedef struct {
+    char data[512];
+    size_t length;
+} FlightLine;
+
+static void flight_put(FlightLine *line, const char *s) {
+    while (*s && line->length < sizeof(line->data)) line->data[line->length++] = *s++;
+}
+
+static void flight_put_number(FlightLine *line, int64_t value, int base, int minDigits) {
+    char digits[24];
+    int n = 0;
+    uint64_t v = value < 0 ? -(uint64_t)value : (uint64_t)value;
+    do {
+        digits[n++] = "0123456789abcdef"[v % base];
+        v /= base;
+    } while (v || n < minDigits);
+    if (value < 0) digits[n++] = '-';
+    while (n > 0 && line->length < sizeof(line->data)) line->data[line->length++] = digits[--n];
+}
+
+static void flight_put_field(FlightLine *line, const char *name, int64_t value) {
+    flight_put(line, name);
+    flight_put_number(line, value, 10, 1);
+}
+
+static void flight_format(FlightLine *line, const FlightRecord *record) {
+    line->length = 0;
+    flight_put_number(line, record->timeUs / 1000000, 10, 1);
+    flight_put(line, ".");
+    flight_put_number(line, record->timeUs % 1000000, 10, 6);
+    flight_put(line, " #");
+    flight_put_number(line, (int64_t)record->event, 16, 16);
+    flight_put(line, " ");
+    flight_put(line, flightKindNames[record->kind]);
+    switch (record->kind) {
+    case FLIGHT_CONNECT:
+    case FLIGHT_DISCONNECT:
+        flight_put_field(line, " vid=", record->device.vendorID);
+        flight_put_field(line, " pid=", record->device.productID);
+        flight_put_field(line, " page=", record->device.usagePage);
+        flight_put_field(line, " usage=", record->device.usage);
+        flight_put(line, " location=0x");
+        flight_put_number(line, record->device.locationID, 16, 1);
+        flight_put(line, " serial=\"");
+        flight_put(line, record->text[0]);
+        flight_put(line, "\" product=\"");
+        flight_put(line, record->text[1]);
+        flight_put(line, "\"");
+        break;
+    case FLIGHT_RULE:
+        flight_put_field(line, " ", record->rule.index);
+        flight_put(line, record->rule.ran ? " ran " : " deduplicated ");
+        flight_put(line, record->text[0]);
+        break;
+    case FLIGHT_ACTION:
+        flight_put_field(line, " pid=", record->action.pid);
+        if (record->action.pid > 0 && WIFEXITED(record->action.status)) {
+            flight_put_field(line, " exit=", WEXITSTATUS(record->action.status));
+        } else if (record->action.pid > 0 && WIFSIGNALED(record->action.status)) {
+            flight_put_field(line, " signal=", WTERMSIG(record->action.status));
+        }
+        flight_put_field(line, " duration_us=", record->action.durationUs);
+        flight_put(line, " ");
+        flight_put(line, record->text[0]);
+        break;
+    case FLIGHT_REPORT:
+        flight_put(line, " result=0x");
+        flight_put_number(line, (uint32_t)record->report.result, 16, 8);
+        if (record->report.readBack) flight_put(line, record->report.readBack == 1 ? " verified" : " mismatch");
+        flight_put_field(line, " duration_us=", record->report.durationUs);
+        flight_put(line, " ");
+        flight_put(line, record->text[0]);
+        break;
+    default:
+        flight_put(line, " ");
+        flight_put(line, record->text[0]);
+        break;
+    }
+    flight_put(line, "\n");
+}
+
+// Writes one dump line to `out`, or to `fd` without one; returns 0 on error.
+static int flight_emit(int fd, FILE *out, const FlightLine *line) {
+    if (out) return fwrite(line->data, 1, line->length, out) == line->length;
+    return write(fd, line->data, line->length) >= 0;
+}
+
+// Writes the ring to `out` (the control command's reply) or, without one, to
+// `fd`, oldest record first. Safe in a signal handler when writing to `fd`.
+static void flight_dump(int fd, FILE *out) {
+    unsigned long end = flight.next;
+    unsigned long begin = end > FLIGHT_RECORDS ? end - FLIGHT_RECORDS : 0;
+    FlightLine line = { .length = 0 };
+    flight_put(&line, "hidkitd flight recorder: pid ");
+    flight_put_number(&line, getpid(), 10, 1);
+    flight_put_field(&line, ", ", (int64_t)(end - begin));
+    flight_put_field(&line, " of ", (int64_t)end);
+    flight_put(&line, " records\n");
+    if (!flight_emit(fd, out, &line)) return;
+    for (unsigned long i = begin; i < end; i++) {
+        flight_format(&line, &flight.records[i % FLIGHT_RECORDS]);
+        if (!flight_emit(fd, out, &line)) return;
+    }
+}
+
+// Dumps to `path`; returns 0 if it cannot be written. Safe in a signal handler.
+// The default path is predictable and the daemon may run as root, so the
+// old dump (or whatever was planted there) is unlinked and a new file is
+// created exclusively: a symlink or hard link at `path` is never followed.
+static int flight_dump_file(const char *path) {
+    unlink(path);
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd < 0) return 0;
+    flight_dump(fd, NULL);
+    close(fd);
+    return 1;
+}
+
+static void flight_on_signal(int sig) {
+    int saved = errno;
+    int written = flight_dump_file(flight.path);
+    if (sig != SIGUSR1) {
+        // Crash: say where the dump went, then die of the same signal (the
+        // handler was reset on entry).
+        FlightLine line = { .length = 0 };
+        flight_put_field(&line, "DAEMON_ERROR: Fatal signal ", sig);
+        flight_put(&line, written ? "; flight recorder written to " : "; cannot write flight recorder to ");
+        flight_put(&line, flight.path);
+        flight_put(&line, ".\n");
+        if (write(STDERR_FILENO, line.data, line.length) < 0) {}
+        raise(sig);
+    }
+    errno = saved;
+}
+
+// Sets where dumps go (default /tmp/hidkitd-flight.<pid>) and installs the
+// SIGUSR1 and crash handlers. Crashes are handled on an alternate stack so
+// that a stack overflow still produces a dump.
+static void flight_start(const char *path) {
+    static char altStack[64 * 1024];
+    if (path) snprintf(flight.path, sizeof(flight.path), "%s", path);
+    else snprintf(flight.path, sizeof(flight.path), "/tmp/hidkitd-flight.%ld", (long)getpid());
+    stack_t stack = { .ss_sp = altStack, .ss_size = sizeof(altStack) };
+    sigaltstack(&stack, NULL);
+    struct sigaction action = { .sa_handler = flight_on_signal, .sa_flags = SA_RESTART };
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, NULL);
+    action.sa_flags = SA_RESETHAND | SA_ONSTACK;
+    const int fatal[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+    for (size_t i = 0; i < sizeof(fatal) / sizeof(fatal[0]); i++) sigaction(fatal[i], &action, NULL);
+}
+
+// --- Event latency ----------------------------------------------------------
+//
+// Every event's handling time, from its IOKit callback to its actions having
+// run, goes into a histogram. An event slower than --exemplar-threshold also
+// leaves an exemplar in its bucket: the device, the rules that matched and
+// where the time went (waiting behind earlier events of the same callback,
+// spawning, running actions). The exemplar carries the flight recorder's
+// event number, so a slow bucket leads to a concrete event and its history.
+// A normal event costs a bucket increment and a handful of stores.
+
+#define LATENCY_BUCKETS 13          // The last one is +Inf.
+#define EXEMPLARS_PER_BUCKET 4
+#define EXEMPLAR_RULES 4
+#define DEFAULT_EXEMPLAR_THRESHOLD_MS 50
+
+static const double latencyBounds[LATENCY_BUCKETS - 1] = {
+    0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5,
+};
+
+typedef struct {
+    uint64_t event;                 // Correlation ID.
+    int64_t timeUs;                 // Wall clock at the start of the event.
+    int connected;
+    double latency, queueWait, spawn, action;
+    long vendorID, productID, locationID;
+    char serial[FLIGHT_TEXT];
+    char product[FLIGHT_TEXT];
+    int ruleCount;                  // Rules matched; the first EXEMPLAR_RULES are listed.
+    int rules[EXEMPLAR_RULES];
+} Exemplar;
+
+static struct {
+    unsigned long counts[LATENCY_BUCKETS];
+    double sum;
+    double thresholdSeconds;
+    Exemplar exemplars[LATENCY_BUCKETS][EXEMPLARS_PER_BUCKET];
+    unsigned long captured[LATENCY_BUCKETS];   // The newest EXEMPLARS_PER_BUCKET are kept.
+    // The event being handled.
+    int active;
+    double batchStart;              // Start of the current callback, 0 outside one.
+    double start, spawn, action;
+    int ruleCount;
+    int rules[EXEMPLAR_RULES];
+    double stageSums[3];            // Queue wait, spawn and action time over all events.
+} latency = { .thresholdSeconds = DEFAULT_EXEMPLAR_THRESHOLD_MS / 1000.0 };
+
+static int latency_bucket(double seconds) {
+    int b = 0;
+    while (b < LATENCY_BUCKETS - 1 && seconds > latencyBounds[b]) b++;
+    return b;
+}
+
+// --- Kernel delivery --------------------------------------------------------
+//
+// How long an event took from the kernel to the notification callback. IOKit
+// does not say when the kernel sent an event, so this only exists in stand-in
+// builds, where the Linux uevent socket stamps each message in the kernel
+// (SO_TIMESTAMPNS) and numbers it (SEQNUM), which also gives a count of the
+// events the socket dropped. The stand-in fills the histogram itself as it
+// hands each batch to a callback; the callbacks know nothing of it.
+
+#ifdef HIDKITD_STANDIN
+#define DELIVERY_BUCKETS 12         // The last one is +Inf.
+
+static const double deliveryBounds[DELIVERY_BUCKETS - 1] = {
+    0.00001, 0.000025, 0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.01, 0.1, 1,
+};
+
+static struct {
+    unsigned long counts[DELIVERY_BUCKETS];
+    double sum;
+} delivery;
+#endif
+
+// The environment for a spawned script: the daemon's own, minus `name`, plus
+// `entry` ("name=value") if given. The strings are shared with environ, so
+// only the array is freed. The daemon's environment itself is never changed,
+// so one script's variables cannot leak into the next spawn. NULL if out of
+// memory.
+static char **spawn_environment(const char *name, char *entry) {
+    size_t count = 0, length = strlen(name);
+    while (environ[count]) count++;
+    char **envp = mem_alloc(MEM_ACTIONS, (count + 2) * sizeof(*envp));
+    if (!envp) return NULL;
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (strncmp(environ[i], name, length) != 0 || environ[i][length] != '=') envp[n++] = environ[i];
+    }
+    if (entry) envp[n++] = entry;
+    envp[n] = NULL;
+    return envp;
+}
+
+// A simple function to run a user-provided script.
+// `correlation` is the ID of the event the script acts on, 0 for none.
+void run_script(const char *scriptPath, uint64_t correlation) {
+    if (!scriptPath) return; // Do nothing if the script path is not provided
+    char command[2048];
+    snprintf(command, sizeof(command), "\"%s\"", scriptPath);
+    if (correlation) printf("DAEMON: Executing command: %s [%016llx]\n", command, (unsigned long long)correlation);
+    else printf("DAEMON: Executing command: %s\n", command);
+    fflush(stdout);
+    overload.spawnsInWindow++;
+    counters.spawns++;
+    flight.timeUs = flight_clock_us();
+    FlightRecord *record = flight_next(FLIGHT_ACTION);
+    record->event = correlation;   // A deferred action runs after later events.
+    record->action.pid = 0;
+    record->action.status = 0;
+    record->action.durationUs = 0;
+    flight_copy(record->text[0], scriptPath);
+    if (daemonClock.isVirtual) return;   // Simulations only log the command.
+    // Errors carry the event's ID, like the Executing line, so they can be
+    // found from either end.
+    char tag[24] = "";
+    if (correlation) snprintf(tag, sizeof(tag), " [%016llx]", (unsigned long long)correlation);
+    char id[48];
+    snprintf(id, sizeof(id), "HIDKITD_CORRELATION_ID=%016llx", (unsigned long long)correlation);
+    char **envp = spawn_environment("HIDKITD_CORRELATION_ID", correlation ? id : NULL);
+    if (!envp) {
+        fprintf(stderr, "DAEMON_ERROR: Cannot run %s: out of memory%s.\n", scriptPath, tag);
+        return;
+    }
+    // As system(3) would, but keeping the pid for the flight recorder.
+    char *argv[] = { "sh", "-c", command, NULL };
+    pid_t pid;
+    int64_t start = flight.timeUs;
+    double spawnStart = now_seconds();
+    int err = posix_spawn(&pid, "/bin/sh", NULL, NULL, argv, envp);
+    double spawned = now_seconds();
+    mem_free(envp);
+    if (latency.active) latency.spawn += spawned - spawnStart;
+    if (err != 0) {
+        fprintf(stderr, "DAEMON_ERROR: Cannot run %s: %s%s.\n", scriptPath, strerror(err), tag);
+        return;
+    }
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+    if (latency.active) latency.action += now_seconds() - spawned;
+    if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "DAEMON_ERROR: %s exited with status %d%s.\n", scriptPath, WEXITSTATUS(status), tag);
+    } else if (WIFSIGNALED(status)) {
+        fprintf(stderr, "DAEMON_ERROR: %s was killed by signal %d%s.\n", scriptPath, WTERMSIG(status), tag);
+    }
+    record->action.pid = (int)pid;
+    record->action.status = status;
+    record->action.durationUs = flight_clock_us() - start;
+}
+
+// --- Write-ahead log --------------------------------------------------------
+//
+// With --wal, event actions are appended to a log and synced to disk before
+// any of them runs, then marked done one by one as they finish. Actions cut
+// off by a crash or power loss therefore run on the next start (at least
+// once). A single sync covers every action queued in the commit window, so
+// a burst of events pays for one sync rather than one each.
+//
+//   A <seq> <checksum> <script>    action queued
+//   D <seq>                        action finished
+
+#define MAX_WAL_BATCH 1024   // Queued actions that force a commit.
+
+static struct {
+    const char *path;
+    double windowMs;             // Extra time actions wait to share a sync.
+    int fd;
+    unsigned long seq;
+    struct {
+        unsigned long seq;
+        const char *scriptPath;
+        uint64_t correlation;
+    } batch[MAX_WAL_BATCH];
+    int batchCount;
+    char *buffer;                // Records of the batch not yet written.
+    size_t length, capacity;
+    DaemonTimer *timer;
+    unsigned long commits;
+    unsigned long records;
+    unsigned long replayed;
+    double syncSeconds;
+} wal = { .fd = -1 };
+
+// FNV-1a over the script path; rejects records torn by a crash mid-write.
+static uint32_t wal_checksum(const char *s) {
+    uint32_t h = 2166136261u;
+    while (*s) h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
+}
+
+static void wal_printf(const char *format, ...) __attribute__((format(printf, 1, 2)));
+static void wal_printf(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if (wal.length + (size_t)n + 1 > wal.capacity) {
+        size_t capacity = (wal.length + (size_t)n + 1) * 2;
+        char *buffer = mem_realloc(MEM_ACTIONS, wal.buffer, capacity);
+        if (!buffer) {
+            fprintf(stderr, "DAEMON_ERROR: Out of memory; WAL record dropped.\n");
+            return;
+        }
+        wal.buffer = buffer;
+        wal.capacity = capacity;
+    }
+    va_start(args, format);
+    vsnprintf(wal.buffer + wal.length, wal.capacity - wal.length, format, args);
+    va_end(args);
+    wal.length += (size_t)n;
+}
+
+// Writes out the buffered records.
+static int wal_write(void) {
+    size_t done = 0;
+    while (done < wal.length) {
+        ssize_t n = write(wal.fd, wal.buffer + done, wal.length - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            fprintf(stderr, "DAEMON_ERROR: Cannot write WAL %s: %s.\n", wal.path, strerror(errno));
+            wal.length = 0;
+            return 0;
+        }
+        done += (size_t)n;
+    }
+    wal.length = 0;
+    return 1;
+}
+
+// Writes the buffered records and waits until they are on stable storage.
+static int wal_sync(void) {
+    double start = now_seconds();
+    if (!wal_write()) return 0;
+#ifdef F_FULLFSYNC
+    // fsync() on macOS stops at the drive's cache.
+    if (fcntl(wal.fd, F_FULLFSYNC) == 0) {
+        wal.syncSeconds += now_seconds() - start;
+        wal.commits++;
+        return 1;
+    }
+#endif
+    if (fsync(wal.fd) != 0) {
+        fprintf(stderr, "DAEMON_ERROR: Cannot sync WAL %s: %s.\n", wal.path, strerror(errno));
+        return 0;
+    }
+    wal.syncSeconds += now_seconds() - start;
+    wal.commits++;
+    return 1;
+}
+
+// Makes the queued actions durable, runs them and empties the log. If the
+// log cannot be written the actions still run, without the guarantee.
+static void wal_commit(void) {
+    if (wal.batchCount == 0) return;
+    wal_sync();
+    for (int i = 0; i < wal.batchCount; i++) {
+        run_script(wal.batch[i].scriptPath, wal.batch[i].correlation);
+        // Not synced: losing it only repeats the action after a crash.
+        wal_printf("D %lu\n", wal.batch[i].seq);
+        wal_write();
+    }
+    wal.batchCount = 0;
+    if (ftruncate(wal.fd, 0) != 0) {
+        fprintf(stderr, "DAEMON_ERROR: Cannot truncate WAL %s: %s.\n", wal.path, strerror(errno));
+    }
+}
+
+static void walCommitTick(CFRunLoopTimerRef timer, void *info) {
+    (void)timer;
+    (void)info;
+    wal_commit();
+}
+
+// Appends an action to the current batch. Without a commit window the batch
+// is committed at the end of the notification callback.
+static void wal_queue(const char *scriptPath, uint64_t correlation) {
+    if (wal.batchCount == MAX_WAL_BATCH) wal_commit();
+    if (wal.batchCount == 0 && wal.timer) {
+        timer_arm(wal.timer, wal.windowMs / 1000.0);
+    }
+    unsigned long seq = ++wal.seq;
+    wal_printf("A %lu %08x %s\n", seq, wal_checksum(scriptPath), scriptPath);
+    wal.batch[wal.batchCount].seq = seq;
+    wal.batch[wal.batchCount].correlation = correlation;
+    wal.batch[wal.batchCount++].scriptPath = scriptPath;
+    wal.records++;
+}
+
+// Runs one event action, through the write-ahead log when it is enabled.
+static void run_action(const char *scriptPath, uint64_t correlation) {
+    if (wal.fd < 0) run_script(scriptPath, correlation);
+    else wal_queue(scriptPath, correlation);
+}
+
+// Reads the log left by the previous run, keeping actions that were queued
+// but never finished, in order. Returns how many were found.
+static size_t wal_read_unfinished(FILE *in, char ***scripts) {
+    unsigned long *seqs = NULL;
+    size_t count = 0, capacity = 0;
+    char *line = NULL;   // Grown by getline, so long script paths are read whole.
+    size_t lineCapacity = 0;
+    ssize_t read;
+    *scripts = NULL;
+    while ((read = getline(&line, &lineCapacity, in)) > 0) {
+        size_t len = (size_t)read;
+        if (line[len - 1] != '\n') break;   // Torn final record.
+        line[len - 1] = '\0';
+        unsigned long seq;
+        unsigned int checksum;
+        int offset = 0;
+        if (sscanf(line, "A %lu %8x %n", &seq, &checksum, &offset) == 2 && offset > 0) {
+            const char *script = line + offset;
+            if (wal_checksum(script) != checksum) break;
+            if (count == capacity) {
+                size_t grown = capacity ? capacity * 2 : 16;
+                unsigned long *moreSeqs = mem_realloc(MEM_ACTIONS, seqs, grown * sizeof(*seqs));
+                if (moreSeqs) seqs = moreSeqs;
+                char **moreScripts = moreSeqs ? mem_realloc(MEM_ACTIONS, *scripts, grown * sizeof(**scripts)) : NULL;
+                if (!moreScripts) {
+                    fprintf(stderr, "DAEMON_ERROR: Out of memory reading the WAL; later records ignored.\n");
+                    break;
+                }
+                *scripts = moreScripts;
+                capacity = grown;
+            }
+            char *copy = mem_strdup(MEM_ACTIONS, script);
+            if (!copy) break;
+            seqs[count] = seq;
+            (*scripts)[count++] = copy;
+        } else if (sscanf(line, "D %lu", &seq) == 1) {
+            for (size_t i = 0; i < count; i++) {
+                if (seqs[i] != seq) continue;
+                mem_free((*scripts)[i]);
+                memmove(&seqs[i], &seqs[i + 1], (count - i - 1) * sizeof(*seqs));
+                memmove(&(*scripts)[i], &(*scripts)[i + 1], (count - i - 1) * sizeof(**scripts));
+                count--;
+                break;
+            }
+        }
+    }
+    free(line);
+    mem_free(seqs);
+    return count;
+}
+
+// Opens the log, first replaying whatever the previous run left unfinished.
+static int wal_open(void) {
+    FILE *in = fopen(wal.path, "r");
+    if (in) {
+        char **scripts;
+        size_t count = wal_read_unfinished(in, &scripts);
+        fclose(in);
+        if (count > 0) {
+            printf("DAEMON: Replaying %zu unfinished action(s) from %s.\n", count, wal.path);
+            fflush(stdout);
+        }
+        for (size_t i = 0; i < count; i++) {
+            run_script(scripts[i], 0);   // The log does not keep IDs.
+            mem_free(scripts[i]);
+        }
+        mem_free(scripts);
+        wal.replayed += count;
+    }
+    wal.fd = open(wal.path, O_WRONLY | O_CREAT | O_APPEND | O_TRUNC, 0600);
+    if (wal.fd < 0) {
+        fprintf(stderr, "DAEMON_ERROR: Cannot open WAL %s: %s.\n", wal.path, strerror(errno));
+        return 0;
+    }
+    fcntl(wal.fd, F_SETFD, FD_CLOEXEC);
+    if (wal.windowMs > 0) wal.timer = timer_add(0, 0, walCommitTick, NULL);
+    return 1;
+}
+
+// Maps a signal onto the level it calls for, given the threshold that starts
+// coalescing. Shedding starts at 5x and count-only at 25x that threshold.
+static OverloadLevel level_for(double value, double coalesceAt) {
+    if (coalesceAt <= 0) return LEVEL_NORMAL;
+    if (value >= coalesceAt * 25) return LEVEL_COUNT_ONLY;
+    if (value >= coalesceAt * 5) return LEVEL_SHED_LOW;
+    if (value >= coalesceAt) return LEVEL_COALESCE;
+    return LEVEL_NORMAL;
+}
+
+// The level the current window's signals call for. `scale` lowers the
+// thresholds, which is how recovery applies hysteresis.
+static OverloadLevel overload_pressure(const AppConfig *config, double elapsed, double scale) {
+    if (elapsed < OVERLOAD_TICK_SECONDS) elapsed = OVERLOAD_TICK_SECONDS;
+    OverloadLevel want = level_for(overload.eventsInWindow / elapsed, config->maxEventRate * scale);
+    OverloadLevel l = level_for(overload.spawnsInWindow / elapsed, config->maxSpawnRate * scale);
+    if (l > want) want = l;
+    l = level_for(overload.maxBurstDepth, 32 * scale);
+    if (l > want) want = l;
+    l = level_for(overload.loopLagMs, 200 * scale);
+    if (l > want) want = l;
+    return want;
+}
+
+static void overload_set_level(const AppConfig *config, OverloadLevel level) {
+    if (level == overload.level) return;
+    printf("DAEMON: Overload level %s -> %s (events=%ld spawns=%ld depth=%ld lag=%.0fms).\n",
+           levelNames[overload.level], levelNames[level], overload.eventsInWindow, overload.spawnsInWindow,
+           overload.maxBurstDepth, overload.loopLagMs);
+    fflush(stdout);
+    overload.level = level;
+    overload.transitions++;
+    overload.calmTicks = 0;
+    overload.hookPending = config->onOverloadScript != NULL;
+}
+
+// Tells the --on-overload hook about the current level, once the callback or
+// tick that changed it is done. The hook runs detached, with the level in its
+// own environment only, and is reaped by the tick; a level change while it
+// still runs is passed on when it has exited. It is not an event action, so
+// it does not count as a spawn.
+static void overload_run_hook(const AppConfig *config) {
+    if (overload.hookPid > 0 && waitpid(overload.hookPid, NULL, WNOHANG) != 0) overload.hookPid = 0;
+    if (!overload.hookPending || overload.hookPid > 0) return;
+    overload.hookPending = 0;
+    char command[2048];
+    snprintf(command, sizeof(command), "\"%s\"", config->onOverloadScript);
+    printf("DAEMON: Executing command: %s (level %s)\n", command, levelNames[overload.level]);
+    fflush(stdout);
+    if (daemonClock.isVirtual) return;   // Simulations only log the command.
+    char level[64];
+    snprintf(level, sizeof(level), "HIDKITD_OVERLOAD_LEVEL=%s", levelNames[overload.level]);
+    char **envp = spawn_environment("HIDKITD_OVERLOAD_LEVEL", level);
+    if (!envp) return;
+    char *argv[] = { "sh", "-c", command, NULL };
+    int err = posix_spawn(&overload.hookPid, "/bin/sh", NULL, NULL, argv, envp);
+    mem_free(envp);
+    if (err != 0) {
+        overload.hookPid = 0;
+        fprintf(stderr, "DAEMON_ERROR: Cannot run %s: %s.\n", config->onOverloadScript, strerror(err));
+    }
+}
+
+// Whether the current level drops actions of `priority`.
+static int overload_sheds(ActionPriority priority) {
+    return (overload.level >= LEVEL_SHED_LOW && priority == PRIORITY_LOW) ||
+           (overload.level >= LEVEL_COUNT_ONLY && priority != PRIORITY_HIGH);
+}
+
+static int pending_find(const char *scriptPath) {
+    for (int i = 0; i < overload.pendingCount; i++) {
+        if (strcmp(overload.pending[i].scriptPath, scriptPath) == 0) return i;
+    }
+    return -1;
+}
+
+static int priority_rank(ActionPriority priority) {
+    return priority == PRIORITY_HIGH ? 2 : priority == PRIORITY_NORMAL ? 1 : 0;
+}
+
+// A deferred action wanted again by a rule of higher priority keeps that one.
+static void pending_raise(const char *scriptPath, ActionPriority priority) {
+    int i = overload.level == LEVEL_NORMAL ? -1 : pending_find(scriptPath);
+    if (i >= 0 && priority_rank(priority) > priority_rank(overload.pending[i].priority)) overload.pending[i].priority = priority;
+}
+
+// Records one incoming event and escalates right away if the counts so far
+// already exceed a threshold; stepping down is left to the tick.
+static void overload_note_event(const AppConfig *config) {
+    overload.eventsInWindow++;
+    overload.burstDepth++;
+    if (overload.burstDepth > overload.maxBurstDepth) overload.maxBurstDepth = overload.burstDepth;
+    OverloadLevel want = overload_pressure(config, now_seconds() - overload.windowStart, 1.0);
+    if (want > overload.level) overload_set_level(config, want);
+}
+
+// Runs an event's action right away, or defers it to overload_flush when the
+// daemon is degraded so that a burst runs each distinct script only once.
+static void dispatch_action(const char *scriptPath, ActionPriority priority) {
+    if (!scriptPath) return;
+    if (overload.level == LEVEL_NORMAL) {
+        run_action(scriptPath, flight.event);
+        return;
+    }
+    flight_copy(flight_next(FLIGHT_DEFERRED)->text[0], scriptPath);
+    int i = pending_find(scriptPath);
+    if (i >= 0) {
+        overload.pending[i].events++;
+        pending_raise(scriptPath, priority);
+        return;
+    }
+    if (overload.pendingCount == MAX_PENDING_ACTIONS) {
+        overload.droppedActions++;
+        return;
+    }
+    overload.pending[overload.pendingCount].scriptPath = scriptPath;
+    overload.pending[overload.pendingCount].correlation = flight.event;
+    overload.pending[overload.pendingCount].priority = priority;
+    overload.pending[overload.pendingCount++].events = 1;
+}
+
+// Runs the actions a callback deferred because the daemon was degraded: once
+// per script for the whole burst, unless the level sheds their priority.
+static void overload_flush(const AppConfig *config) {
+    overload.burstDepth = 0;
+    for (int i = 0; i < overload.pendingCount; i++) {
+        long events = overload.pending[i].events;
+        if (overload_sheds(overload.pending[i].priority)) {
+            overload.droppedActions += events;
+            continue;
+        }
+        if (events > 1) {
+            printf("DAEMON: Coalesced %ld events into one action [%016llx].\n", events,
+                   (unsigned long long)overload.pending[i].correlation);
+            fflush(stdout);
+            overload.coalescedEvents += events - 1;
+        }
+        run_action(overload.pending[i].scriptPath, overload.pending[i].correlation);
+    }
+    overload.pendingCount = 0;
+    overload_run_hook(config);
+}
+
+// Periodic evaluation: measures event-loop lag, escalates on pressure and
+// steps down one level after enough calm ticks.
+static void overloadTick(CFRunLoopTimerRef timer, void *info) {
+    (void)timer;
+    const AppConfig *config = (const AppConfig *)info;
+    double now = now_seconds();
+    overload.loopLagMs = (now - overload.nextTick) * 1000.0;
+    if (overload.loopLagMs < 0) overload.loopLagMs = 0;
+    overload.nextTick = now + OVERLOAD_TICK_SECONDS;
+
+    double elapsed = now - overload.windowStart;
+    OverloadLevel want = overload_pressure(config, elapsed, 1.0);
+    if (want > overload.level) {
+        overload_set_level(config, want);
+    } else if (overload.level > LEVEL_NORMAL && overload_pressure(config, elapsed, 0.5) < overload.level) {
+        if (++overload.calmTicks >= OVERLOAD_RECOVERY_TICKS) overload_set_level(config, overload.level - 1);
+    } else {
+        overload.calmTicks = 0;
+    }
+    overload.windowStart = now;
+    overload.eventsInWindow = 0;
+    overload.spawnsInWindow = 0;
+    overload.maxBurstDepth = 0;
+    overload_run_hook(config);
+}
+
+#define MAX_COLLECTIONS 8            // Top-level collections kept per device.
+#define MAX_DESCRIPTOR_BYTES 4096    // HID_MAX_DESCRIPTOR_SIZE.
+
+// What the daemon knows about one device, read from the registry once when
+// it connects and kept until it disconnects. The service stays retained so
+// further attributes can be read on demand.
+typedef struct {
+    io_service_t service;
+    uint64_t entryID;
+    long vendorID;
+    long productID;
+    long usagePage;                      // The primary collection's, as IOKit reports it.
+    long usage;
+    struct { uint16_t usagePage, usage; } collections[MAX_COLLECTIONS];   // Every top-level one.
+    int collectionCount;
+    long locationID;
+    char product[128];
+    char serial[128];
+    char address[64];
+    double connectedAt;                  // now_seconds() at connect, 0 if unknown.
+    uint32_t attributesFetched;          // Bit n set once attributes[n] was read.
+    char *attributes[MAX_ATTRIBUTES];    // NULL when the property is absent.
+} DeviceRecord;
+
+// Registry property names referenced by --attr predicates and by attr() in
+// conditions. Values are only read when a predicate needs them and are then
+// cached in the DeviceRecord for the device's lifetime.
+static const char *attributeNames[MAX_ATTRIBUTES];
+static CFStringRef attributeKeys[MAX_ATTRIBUTES];
+static int attributeCount;
+
+// Devices currently connected that match the daemon's filters.
+static DeviceRecord *devices;
+static size_t deviceCount, deviceCapacity;
+
+static long get_number_property(io_service_t service, CFStringRef key) {
+    long value = 0;
+    CFTypeRef prop = IORegistryEntryCreateCFProperty(service, key, kCFAllocatorDefault, 0);
+    if (!prop) return 0;
+    if (CFGetTypeID(prop) == CFNumberGetTypeID()) CFNumberGetValue((CFNumberRef)prop, kCFNumberLongType, &value);
+    CFRelease(prop);
+    return value;
+}
+
+static void get_string_property(io_service_t service, CFStringRef key, char *buf, size_t size) {
+    buf[0] = '\0';
+    CFTypeRef prop = IORegistryEntryCreateCFProperty(service, key, kCFAllocatorDefault, 0);
+    if (!prop) return;
+    if (CFGetTypeID(prop) == CFStringGetTypeID()) CFStringGetCString((CFStringRef)prop, buf, (CFIndex)size, kCFStringEncodingUTF8);
+    CFRelease(prop);
+}
+
+// Decodes a string of hex digit pairs; returns the byte count, or -1 if the
+// string is malformed or longer than `capacity` bytes.
+static long hex_decode(const char *hex, uint8_t *out, size_t capacity) {
+    size_t length = strlen(hex);
+    if (length % 2 || length / 2 > capacity) return -1;
+    for (size_t i = 0; i < length; i += 2) {
+        char pair[3] = { hex[i], hex[i + 1], '\0' };
+        char *end;
+        unsigned long byte = strtoul(pair, &end, 16);
+        if (*end || strchr("+- \t", pair[0])) return -1;
+        out[i / 2] = (uint8_t)byte;
+    }
+    return (long)(length / 2);
+}
+
+// Lists the usage of every top-level collection in a report descriptor.
+// One pass over the items, tracking only what names a collection: the usage
+// page (through Push and Pop) and the first usage since the last main item.
+// A device without a descriptor keeps its primary usage as its only
+// collection; one without a primary usage takes its first collection's.
+static void device_parse_collections(DeviceRecord *record, const uint8_t *d, size_t length) {
+    uint32_t page = 0, pages[4], usage = 0;
+    int pushed = 0, haveUsage = 0, depth = 0;
+    record->collectionCount = 0;
+    for (size_t i = 0; i < length;) {
+        uint8_t prefix = d[i++];
+        if (prefix == 0xfe) {   // Long item: size, tag, data.
+            if (i < length) i += 2 + d[i];
+            continue;
+        }
+        size_t size = (prefix & 3) == 3 ? 4 : prefix & 3;
+        if (i + size > length) break;
+        uint32_t value = 0;
+        for (size_t b = 0; b < size; b++) value |= (uint32_t)d[i + b] << (8 * b);
+        i += size;
+        switch (prefix & 0xfc) {
+        case 0x04: page = value; break;                                    // Usage Page
+        case 0xa4: if (pushed < 4) pages[pushed++] = page; break;          // Push
+        case 0xb4: if (pushed > 0) page = pages[--pushed]; break;          // Pop
+        case 0x08:                                                         // Usage
+            if (!haveUsage) usage = size == 4 ? value : page << 16 | (value & 0xffff);
+            haveUsage = 1;
+            break;
+        case 0xa0:                                                         // Collection
+            if (depth++ == 0 && haveUsage && record->collectionCount < MAX_COLLECTIONS) {
+                int n = record->collectionCount, seen = 0;
+                for (int c = 0; c < n; c++) {
+                    seen |= record->collections[c].usagePage == usage >> 16 && record->collections[c].usage == (usage & 0xffff);
+                }
+                if (!seen) {
+                    record->collections[n].usagePage = (uint16_t)(usage >> 16);
+                    record->collections[n].usage = (uint16_t)usage;
+                    record->collectionCount++;
+                }
+            }
+            haveUsage = 0;
+            break;
+        case 0xc0: if (depth > 0) depth--; haveUsage = 0; break;           // End Collection
+        case 0x80: case 0x90: case 0xb0: haveUsage = 0; break;             // Input, Output, Feature
+        }
+    }
+    if (record->collectionCount == 0 && (record->usagePage > 0 || record->usage > 0)) {
+        record->collections[0].usagePage = (uint16_t)record->usagePage;
+        record->collections[0].usage = (uint16_t)record->usage;
+        record->collectionCount = 1;
+    } else if (record->collectionCount > 0 && record->usagePage <= 0 && record->usage <= 0) {
+        record->usagePage = record->collections[0].usagePage;
+        record->usage = record->collections[0].usage;
+    }
+}
+
+static void device_read(io_service_t service, DeviceRecord *record) {
+    memset(record, 0, sizeof(*record));
+    IOObjectRetain(service);
+    record->service = service;
+    IORegistryEntryGetRegistryEntryID(service, &record->entryID);
+    record->vendorID = get_number_property(service, CFSTR("VendorID"));
+    record->productID = get_number_property(service, CFSTR("ProductID"));
+    record->usagePage = get_number_property(service, CFSTR("PrimaryUsagePage"));
+    record->usage = get_number_property(service, CFSTR("PrimaryUsage"));
+    record->locationID = get_number_property(service, CFSTR("LocationID"));
+    get_string_property(service, CFSTR("Product"), record->product, sizeof(record->product));
+    get_string_property(service, CFSTR("SerialNumber"), record->serial, sizeof(record->serial));
+    get_string_property(service, CFSTR("DeviceAddress"), record->address, sizeof(record->address));
+    CFTypeRef descriptor = IORegistryEntryCreateCFProperty(service, CFSTR("ReportDescriptor"), kCFAllocatorDefault, 0);
+    if (descriptor && CFGetTypeID(descriptor) == CFDataGetTypeID()) {
+        device_parse_collections(record, CFDataGetBytePtr((CFDataRef)descriptor), (size_t)CFDataGetLength((CFDataRef)descriptor));
+    } else {
+        device_parse_collections(record, NULL, 0);
+    }
+    if (descriptor) CFRelease(descriptor);
+}
+
+static void device_release(DeviceRecord *record) {
+    for (int i = 0; i < attributeCount; i++) mem_free(record->attributes[i]);
+    if (record->service) IOObjectRelease(record->service);
+    record->service = 0;
+    record->attributesFetched = 0;
+}
+
+// Returns the index of attribute `name`, adding it to the table if needed.
+static int attribute_intern(const char *name) {
+    for (int i = 0; i < attributeCount; i++) {
+        if (strcmp(attributeNames[i], name) == 0) return i;
+    }
+    if (attributeCount == MAX_ATTRIBUTES) return -1;
+    attributeNames[attributeCount] = name;
+    attributeKeys[attributeCount] = CFStringCreateWithCString(kCFAllocatorDefault, name, kCFStringEncodingUTF8);
+    return attributeCount++;
+}
+
+// Formats any registry property as the string predicates compare against.
+static char *read_attribute(io_service_t service, CFStringRef key) {
+    if (!service) return NULL;
+    CFTypeRef prop = IORegistryEntryCreateCFProperty(service, key, kCFAllocatorDefault, 0);
+    if (!prop) return NULL;
+    char buf[256] = "";
+    if (CFGetTypeID(prop) == CFStringGetTypeID()) {
+        CFStringGetCString((CFStringRef)prop, buf, sizeof(buf), kCFStringEncodingUTF8);
+    } else if (CFGetTypeID(prop) == CFNumberGetTypeID()) {
+        long long n = 0;
+        CFNumberGetValue((CFNumberRef)prop, kCFNumberLongLongType, &n);
+        snprintf(buf, sizeof(buf), "%lld", n);
+    } else if (CFGetTypeID(prop) == CFBooleanGetTypeID()) {
+        snprintf(buf, sizeof(buf), "%s", CFBooleanGetValue((CFBooleanRef)prop) ? "Yes" : "No");
+    } else if (CFGetTypeID(prop) == CFDataGetTypeID()) {
+        const UInt8 *bytes = CFDataGetBytePtr((CFDataRef)prop);
+        CFIndex len = CFDataGetLength((CFDataRef)prop);
+        for (CFIndex i = 0; i < len && i * 2 + 2 < (CFIndex)sizeof(buf); i++) sprintf(buf + i * 2, "%02x", bytes[i]);
+    }
+    CFRelease(prop);
+    return mem_strdup(MEM_REGISTRY, buf);
+}
+
+// The value of attribute `index` for a device, read on first use only.
+static const char *device_attribute(DeviceRecord *device, int index) {
+    if (!(device->attributesFetched & (1u << index))) {
+        device->attributes[index] = read_attribute(device->service, attributeKeys[index]);
+        device->attributesFetched |= 1u << index;
+    }
+    return device->attributes[index] ? device->attributes[index] : "";
+}
+
+static DeviceRecord *registry_find(uint64_t entryID) {
+    for (size_t i = 0; i < deviceCount; i++) {
+        if (devices[i].entryID == entryID) return &devices[i];
+    }
+    return NULL;
+}
+
+// Takes ownership of `record`; returns the registry's copy, or NULL if the
+// registry could not grow (the record is then released).
+static DeviceRecord *registry_add(DeviceRecord *record) {
+    DeviceRecord *existing = registry_find(record->entryID);
+    if (existing) {
+        device_release(record);
+        return existing;
+    }
+    if (deviceCount == deviceCapacity) {
+        size_t capacity = deviceCapacity ? deviceCapacity * 2 : 16;
+        DeviceRecord *grown = mem_realloc(MEM_REGISTRY, devices, capacity * sizeof(*devices));
+        if (!grown) {
+            device_release(record);
+            return NULL;
+        }
+        devices = grown;
+        deviceCapacity = capacity;
+    }
+    devices[deviceCount] = *record;
+    return &devices[deviceCount++];
+}
+
+// Removes a device from the registry, handing its record to the caller.
+static int registry_take(uint64_t entryID, DeviceRecord *out) {
+    DeviceRecord *record = registry_find(entryID);
+    if (!record) return 0;
+    *out = *record;
+    *record = devices[--deviceCount];
+    return 1;
+}
+
+// --- USB topology -----------------------------------------------------------
+//
+// A device's port path is read off its LocationID: the top byte is the bus
+// and each following nibble the port on the next hub down, so 0x14320000
+// is bus 14, port 3, then port 2 of the hub there, written "14-3.2".
+// --port patterns name a port ("14-3.2") or everything below one
+// ("14-3.*", "14-*") and are kept in a compressed trie over path
+// components, so matching costs one step per hub level however many
+// patterns there are.
+
+#define PORT_MAX_DEPTH 7   // The bus and up to six hub levels.
+
+struct PortNode {
+    uint8_t label[PORT_MAX_DEPTH];   // Components on the edge into this node.
+    int labelLength;
+    int exact;                       // A pattern names this port.
+    int subtree;                     // A pattern covers every port below it.
+    PortNode *children;
+    int childCount;
+};
+
+static int port_components(long locationID, uint8_t *out) {
+    int n = 0;
+    out[n++] = (uint8_t)((unsigned long)locationID >> 24);
+    for (int shift = 20; shift >= 0; shift -= 4) {
+        uint8_t port = (uint8_t)((locationID >> shift) & 0xf);
+        if (!port) break;
+        out[n++] = port;
+    }
+    return n;
+}
+
+static void port_path(long locationID, char *buf, size_t size) {
+    uint8_t c[PORT_MAX_DEPTH];
+    int n = port_components(locationID, c);
+    int used = snprintf(buf, size, "%x-", c[0]);
+    for (int i = 1; i < n && used < (int)size; i++) used += snprintf(buf + used, size - (size_t)used, "%s%d", i > 1 ? "." : "", c[i]);
+}
+
+// Parses "14-3.2" or "14-3.*" into components; returns how many, or -1.
+static int port_parse(const char *pattern, uint8_t *out, int *subtree) {
+    char *end;
+    unsigned long bus = strtoul(pattern, &end, 16);
+    if (end == pattern || *end != '-' || bus > 0xff) return -1;
+    int n = 0;
+    out[n++] = (uint8_t)bus;
+    *subtree = 0;
+    for (const char *p = end + 1; ; p = end + 1) {
+        if (strcmp(p, "*") == 0) {
+            *subtree = 1;
+            return n;
+        }
+        long port = strtol(p, &end, 10);
+        if (end == p || port < 1 || port > 15 || n == PORT_MAX_DEPTH) return -1;
+        out[n++] = (uint8_t)port;
+        if (!*end) return n;
+        if (*end != '.') return -1;
+    }
+}
+
+// Returns 0 if out of memory; the trie is then left as it was.
+static int port_trie_insert(PortNode *node, const uint8_t *key, int length, int subtree) {
+    for (;;) {
+        if (length == 0) {
+            if (subtree) node->subtree = 1;
+            else node->exact = 1;
+            return 1;
+        }
+        PortNode *child = NULL;
+        for (int i = 0; i < node->childCount && !child; i++) {
+            if (node->children[i].label[0] == key[0]) child = &node->children[i];
+        }
+        if (!child) {
+            PortNode *children = mem_realloc(MEM_CONDITIONS, node->children, (size_t)(node->childCount + 1) * sizeof(PortNode));
+            if (!children) return 0;
+            node->children = children;
+            child = &node->children[node->childCount++];
+            *child = (PortNode){ .labelLength = length };
+            memcpy(child->label, key, (size_t)length);
+            if (subtree) child->subtree = 1;
+            else child->exact = 1;
+            return 1;
+        }
+        int common = 0;
+        while (common < child->labelLength && common < length && child->label[common] == key[common]) common++;
+        if (common < child->labelLength) {
+            // Split the edge: the child keeps the shared head and the old
+            // node moves below it with the rest of the label.
+            PortNode *below = mem_alloc(MEM_CONDITIONS, sizeof(PortNode));
+            if (!below) return 0;
+            PortNode tail = *child;
+            tail.labelLength -= common;
+            memmove(tail.label, tail.label + common, (size_t)tail.labelLength);
+            *child = (PortNode){ .labelLength = common, .childCount = 1 };
+            memcpy(child->label, key, (size_t)common);
+            child->children = below;
+            child->children[0] = tail;
+        }
+        node = child;
+        key += common;
+        length -= common;
+    }
+}
+
+// Adds a --port pattern to the filter; returns 0 if it does not parse and
+// -1 if out of memory.
+static int port_filter_add(AppConfig *config, const char *pattern) {
+    uint8_t key[PORT_MAX_DEPTH];
+    int subtree, length = port_parse(pattern, key, &subtree);
+    if (length < 0) return 0;
+    if (!config->ports) config->ports = mem_calloc(MEM_CONDITIONS, 1, sizeof(PortNode));
+    if (!config->ports || !port_trie_insert(config->ports, key, length, subtree)) return -1;
+    // A single exact port can be left to IOKit's matching.
+    long locationID = 0;
+    for (int i = 0; i < length; i++) locationID |= (long)key[i] << (i == 0 ? 24 : 24 - 4 * i);
+    config->portLocationID = ++config->portCount == 1 && !subtree ? locationID : 0;
+    return 1;
+}
+
+// Whether a device's port is covered by the --port patterns (true if none).
+// Applied with the numeric range filters by filters_match().
+static int port_filter_matches(const AppConfig *config, const DeviceRecord *device) {
+    if (!config->ports) return 1;
+    uint8_t components[PORT_MAX_DEPTH];
+    const uint8_t *key = components;
+    int length = port_components(device->locationID, components);
+    const PortNode *node = config->ports;
+    for (;;) {
+        if (length == 0) return node->exact;
+        if (node->subtree) return 1;
+        const PortNode *child = NULL;
+        for (int i = 0; i < node->childCount && !child; i++) {
+            if (node->children[i].label[0] == key[0]) child = &node->children[i];
+        }
+        if (!child || child->labelLength > length || memcmp(child->label, key, (size_t)child->labelLength) != 0) return 0;
+        node = child;
+        key += child->labelLength;
+        length -= child->labelLength;
+    }
+}
+
+// --- Numeric filters --------------------------------------------------------
+//
+// --vendor-id, --product-id, --usage-page and --usage take a single value,
+// a range (0xc000-0xc0ff), a comma-separated list of both, or @file with one
+// item per line. A single vendor or product ID goes into the IOKit matching
+// dictionary; anything else becomes a sorted array of disjoint ranges that
+// the daemon binary-searches, so even 100k ranges cost a handful of comparisons.
+// Files may include further @files, to NUMERIC_INCLUDE_DEPTH levels.
+
+#define NUMERIC_INCLUDE_DEPTH 8
+
+static int numeric_parse(const char *s, long *out, const char **end) {
+    char *e;
+    *out = strtol(s, &e, strncmp(s, "0x", 2) == 0 || strncmp(s, "0X", 2) == 0 ? 16 : 10);
+    *end = e;
+    return e != s && *out >= 0;
+}
+
+static int numeric_set_items(NumericSet *set, const char *spec, int depth);
+
+// Adds the items of an @file. The first bad line is reported with its file
+// and line number; the files including it just pass the failure up.
+static int numeric_set_file(NumericSet *set, const char *path, int depth) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Error: Cannot read %s: %s.\n", path, strerror(errno));
+        return 0;
+    }
+    char line[256];
+    int ok = 1, lineNumber = 0;
+    while (ok && fgets(line, sizeof(line), f)) {
+        lineNumber++;
+        line[strcspn(line, "#\r\n")] = '\0';
+        const char *item = line + strspn(line, " \t");
+        if (!*item) continue;
+        if (item[0] == '@' && depth == NUMERIC_INCLUDE_DEPTH) {
+            fprintf(stderr, "Error: %s:%d: @files nested more than %d deep; is one including itself?\n", path,
+                    lineNumber, NUMERIC_INCLUDE_DEPTH);
+            ok = 0;
+        } else if (item[0] == '@') {
+            ok = numeric_set_file(set, item + 1, depth + 1);
+        } else if (!(ok = numeric_set_items(set, item, depth))) {
+            fprintf(stderr, "Error: %s:%d: invalid item %s.\n", path, lineNumber, item);
+        }
+    }
+    fclose(f);
+    return ok;
+}
+
+// Adds the items of one filter flag to `set`; returns 0 if any is invalid.
+static int numeric_set_add(NumericSet *set, const char *spec) {
+    return numeric_set_items(set, spec, 0);
+}
+
+static int numeric_set_items(NumericSet *set, const char *spec, int depth) {
+    if (spec[0] == '@') return numeric_set_file(set, spec + 1, depth + 1);
+    const char *p = spec;
+    for (;;) {
+        NumericRange range;
+        if (!numeric_parse(p, &range.low, &p)) return 0;
+        range.high = range.low;
+        if (*p == '-' && (!numeric_parse(p + 1, &range.high, &p) || range.high < range.low)) return 0;
+        if (set->count == set->capacity) {
+            size_t capacity = set->capacity ? set->capacity * 2 : 8;
+            NumericRange *ranges = mem_realloc(MEM_CONDITIONS, set->ranges, capacity * sizeof(*ranges));
+            if (!ranges) return 0;
+            set->ranges = ranges;
+            set->capacity = capacity;
+        }
+        set->ranges[set->count++] = range;
+        p += strspn(p, " \t");
+        if (!*p) return 1;
+        if (*p++ != ',') return 0;
+    }
+}
+
+static int compare_ranges(const void *a, const void *b) {
+    const NumericRange *x = a, *y = b;
+    return x->low < y->low ? -1 : x->low > y->low;
+}
+
+// Sorts and merges the ranges. If they come down to one value, that value
+// is moved to `single` (for IOKit to match) and the set is emptied.
+static void numeric_set_finish(NumericSet *set, long *single) {
+    if (set->count == 0) return;
+    qsort(set->ranges, set->count, sizeof(*set->ranges), compare_ranges);
+    size_t n = 0;
+    for (size_t i = 1; i < set->count; i++) {
+        if (set->ranges[i].low <= set->ranges[n].high + 1) {
+            if (set->ranges[i].high > set->ranges[n].high) set->ranges[n].high = set->ranges[i].high;
+        } else {
+            set->ranges[++n] = set->ranges[i];
+        }
+    }
+    set->count = n + 1;
+    if (set->count == 1 && set->ranges[0].low == set->ranges[0].high) {
+        *single = set->ranges[0].low;
+        set->count = 0;
+    }
+}
+
+static int numeric_set_contains(const NumericSet *set, long value) {
+    size_t lo = 0, hi = set->count;   // First range with low > value.
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (set->ranges[mid].low <= value) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo > 0 && value <= set->ranges[lo - 1].high;
+}
+
+static int usage_value_matches(long single, const NumericSet *set, long value) {
+    return set->count ? numeric_set_contains(set, value) : single <= 0 || value == single;
+}
+
+// Whether one top-level collection of the device has both a wanted usage
+// page and a wanted usage. IOKit can only match the primary collection, so
+// the usage filters, single values included, are all applied here. Devices
+// have a handful of collections, kept in their record from connect on.
+static int usage_filter_matches(const AppConfig *config, const DeviceRecord *device) {
+    if (config->usagePage <= 0 && config->usage <= 0 && !config->usagePages.count && !config->usages.count) return 1;
+    for (int i = 0; i < device->collectionCount; i++) {
+        if (usage_value_matches(config->usagePage, &config->usagePages, device->collections[i].usagePage) &&
+            usage_value_matches(config->usage, &config->usages, device->collections[i].usage)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// The filters IOKit's matching dictionary cannot express: port prefixes,
+// numeric ranges and usages of other than the primary collection.
+static int filters_match(const AppConfig *config, const DeviceRecord *device) {
+    return (!config->vendorIDs.count || numeric_set_contains(&config->vendorIDs, device->vendorID)) &&
+           (!config->productIDs.count || numeric_set_contains(&config->productIDs, device->productID)) &&
+           usage_filter_matches(config, device) &&
+           port_filter_matches(config, device);
+}
+
+// --- Inline action conditions ---------------------------------------------
+//
+// A condition such as `serial ^= "LAB" && weekday >= 1 && weekday <= 5` is
+// compiled once at startup into a short register bytecode and evaluated for
+// every event before any process is spawned. Types are checked at compile
+// time, so each opcode knows whether its operands are numbers or strings.
+
+#define CONDITION_REGISTERS 16
+#define CONDITION_MAX_CODE 256
+#define CONDITION_MAX_CONSTANTS 64
+#define NO_REGISTER 0xff
+
+typedef enum { TYPE_BOOL, TYPE_NUMBER, TYPE_STRING } ValueType;
+
+typedef enum {
+    OP_LOADK,     // dst = constants[imm]
+    OP_FIELD,     // dst = field imm of the event
+    OP_PRESENT,   // dst = connected devices with vendor a (and product b)
+    OP_ATTR,      // dst = attribute imm of the device, read lazily
+    OP_NOT,       // dst = !a
+    OP_EQ, OP_NE, OP_LT, OP_LE, OP_GT, OP_GE,     // dst = a <op> b, numbers
+    OP_SEQ, OP_SNE, OP_PREFIX, OP_SUFFIX, OP_CONTAINS, // dst = a <op> b, strings
+    OP_JUMP_FALSE, // if !a goto imm
+    OP_JUMP_TRUE,  // if a goto imm
+    OP_RETURN,     // return a != 0
+} Opcode;
+
+typedef struct {
+    uint8_t op, dst, a, b;
+    int32_t imm;
+} Instruction;
+
+typedef union {
+    long n;
+    const char *s;
+} Register;
+
+struct Condition {
+    Instruction code[CONDITION_MAX_CODE];
+    int length;
+    Register constants[CONDITION_MAX_CONSTANTS];
+    int constantCount;
+};
+
+typedef enum {
+    FIELD_VENDOR_ID, FIELD_PRODUCT_ID, FIELD_USAGE_PAGE, FIELD_USAGE, FIELD_LOCATION_ID,
+    FIELD_PRODUCT, FIELD_SERIAL, FIELD_ADDRESS, FIELD_EVENT,
+    FIELD_WEEKDAY, FIELD_HOUR, FIELD_MINUTE, FIELD_CONNECTED,
+} Field;
+
+static const struct {
+    const char *name;
+    ValueType type;
+} fields[] = {
+    [FIELD_VENDOR_ID] = { "vid", TYPE_NUMBER },
+    [FIELD_PRODUCT_ID] = { "pid", TYPE_NUMBER },
+    [FIELD_USAGE_PAGE] = { "usage_page", TYPE_NUMBER },
+    [FIELD_USAGE] = { "usage", TYPE_NUMBER },
+    [FIELD_LOCATION_ID] = { "location", TYPE_NUMBER },
+    [FIELD_PRODUCT] = { "name", TYPE_STRING },
+    [FIELD_SERIAL] = { "serial", TYPE_STRING },
+    [FIELD_ADDRESS] = { "address", TYPE_STRING },
+    [FIELD_EVENT] = { "event", TYPE_STRING },
+    [FIELD_WEEKDAY] = { "weekday", TYPE_NUMBER },
+    [FIELD_HOUR] = { "hour", TYPE_NUMBER },
+    [FIELD_MINUTE] = { "minute", TYPE_NUMBER },
+    [FIELD_CONNECTED] = { "connected", TYPE_NUMBER },
+};
+
+// The event a condition is evaluated against.
+typedef struct {
+    DeviceRecord *device;
+    const char *event;   // "connect" or "disconnect"
+    time_t when;
+} EventContext;
+
+typedef struct {
+    ValueType type;
+    int reg;
+} Operand;
+
+typedef struct {
+    const char *p;
+    Condition *cond;
+    int nextRegister;
+    char error[128];
+} Compiler;
+
+static void compile_error(Compiler *c, const char *message) {
+    if (!c->error[0]) snprintf(c->error, sizeof(c->error), "%s near '%.16s'", message, c->p);
+}
+
+static int emit(Compiler *c, Opcode op, int dst, int a, int b, int32_t imm) {
+    if (c->cond->length >= CONDITION_MAX_CODE) { compile_error(c, "expression too long"); return 0; }
+    c->cond->code[c->cond->length] = (Instruction){ (uint8_t)op, (uint8_t)dst, (uint8_t)a, (uint8_t)b, imm };
+    return c->cond->length++;
+}
+
+static int alloc_register(Compiler *c) {
+    if (c->nextRegister >= CONDITION_REGISTERS) { compile_error(c, "expression too complex"); return 0; }
+    return c->nextRegister++;
+}
+
+static int add_constant(Compiler *c, Register value) {
+    if (c->cond->constantCount >= CONDITION_MAX_CONSTANTS) { compile_error(c, "too many constants"); return 0; }
+    c->cond->constants[c->cond->constantCount] = value;
+    return c->cond->constantCount++;
+}
+
+static void skip_space(Compiler *c) {
+    while (*c->p == ' ' || *c->p == '\t') c->p++;
+}
+
+// Consumes `token` if it comes next.
+static int consume(Compiler *c, const char *token) {
+    skip_space(c);
+    size_t len = strlen(token);
+    if (strncmp(c->p, token, len) != 0) return 0;
+    c->p += len;
+    return 1;
+}
+
+static Operand compile_or(Compiler *c);
+
+static Operand compile_primary(Compiler *c) {
+    Operand result = { TYPE_NUMBER, 0 };
+    skip_space(c);
+    if (consume(c, "(")) {
+        result = compile_or(c);
+        if (!consume(c, ")")) compile_error(c, "expected ')'");
+        return result;
+    }
+    if (*c->p == '"') {
+        const char *start = ++c->p;
+        while (*c->p && *c->p != '"') c->p++;
+        if (!*c->p) { compile_error(c, "unterminated string"); return result; }
+        Register k = { .s = mem_strndup(MEM_CONDITIONS, start, (size_t)(c->p - start)) };
+        if (!k.s) { compile_error(c, "out of memory"); return result; }
+        c->p++;
+        result.type = TYPE_STRING;
+        result.reg = alloc_register(c);
+        emit(c, OP_LOADK, result.reg, 0, 0, add_constant(c, k));
+        return result;
+    }
+    if (*c->p >= '0' && *c->p <= '9') {
+        char *end;
+        Register k = { .n = strtol(c->p, &end, 0) };
+        c->p = end;
+        result.reg = alloc_register(c);
+        emit(c, OP_LOADK, result.reg, 0, 0, add_constant(c, k));
+        return result;
+    }
+    const char *start = c->p;
+    while ((*c->p >= 'a' && *c->p <= 'z') || *c->p == '_') c->p++;
+    size_t len = (size_t)(c->p - start);
+    if (len == 0) { compile_error(c, "expected a value"); return result; }
+    if ((len == 4 && strncmp(start, "true", 4) == 0) || (len == 5 && strncmp(start, "false", 5) == 0)) {
+        result.type = TYPE_BOOL;
+        result.reg = alloc_register(c);
+        emit(c, OP_LOADK, result.reg, 0, 0, add_constant(c, (Register){ .n = len == 4 }));
+        return result;
+    }
+    if (len == 7 && strncmp(start, "present", 7) == 0) {
+        // present(vid) or present(vid, pid): how many such devices are connected.
+        result.reg = alloc_register(c);
+        if (!consume(c, "(")) { compile_error(c, "expected '('"); return result; }
+        Operand vid = compile_or(c), pid = { TYPE_NUMBER, NO_REGISTER };
+        if (consume(c, ",")) pid = compile_or(c);
+        if (!consume(c, ")")) compile_error(c, "expected ')'");
+        if (vid.type != TYPE_NUMBER || pid.type != TYPE_NUMBER) compile_error(c, "present() takes numbers");
+        emit(c, OP_PRESENT, result.reg, vid.reg, pid.reg, 0);
+        c->nextRegister = result.reg + 1;
+        return result;
+    }
+    if (len == 4 && strncmp(start, "attr", 4) == 0) {
+        // attr("Name"): any registry property as a string, only read if reached.
+        skip_space(c);
+        const char *open = c->p;
+        if (!consume(c, "(") || !consume(c, "\"")) { compile_error(c, "expected attr(\"Name\")"); return result; }
+        const char *name = c->p;
+        while (*c->p && *c->p != '"') c->p++;
+        char *copy = mem_strndup(MEM_CONDITIONS, name, (size_t)(c->p - name));
+        int attribute = copy ? attribute_intern(copy) : -1;
+        if (!consume(c, "\"") || !consume(c, ")")) { c->p = open; compile_error(c, "expected attr(\"Name\")"); return result; }
+        if (!copy) compile_error(c, "out of memory");
+        else if (attribute < 0) compile_error(c, "too many attributes");
+        result.type = TYPE_STRING;
+        result.reg = alloc_register(c);
+        emit(c, OP_ATTR, result.reg, 0, 0, attribute);
+        return result;
+    }
+    for (size_t f = 0; f < sizeof(fields) / sizeof(fields[0]); f++) {
+        if (strlen(fields[f].name) == len && strncmp(fields[f].name, start, len) == 0) {
+            result.type = fields[f].type;
+            result.reg = alloc_register(c);
+            emit(c, OP_FIELD, result.reg, 0, 0, (int32_t)f);
+            return result;
+        }
+    }
+    c->p = start;
+    compile_error(c, "unknown name");
+    return result;
+}
+
+static Operand compile_comparison(Compiler *c) {
+    static const struct {
+        const char *token;
+        Opcode numberOp, stringOp;
+    } ops[] = {
+        { "==", OP_EQ, OP_SEQ }, { "!=", OP_NE, OP_SNE }, { "<=", OP_LE, 0 }, { ">=", OP_GE, 0 },
+        { "<", OP_LT, 0 }, { ">", OP_GT, 0 }, { "^=", 0, OP_PREFIX }, { "$=", 0, OP_SUFFIX },
+        { "*=", 0, OP_CONTAINS },
+    };
+    Operand left = compile_primary(c);
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if (!consume(c, ops[i].token)) continue;
+        Operand right = compile_primary(c);
+        Opcode op = 0;
+        if (left.type != right.type) compile_error(c, "type mismatch");
+        else if (left.type == TYPE_STRING) op = ops[i].stringOp;
+        else op = ops[i].numberOp;
+        if (!op) compile_error(c, "operator not valid for these operands");
+        emit(c, op, left.reg, left.reg, right.reg, 0);
+        c->nextRegister = left.reg + 1;
+        return (Operand){ TYPE_BOOL, left.reg };
+    }
+    return left;
+}
+
+// `!` applies to a whole comparison, so `!serial ^= "X"` reads naturally.
+static Operand compile_not(Compiler *c) {
+    if (consume(c, "!")) {
+        Operand operand = compile_not(c);
+        if (operand.type == TYPE_STRING) compile_error(c, "cannot negate a string");
+        emit(c, OP_NOT, operand.reg, operand.reg, 0, 0);
+        return (Operand){ TYPE_BOOL, operand.reg };
+    }
+    return compile_comparison(c);
+}
+
+// && and || short-circuit; the right operand reuses the left's register
+// because the left value is dead once the jump has not been taken.
+static Operand compile_and(Compiler *c) {
+    Operand left = compile_not(c);
+    while (consume(c, "&&")) {
+        if (left.type == TYPE_STRING) compile_error(c, "string used as a condition");
+        int jump = emit(c, OP_JUMP_FALSE, 0, left.reg, 0, 0);
+        c->nextRegister = left.reg;
+        Operand right = compile_not(c);
+        if (right.type == TYPE_STRING) compile_error(c, "string used as a condition");
+        c->cond->code[jump].imm = c->cond->length;
+        left = (Operand){ TYPE_BOOL, right.reg };
+    }
+    return left;
+}
+
+static Operand compile_or(Compiler *c) {
+    Operand left = compile_and(c);
+    while (consume(c, "||")) {
+        if (left.type == TYPE_STRING) compile_error(c, "string used as a condition");
+        int jump = emit(c, OP_JUMP_TRUE, 0, left.reg, 0, 0);
+        c->nextRegister = left.reg;
+        Operand right = compile_and(c);
+        if (right.type == TYPE_STRING) compile_error(c, "string used as a condition");
+        c->cond->code[jump].imm = c->cond->length;
+        left = (Operand){ TYPE_BOOL, right.reg };
+    }
+    return left;
+}
+
+// Compiles `source`; on failure returns NULL and prints why.
+Condition *condition_compile(const char *source) {
+    Condition *cond = mem_calloc(MEM_CONDITIONS, 1, sizeof(*cond));
+    if (!cond) return NULL;
+    Compiler c = { source, cond, 0, "" };
+    Operand result = compile_or(&c);
+    skip_space(&c);
+    if (*c.p) compile_error(&c, "unexpected input");
+    if (result.type == TYPE_STRING) compile_error(&c, "string used as a condition");
+    emit(&c, OP_RETURN, 0, result.reg, 0, 0);
+    if (c.error[0]) {
+        fprintf(stderr, "DAEMON_ERROR: Invalid condition: %s.\n", c.error);
+        mem_free(cond);
+        return NULL;
+    }
+    return cond;
+}
+
+static long present_count(long vendorID, long productID, int anyProduct) {
+    long count = 0;
+    for (size_t i = 0; i < deviceCount; i++) {
+        if (devices[i].vendorID == vendorID && (anyProduct || devices[i].productID == productID)) count++;
+    }
+    return count;
+}
+
+static Register load_field(Field field, const EventContext *ev) {
+    Register r = { 0 };
+    struct tm tm;
+    switch (field) {
+    case FIELD_VENDOR_ID: r.n = ev->device->vendorID; break;
+    case FIELD_PRODUCT_ID: r.n = ev->device->productID; break;
+    case FIELD_USAGE_PAGE: r.n = ev->device->usagePage; break;
+    case FIELD_USAGE: r.n = ev->device->usage; break;
+    case FIELD_LOCATION_ID: r.n = ev->device->locationID; break;
+    case FIELD_PRODUCT: r.s = ev->device->product; break;
+    case FIELD_SERIAL: r.s = ev->device->serial; break;
+    case FIELD_ADDRESS: r.s = ev->device->address; break;
+    case FIELD_EVENT: r.s = ev->event; break;
+    case FIELD_WEEKDAY: localtime_r(&ev->when, &tm); r.n = tm.tm_wday; break;
+    case FIELD_HOUR: localtime_r(&ev->when, &tm); r.n = tm.tm_hour; break;
+    case FIELD_MINUTE: localtime_r(&ev->when, &tm); r.n = tm.tm_min; break;
+    case FIELD_CONNECTED: r.n = (long)deviceCount; break;
+    }
+    return r;
+}
+
+static int has_suffix(const char *s, const char *suffix) {
+    size_t n = strlen(s), m = strlen(suffix);
+    return n >= m && memcmp(s + n - m, suffix, m) == 0;
+}
+
+int condition_eval(const Condition *cond, const EventContext *ev) {
+    Register r[CONDITION_REGISTERS];
+    const Instruction *pc = cond->code;
+    for (;;) {
+        switch ((Opcode)pc->op) {
+        case OP_LOADK: r[pc->dst] = cond->constants[pc->imm]; break;
+        case OP_FIELD: r[pc->dst] = load_field((Field)pc->imm, ev); break;
+        case OP_PRESENT: r[pc->dst].n = present_count(r[pc->a].n, pc->b == NO_REGISTER ? 0 : r[pc->b].n, pc->b == NO_REGISTER); break;
+        case OP_ATTR: r[pc->dst].s = device_attribute(ev->device, pc->imm); break;
+        case OP_NOT: r[pc->dst].n = !r[pc->a].n; break;
+        case OP_EQ: r[pc->dst].n = r[pc->a].n == r[pc->b].n; break;
+        case OP_NE: r[pc->dst].n = r[pc->a].n != r[pc->b].n; break;
+        case OP_LT: r[pc->dst].n = r[pc->a].n < r[pc->b].n; break;
+        case OP_LE: r[pc->dst].n = r[pc->a].n <= r[pc->b].n; break;
+        case OP_GT: r[pc->dst].n = r[pc->a].n > r[pc->b].n; break;
+        case OP_GE: r[pc->dst].n = r[pc->a].n >= r[pc->b].n; break;
+        case OP_SEQ: r[pc->dst].n = strcmp(r[pc->a].s, r[pc->b].s) == 0; break;
+        case OP_SNE: r[pc->dst].n = strcmp(r[pc->a].s, r[pc->b].s) != 0; break;
+        case OP_PREFIX: r[pc->dst].n = strncmp(r[pc->a].s, r[pc->b].s, strlen(r[pc->b].s)) == 0; break;
+        case OP_SUFFIX: r[pc->dst].n = has_suffix(r[pc->a].s, r[pc->b].s); break;
+        case OP_CONTAINS: r[pc->dst].n = strstr(r[pc->a].s, r[pc->b].s) != NULL; break;
+        case OP_JUMP_FALSE: if (!r[pc->a].n) { pc = cond->code + pc->imm; continue; } break;
+        case OP_JUMP_TRUE: if (r[pc->a].n) { pc = cond->code + pc->imm; continue; } break;
+        case OP_RETURN: return r[pc->a].n != 0;
+        }
+        pc++;
+    }
+}
+
+// --- Rule files -------------------------------------------------------------
+//
+// --rules loads per-serial asset mappings, one rule per line:
+//   <serial pattern> <on-connect script|-> [<on-disconnect script|->] [stop]
+// Patterns without wildcards are looked up in a hash index. Patterns with `*`
+// or `?` cannot be indexed; they are split into contiguous partitions that a
+// pool of worker threads scans in parallel for each event. Matches are
+// always reported in file order, however the work was split.
+//
+// A rule ending in `stop` is terminal: when it matches, the rules after it
+// in the file are not considered, so an ordered policy ("this reader → A,
+// other readers → B, anything else → nothing") reads top to bottom. The
+// first terminal exact match bounds the wildcard scan, and each partition
+// stops at its own first terminal match.
+//
+// One event in --rule-sample is timed rule by rule with cheap_ticks(), and
+// so are the exact-serial lookup and the --condition expression. The
+// `rulecost` control command ranks them by estimated total cost.
+
+#define PARALLEL_MIN_RULES 4096   // Below this, pattern rules are scanned inline.
+#define MAX_RULE_THREADS 64
+
+typedef struct {
+    char *pattern;
+    const char *onConnectScript;
+    const char *onDisconnectScript;
+    uint64_t onConnectKey;          // action_key() of each script.
+    uint64_t onDisconnectKey;
+    int next;                       // Next exact rule with the same serial, or -1.
+    int terminal;                   // Later rules are skipped when this one matches.
+    ActionPriority priority;        // Of its actions under overload.
+    unsigned long hits;             // Events the rule matched.
+    unsigned long deduplicated;     // Of those, times its action had already run for the event.
+    uint64_t costTicks;             // Time spent matching it in sampled events.
+    unsigned long costSamples;
+} Rule;
+
+typedef struct {
+    pthread_t thread;
+    size_t begin, end;   // Slice of patternRules this worker scans.
+    int *matches;        // Rule indices matched for the current event, ascending.
+    size_t matchCount, matchCapacity;
+} RuleWorker;
+
+static struct {
+    Rule *rules;
+    size_t count, capacity;
+    int *exactIndex;      // Open-addressing table of first-rule indices, -1 when empty.
+    size_t exactSlots;
+    int *patternRules;    // Indices of wildcard rules, ascending.
+    size_t patternCount;
+    int *matches;         // Merged result of the last rule_match().
+    size_t matchCapacity;
+} ruleset;
+
+#define DEFAULT_RULE_SAMPLE 64
+
+// Evaluation cost sampling. The rules keep their own counters; the costs
+// that are not a rule's live here.
+static struct {
+    unsigned long every;            // Sample one event in this many; 0 never.
+    unsigned long events;
+    int sampling;                   // Whether the current event is sampled.
+    unsigned long sampled;
+    uint64_t exactTicks, conditionTicks;
+    unsigned long conditionSamples;
+} ruleCost = { .every = DEFAULT_RULE_SAMPLE };
+
+// Decides whether the event now starting is one of the sampled ones.
+static void rule_cost_next_event(void) {
+    ruleCost.sampling = ruleCost.every && ++ruleCost.events % ruleCost.every == 0;
+    ruleCost.sampled += ruleCost.sampling;
+}
+
+// Fork-join pool: the event thread bumps `generation`, every worker scans its
+// partition, and the last one to finish wakes the event thread.
+static struct {
+    RuleWorker workers[MAX_RULE_THREADS];
+    int count;
+    pthread_mutex_t lock;
+    pthread_cond_t start, done;
+    unsigned long generation;
+    int remaining;
+    int stopping;
+    const char *serial;
+    int limit;
+    int sample;
+} rulePool = { .lock = PTHREAD_MUTEX_INITIALIZER, .start = PTHREAD_COND_INITIALIZER, .done = PTHREAD_COND_INITIALIZER };
+
+static int glob_match(const char *pattern, const char *s) {
+    const char *star = NULL, *resume = NULL;
+    while (*s) {
+        if (*pattern == '*') {
+            star = pattern++;
+            resume = s;
+        } else if (*pattern == '?' || *pattern == *s) {
+            pattern++;
+            s++;
+        } else if (star) {
+            pattern = star + 1;
+            s = ++resume;
+        } else {
+            return 0;
+        }
+    }
+    while (*pattern == '*') pattern++;
+    return *pattern == '\0';
+}
+
+static uint64_t hash_string(const char *s) {
+    uint64_t h = 1469598103934665603ULL;   // FNV-1a
+    while (*s) h = (h ^ (unsigned char)*s++) * 1099511628211ULL;
+    return h;
+}
+
+// Action keys by script string. Resolving one costs a realpath and a PATH
+// search, and large rules files name the same few scripts over and over.
+typedef struct {
+    char *scriptPath;   // NULL marks an empty slot.
+    uint64_t key;
+} ActionKeySlot;
+
+static struct {
+    ActionKeySlot *slots;   // Open addressing by hash_string(scriptPath).
+    size_t capacity, used;
+} actionKeys;
+
+static ActionKeySlot *action_key_slot(const char *scriptPath) {
+    size_t slot = hash_string(scriptPath) & (actionKeys.capacity - 1);
+    while (actionKeys.slots[slot].scriptPath && strcmp(actionKeys.slots[slot].scriptPath, scriptPath) != 0) {
+        slot = (slot + 1) & (actionKeys.capacity - 1);
+    }
+    return &actionKeys.slots[slot];
+}
+
+// Identifies what running `scriptPath` executes: the executable it resolves
+// to through PATH (as the shell does) and symlinks, so that different
+// spellings of one script are the same action. Scripts take no arguments
+// and inherit the daemon's environment, so the executable is the whole
+// action. Never 0.
+static uint64_t action_key_resolve(const char *scriptPath) {
+    char resolved[PATH_MAX];
+    const char *canonical = scriptPath;
+    if (strchr(scriptPath, '/')) {
+        if (realpath(scriptPath, resolved)) canonical = resolved;
+    } else {
+        const char *path = getenv("PATH");
+        while (path && *path) {
+            size_t len = strcspn(path, ":");
+            char candidate[PATH_MAX];
+            snprintf(candidate, sizeof(candidate), "%.*s/%s", (int)len, len ? path : ".", scriptPath);
+            if (access(candidate, X_OK) == 0 && realpath(candidate, resolved)) {
+                canonical = resolved;
+                break;
+            }
+            path += len + (path[len] == ':');
+        }
+    }
+    uint64_t key = hash_string(canonical);
+    return key ? key : 1;
+}
+
+// action_key_resolve, cached; 0 for no script.
+static uint64_t action_key(const char *scriptPath) {
+    if (!scriptPath) return 0;
+    if ((actionKeys.used + 1) * 2 > actionKeys.capacity) {
+        size_t oldCapacity = actionKeys.capacity;
+        ActionKeySlot *old = actionKeys.slots;
+        size_t capacity = oldCapacity ? oldCapacity * 2 : 16;
+        ActionKeySlot *grown = mem_calloc(MEM_RULES, capacity, sizeof(*grown));
+        if (!grown) return action_key_resolve(scriptPath);   // Uncached, but still right.
+        actionKeys.slots = grown;
+        actionKeys.capacity = capacity;
+        for (size_t i = 0; i < oldCapacity; i++) {
+            if (old[i].scriptPath) *action_key_slot(old[i].scriptPath) = old[i];
+        }
+        mem_free(old);
+    }
+    ActionKeySlot *slot = action_key_slot(scriptPath);
+    if (slot->scriptPath) return slot->key;
+    uint64_t key = action_key_resolve(scriptPath);
+    slot->scriptPath = mem_strdup(MEM_RULES, scriptPath);
+    if (!slot->scriptPath) return key;
+    slot->key = key;
+    actionKeys.used++;
+    return key;
+}
+
+// Returns 0 if the list could not grow; the caller then ends the chain there
+// as if the last rule kept had been terminal.
+static int push_match(int **matches, size_t *count, size_t *capacity, int rule) {
+    if (*count == *capacity) {
+        size_t grown = *capacity ? *capacity * 2 : 64;
+        int *list = mem_realloc(MEM_RULES, *matches, grown * sizeof(*list));
+        if (!list) {
+            fprintf(stderr, "DAEMON_ERROR: Out of memory matching rules; later rules skipped.\n");
+            return 0;
+        }
+        *matches = list;
+        *capacity = grown;
+    }
+    (*matches)[(*count)++] = rule;
+    return 1;
+}
+
+// Scans the worker's slice for rules before index `limit`, stopping at the
+// first terminal match. With `sample`, each rule's match is timed too; a
+// rule is only ever scanned by one worker at a time, so its counters need
+// no locking.
+static void scan_partition(RuleWorker *worker, const char *serial, int limit, int sample) {
+    worker->matchCount = 0;
+    for (size_t i = worker->begin; sample && i < worker->end; i++) {
+        int rule = ruleset.patternRules[i];
+        if (rule >= limit) break;
+        uint64_t start = cheap_ticks();
+        int matched = glob_match(ruleset.rules[rule].pattern, serial);
+        ruleset.rules[rule].costTicks += cheap_ticks() - start;
+        ruleset.rules[rule].costSamples++;
+        if (matched) {
+            if (!push_match(&worker->matches, &worker->matchCount, &worker->matchCapacity, rule)) break;
+            if (ruleset.rules[rule].terminal) break;
+        }
+    }
+    for (size_t i = worker->begin; !sample && i < worker->end; i++) {
+        int rule = ruleset.patternRules[i];
+        if (rule >= limit) break;
+        if (glob_match(ruleset.rules[rule].pattern, serial)) {
+            if (!push_match(&worker->matches, &worker->matchCount, &worker->matchCapacity, rule)) break;
+            if (ruleset.rules[rule].terminal) break;
+        }
+    }
+}
+
+static void *rule_worker_main(void *arg) {
+    RuleWorker *worker = arg;
+    unsigned long seen = 0;
+    pthread_mutex_lock(&rulePool.lock);
+    for (;;) {
+        while (rulePool.generation == seen && !rulePool.stopping) pthread_cond_wait(&rulePool.start, &rulePool.lock);
+        if (rulePool.stopping) break;
+        seen = rulePool.generation;
+        const char *serial = rulePool.serial;
+        int limit = rulePool.limit, sample = rulePool.sample;
+        pthread_mutex_unlock(&rulePool.lock);
+        scan_partition(worker, serial, limit, sample);
+        pthread_mutex_lock(&rulePool.lock);
+        if (--rulePool.remaining == 0) pthread_cond_signal(&rulePool.done);
+    }
+    pthread_mutex_unlock(&rulePool.lock);
+    return NULL;
+}
+
+static void rule_pool_stop(void) {
+    pthread_mutex_lock(&rulePool.lock);
+    rulePool.stopping = 1;
+    pthread_cond_broadcast(&rulePool.start);
+    pthread_mutex_unlock(&rulePool.lock);
+    for (int i = 1; i < rulePool.count; i++) pthread_join(rulePool.workers[i].thread, NULL);
+    // New workers start from generation 0; a stale count would look like a
+    // request to them.
+    rulePool.generation = 0;
+    rulePool.stopping = 0;
+    rulePool.count = 0;
+}
+
+// Splits the pattern rules into `threads` partitions. Worker 0 is the calling
+// thread itself, so only threads - 1 helpers are started.
+static int rule_pool_start(int threads) {
+    if (rulePool.count) rule_pool_stop();
+    if (threads < 1) threads = 1;
+    if (threads > MAX_RULE_THREADS) threads = MAX_RULE_THREADS;
+    rulePool.count = threads;
+    for (int i = 0; i < threads; i++) {
+        RuleWorker *worker = &rulePool.workers[i];
+        worker->begin = ruleset.patternCount * (size_t)i / (size_t)threads;
+        worker->end = ruleset.patternCount * (size_t)(i + 1) / (size_t)threads;
+        if (i > 0 && pthread_create(&worker->thread, NULL, rule_worker_main, worker) != 0) {
+            fprintf(stderr, "DAEMON_ERROR: Could not start rule worker threads.\n");
+            rulePool.count = i;
+            rule_pool_stop();
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Returns 0 if out of memory.
+static int rule_add(char *pattern, const char *onConnect, const char *onDisconnect, int terminal,
+                    ActionPriority priority) {
+    if (!pattern) return 0;
+    if (ruleset.count == ruleset.capacity) {
+        size_t capacity = ruleset.capacity ? ruleset.capacity * 2 : 64;
+        Rule *rules = mem_realloc(MEM_RULES, ruleset.rules, capacity * sizeof(*rules));
+        if (!rules) return 0;
+        ruleset.rules = rules;
+        ruleset.capacity = capacity;
+    }
+    ruleset.rules[ruleset.count++] = (Rule){ pattern, onConnect, onDisconnect, action_key(onConnect), action_key(onDisconnect), -1, terminal, priority, 0, 0, 0, 0 };
+    return 1;
+}
+
+// Builds the exact-serial hash index and the list of wildcard rules; returns
+// 0 if out of memory.
+static int rules_index(void) {
+    mem_free(ruleset.exactIndex);
+    mem_free(ruleset.patternRules);
+    ruleset.exactSlots = 16;
+    while (ruleset.exactSlots < ruleset.count * 2) ruleset.exactSlots *= 2;
+    ruleset.exactIndex = mem_alloc(MEM_RULES, ruleset.exactSlots * sizeof(int));
+    ruleset.patternRules = mem_alloc(MEM_RULES, (ruleset.count ? ruleset.count : 1) * sizeof(int));
+    ruleset.patternCount = 0;
+    if (!ruleset.exactIndex || !ruleset.patternRules) {
+        mem_free(ruleset.exactIndex);
+        mem_free(ruleset.patternRules);
+        ruleset.exactIndex = NULL;
+        ruleset.patternRules = NULL;
+        return 0;
+    }
+    memset(ruleset.exactIndex, 0xff, ruleset.exactSlots * sizeof(int));
+    // Walk backwards so each serial's chain comes out in file order.
+    for (size_t i = ruleset.count; i-- > 0;) {
+        Rule *rule = &ruleset.rules[i];
+        if (strpbrk(rule->pattern, "*?")) continue;
+        size_t slot = hash_string(rule->pattern) & (ruleset.exactSlots - 1);
+        while (ruleset.exactIndex[slot] >= 0 && strcmp(ruleset.rules[ruleset.exactIndex[slot]].pattern, rule->pattern) != 0) {
+            slot = (slot + 1) & (ruleset.exactSlots - 1);
+        }
+        rule->next = ruleset.exactIndex[slot];
+        ruleset.exactIndex[slot] = (int)i;
+    }
+    for (size_t i = 0; i < ruleset.count; i++) {
+        if (strpbrk(ruleset.rules[i].pattern, "*?")) ruleset.patternRules[ruleset.patternCount++] = (int)i;
+    }
+    return 1;
+}
+
+// Copies a script field into `*out`, NULL for "-"; returns 0 if out of memory.
+static int rule_script(const char *field, const char **out) {
+    *out = strcmp(field, "-") == 0 ? NULL : mem_strdup(MEM_RULES, field);
+    return *out || strcmp(field, "-") == 0;
+}
+
+// Loads a rules file; returns 0 (after printing why) if it cannot be used.
+// Rules without a priority= option get `priority`.
+int rules_load(const char *path, ActionPriority priority) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "DAEMON_ERROR: Cannot open rules file %s.\n", path);
+        return 0;
+    }
+    char *line = NULL;   // Grown by getline, so a long pattern is never split.
+    size_t lineCapacity = 0;
+    int lineNumber = 0;
+    while (getline(&line, &lineCapacity, f) > 0) {
+        lineNumber++;
+        char *fields[6];
+        int n = 0;
+        for (char *tok = strtok(line, " \t\r\n"); tok && n < 6; tok = strtok(NULL, " \t\r\n")) fields[n++] = tok;
+        if (n == 0 || fields[0][0] == '#') continue;
+        int terminal = 0, bad = 0;
+        ActionPriority rulePriority = priority;
+        // Options follow the scripts, in any order.
+        while (n > 2 && !bad) {
+            if (strcmp(fields[n - 1], "stop") == 0) terminal = 1;
+            else if (strcmp(fields[n - 1], "priority=low") == 0) rulePriority = PRIORITY_LOW;
+            else if (strcmp(fields[n - 1], "priority=normal") == 0) rulePriority = PRIORITY_NORMAL;
+            else if (strcmp(fields[n - 1], "priority=high") == 0) rulePriority = PRIORITY_HIGH;
+            else if (strncmp(fields[n - 1], "priority=", 9) == 0) bad = 1;
+            else break;
+            n--;
+        }
+        if (bad || n < 2 || n > 3) {
+            fprintf(stderr, "DAEMON_ERROR: %s:%d: expected <serial pattern> <on-connect> [<on-disconnect>] [stop] "
+                            "[priority=low|normal|high].\n", path, lineNumber);
+            free(line);
+            fclose(f);
+            return 0;
+        }
+        const char *onConnect, *onDisconnect = NULL;
+        if (!rule_script(fields[1], &onConnect) || (n == 3 && !rule_script(fields[2], &onDisconnect)) ||
+            !rule_add(mem_strdup(MEM_RULES, fields[0]), onConnect, onDisconnect, terminal, rulePriority)) {
+            fprintf(stderr, "DAEMON_ERROR: %s:%d: out of memory.\n", path, lineNumber);
+            free(line);
+            fclose(f);
+            return 0;
+        }
+    }
+    free(line);
+    fclose(f);
+    if (!rules_index()) {
+        fprintf(stderr, "DAEMON_ERROR: %s: out of memory indexing %zu rules.\n", path, ruleset.count);
+        return 0;
+    }
+    return 1;
+}
+
+// Finds the rules matching `serial` in file order, up to and including the
+// first terminal one. The result stays valid until the next call.
+size_t rule_match(const char *serial, const int **out) {
+    size_t count = 0;
+    *out = ruleset.matches;
+    if (!serial[0] || ruleset.count == 0) return 0;
+
+    // Exact rules come straight from the index as a chain in file order. A
+    // terminal one ends the chain and bounds the wildcard scan.
+    int exact = -1;
+    int limit = INT_MAX;
+    int sample = ruleCost.sampling;
+    uint64_t lookupStart = sample ? cheap_ticks() : 0;
+    size_t slot = hash_string(serial) & (ruleset.exactSlots - 1);
+    while (ruleset.exactIndex[slot] >= 0) {
+        if (strcmp(ruleset.rules[ruleset.exactIndex[slot]].pattern, serial) == 0) {
+            exact = ruleset.exactIndex[slot];
+            for (int r = exact; r >= 0; r = ruleset.rules[r].next) {
+                if (ruleset.rules[r].terminal) {
+                    limit = r;
+                    break;
+                }
+            }
+            break;
+        }
+        slot = (slot + 1) & (ruleset.exactSlots - 1);
+    }
+    if (sample) ruleCost.exactTicks += cheap_ticks() - lookupStart;
+
+    // Wildcard rules: inline for small sets, otherwise fork-join over the pool.
+    int partitions = rulePool.count;
+    if (partitions <= 1 || ruleset.patternCount < PARALLEL_MIN_RULES) {
+        RuleWorker *worker = &rulePool.workers[0];
+        size_t begin = worker->begin, end = worker->end;
+        worker->begin = 0;
+        worker->end = ruleset.patternCount;
+        scan_partition(worker, serial, limit, sample);
+        worker->begin = begin;
+        worker->end = end;
+        partitions = 1;
+    } else {
+        pthread_mutex_lock(&rulePool.lock);
+        rulePool.serial = serial;
+        rulePool.limit = limit;
+        rulePool.sample = sample;
+        rulePool.remaining = partitions - 1;
+        rulePool.generation++;
+        pthread_cond_broadcast(&rulePool.start);
+        pthread_mutex_unlock(&rulePool.lock);
+        scan_partition(&rulePool.workers[0], serial, limit, sample);
+        pthread_mutex_lock(&rulePool.lock);
+        while (rulePool.remaining > 0) pthread_cond_wait(&rulePool.done, &rulePool.lock);
+        pthread_mutex_unlock(&rulePool.lock);
+    }
+
+    // Partitions are contiguous and ascending, so concatenating them keeps
+    // file order; the exact chain is walked alongside and merged in by index.
+    // The first terminal rule in the merged order ends the result.
+    int stopped = 0;
+    for (int p = 0; p < partitions && !stopped; p++) {
+        RuleWorker *worker = &rulePool.workers[p];
+        for (size_t i = 0; i < worker->matchCount && !stopped; i++) {
+            while (exact >= 0 && exact < worker->matches[i] && !stopped) {
+                stopped = !push_match(&ruleset.matches, &count, &ruleset.matchCapacity, exact);
+                exact = ruleset.rules[exact].terminal ? -1 : ruleset.rules[exact].next;
+            }
+            if (stopped) break;
+            stopped = !push_match(&ruleset.matches, &count, &ruleset.matchCapacity, worker->matches[i]) ||
+                      ruleset.rules[worker->matches[i]].terminal;
+        }
+    }
+    while (exact >= 0 && !stopped) {
+        stopped = !push_match(&ruleset.matches, &count, &ruleset.matchCapacity, exact);
+        exact = ruleset.rules[exact].terminal ? -1 : ruleset.rules[exact].next;
+    }
+    *out = ruleset.matches;
+    return count;
+}
+
+// --- Rollups ------------------------------------------------------------------
+//
+// Dashboards want per-device and per-model activity over time without
+// replaying logs, so every event updates a fixed ring of time buckets for its
+// device and its model in place. The number of keys per table is capped; a
+// new key arriving at the cap evicts the least recently active one.
+
+#define ROLLUP_BUCKETS 60
+#define DEFAULT_ROLLUP_BUCKET_SECONDS 60
+#define DEFAULT_ROLLUP_KEYS 1024
+#define ROLLUP_KEY_SIZE 160
+#define FLAP_SECONDS 10.0   // Sessions shorter than this count as flaps.
+
+typedef struct {
+    uint32_t connects;
+    uint32_t disconnects;
+    uint32_t flaps;
+    uint32_t sessions;
+    uint64_t sessionMs;
+} RollupBucket;
+
+typedef struct {
+    char key[ROLLUP_KEY_SIZE];
+    long newestBucket;   // Absolute number of the bucket stored at newestBucket % ROLLUP_BUCKETS.
+    int next;            // Hash chain, -1 at the end.
+    int lruPrev, lruNext;
+    RollupBucket buckets[ROLLUP_BUCKETS];
+} RollupEntry;
+
+typedef struct {
+    const char *name;
+    RollupEntry *entries;
+    int *heads;
+    size_t headCount;
+    int count, capacity;
+    int lruHead, lruTail;   // Most and least recently touched entries.
+    unsigned long evictions;
+} RollupTable;
+
+static RollupTable deviceRollups = { .name = "device" };
+static RollupTable modelRollups = { .name = "model" };
+static long rollupBucketSeconds = DEFAULT_ROLLUP_BUCKET_SECONDS;
+static int rollupKeyCap = DEFAULT_ROLLUP_KEYS;
+
+static int rollup_init(RollupTable *table) {
+    table->capacity = rollupKeyCap > 0 ? rollupKeyCap : 1;
+    table->headCount = 16;
+    while (table->headCount < (size_t)table->capacity) table->headCount *= 2;
+    table->entries = mem_calloc(MEM_ROLLUPS, (size_t)table->capacity, sizeof(*table->entries));
+    table->heads = mem_alloc(MEM_ROLLUPS, table->headCount * sizeof(*table->heads));
+    if (!table->entries || !table->heads) {
+        mem_free(table->entries);
+        mem_free(table->heads);
+        table->entries = NULL;
+        return 0;
+    }
+    memset(table->heads, 0xff, table->headCount * sizeof(*table->heads));
+    table->lruHead = table->lruTail = -1;
+    return 1;
+}
+
+static void lru_unlink(RollupTable *table, int i) {
+    RollupEntry *e = &table->entries[i];
+    if (e->lruPrev >= 0) table->entries[e->lruPrev].lruNext = e->lruNext;
+    else table->lruHead = e->lruNext;
+    if (e->lruNext >= 0) table->entries[e->lruNext].lruPrev = e->lruPrev;
+    else table->lruTail = e->lruPrev;
+}
+
+static void lru_push_front(RollupTable *table, int i) {
+    RollupEntry *e = &table->entries[i];
+    e->lruPrev = -1;
+    e->lruNext = table->lruHead;
+    if (table->lruHead >= 0) table->entries[table->lruHead].lruPrev = i;
+    table->lruHead = i;
+    if (table->lruTail < 0) table->lruTail = i;
+}
+
+// Returns the bucket for `key` covering wall-clock time `now`, creating the
+// key (and evicting the coldest one) if needed. NULL only if out of memory.
+static RollupBucket *rollup_touch(RollupTable *table, const char *key, time_t now) {
+    if (!table->entries && !rollup_init(table)) return NULL;
+    long bucket = (long)(now / rollupBucketSeconds);
+    size_t head = hash_string(key) & (table->headCount - 1);
+    int i = table->heads[head];
+    while (i >= 0 && strcmp(table->entries[i].key, key) != 0) i = table->entries[i].next;
+    if (i >= 0) {
+        lru_unlink(table, i);
+    } else {
+        if (table->count < table->capacity) {
+            i = table->count++;
+        } else {
+            i = table->lruTail;
+            lru_unlink(table, i);
+            int *link = &table->heads[hash_string(table->entries[i].key) & (table->headCount - 1)];
+            while (*link != i) link = &table->entries[*link].next;
+            *link = table->entries[i].next;
+            table->evictions++;
+        }
+        RollupEntry *e = &table->entries[i];
+        memset(e->buckets, 0, sizeof(e->buckets));
+        snprintf(e->key, sizeof(e->key), "%s", key);
+        e->newestBucket = bucket;
+        e->next = table->heads[head];
+        table->heads[head] = i;
+    }
+    lru_push_front(table, i);
+    RollupEntry *e = &table->entries[i];
+    if (bucket > e->newestBucket) {
+        // Clear the buckets the ring skipped over since the key was last active.
+        long gap = bucket - e->newestBucket;
+        for (long b = 1; b <= gap && b <= ROLLUP_BUCKETS; b++) {
+            memset(&e->buckets[(e->newestBucket + b) % ROLLUP_BUCKETS], 0, sizeof(RollupBucket));
+        }
+        e->newestBucket = bucket;
+    }
+    return &e->buckets[bucket % ROLLUP_BUCKETS];
+}
+
+static void rollup_keys(const DeviceRecord *device, char *deviceKey, char *modelKey, size_t size) {
+    snprintf(modelKey, size, "%04lx:%04lx", device->vendorID, device->productID);
+    if (device->serial[0]) snprintf(deviceKey, size, "%s:%s", modelKey, device->serial);
+    else snprintf(deviceKey, size, "%s@%08lx", modelKey, device->locationID);
+}
+
+static void rollup_note_connect(const DeviceRecord *device) {
+    char deviceKey[ROLLUP_KEY_SIZE], modelKey[ROLLUP_KEY_SIZE];
+    time_t now = wall_time();
+    rollup_keys(device, deviceKey, modelKey, sizeof(deviceKey));
+    RollupBucket *b = rollup_touch(&deviceRollups, deviceKey, now);
+    if (b) b->connects++;
+    b = rollup_touch(&modelRollups, modelKey, now);
+    if (b) b->connects++;
+}
+
+static void rollup_note_disconnect(const DeviceRecord *device) {
+    char deviceKey[ROLLUP_KEY_SIZE], modelKey[ROLLUP_KEY_SIZE];
+    time_t now = wall_time();
+    rollup_keys(device, deviceKey, modelKey, sizeof(deviceKey));
+    double session = device->connectedAt > 0 ? now_seconds() - device->connectedAt : -1;
+    RollupBucket *buckets[2] = { rollup_touch(&deviceRollups, deviceKey, now), rollup_touch(&modelRollups, modelKey, now) };
+    for (int i = 0; i < 2; i++) {
+        if (!buckets[i]) continue;
+        buckets[i]->disconnects++;
+        if (session < 0) continue;
+        buckets[i]->sessions++;
+        buckets[i]->sessionMs += (uint64_t)(session * 1000.0);
+        if (session < FLAP_SECONDS) buckets[i]->flaps++;
+    }
+}
+
+// One line per key, most recently active first: totals over the ring, the
+// mean session length, and connects per bucket from oldest to newest.
+static void rollup_write(FILE *out, const RollupTable *table) {
+    long current = (long)(wall_time() / rollupBucketSeconds);
+    for (int i = table->lruHead; i >= 0; i = table->entries[i].lruNext) {
+        const RollupEntry *e = &table->entries[i];
+        RollupBucket total = { 0 };
+        char series[ROLLUP_BUCKETS * 11] = "";
+        size_t used = 0;
+        for (long b = current - ROLLUP_BUCKETS + 1; b <= current; b++) {
+            RollupBucket bucket = { 0 };
+            if (b <= e->newestBucket && b > e->newestBucket - ROLLUP_BUCKETS) bucket = e->buckets[b % ROLLUP_BUCKETS];
+            total.connects += bucket.connects;
+            total.disconnects += bucket.disconnects;
+            total.flaps += bucket.flaps;
+            total.sessions += bucket.sessions;
+            total.sessionMs += bucket.sessionMs;
+            used += (size_t)snprintf(series + used, sizeof(series) - used, "%s%u", used ? "," : "", bucket.connects);
+        }
+        fprintf(out, "%s %s connects=%u disconnects=%u flaps=%u mean_session_s=%.1f connects_per_bucket=%s\n",
+                table->name, e->key, total.connects, total.disconnects, total.flaps,
+                total.sessions ? total.sessionMs / 1000.0 / total.sessions : 0.0, series);
+    }
+}
+
+// Periodic export of every rollup to a file, replaced atomically.
+static void rollupExportTick(CFRunLoopTimerRef timer, void *info) {
+    (void)timer;
+    const char *path = info;
+    char tmp[1024];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *out = fopen(tmp, "w");
+    if (!out) {
+        fprintf(stderr, "DAEMON_ERROR: Cannot write rollup export %s.\n", tmp);
+        return;
+    }
+    fprintf(out, "# bucket_seconds=%ld buckets=%d\n", rollupBucketSeconds, ROLLUP_BUCKETS);
+    rollup_write(out, &modelRollups);
+    rollup_write(out, &deviceRollups);
+    if (fclose(out) != 0 || rename(tmp, path) != 0) fprintf(stderr, "DAEMON_ERROR: Cannot write rollup export %s.\n", path);
+}
+
+// --- Flapping devices ---------------------------------------------------------
+//
+// A space-saving sketch finds the devices producing the most events without
+// keeping state for every device: a fixed set of counters, where a device
+// that is not tracked replaces the smallest counter and inherits its count
+// as its error bound. Counts use forward decay, with weights growing
+// 2x per half-life, so they track recent event rate rather than lifetime
+// totals.
+
+#define DEFAULT_FLAPPER_SLOTS 32
+#define MAX_FLAPPER_SLOTS 256
+#define FLAPPER_HALF_LIFE 300.0   // Seconds.
+
+typedef struct {
+    uint64_t hash;
+    double count;   // Forward-decayed weight; divide by the current weight to read.
+    double error;   // Overestimate inherited from the evicted counter.
+    char key[ROLLUP_KEY_SIZE];
+} FlapperSlot;
+
+static struct {
+    FlapperSlot slots[MAX_FLAPPER_SLOTS];
+    int used;
+    int capacity;
+    double landmark;   // now_seconds() at which the weight of one event is 1.
+} flappers = { .capacity = DEFAULT_FLAPPER_SLOTS };
+
+static double flapper_weight(double now) {
+    return exp2((now - flappers.landmark) / FLAPPER_HALF_LIFE);
+}
+
+static void flapper_note(const DeviceRecord *device) {
+    char key[ROLLUP_KEY_SIZE], model[ROLLUP_KEY_SIZE];
+    rollup_keys(device, key, model, sizeof(key));
+    double now = now_seconds();
+    if (flappers.landmark == 0) flappers.landmark = now;
+    double weight = flapper_weight(now);
+    if (weight > 1e12) {
+        // Move the landmark before the weights lose precision.
+        for (int i = 0; i < flappers.used; i++) {
+            flappers.slots[i].count /= weight;
+            flappers.slots[i].error /= weight;
+        }
+        flappers.landmark = now;
+        weight = 1;
+    }
+    uint64_t hash = hash_string(key);
+    int min = 0;
+    for (int i = 0; i < flappers.used; i++) {
+        FlapperSlot *slot = &flappers.slots[i];
+        if (slot->hash == hash && strcmp(slot->key, key) == 0) {
+            slot->count += weight;
+            return;
+        }
+        if (slot->count < flappers.slots[min].count) min = i;
+    }
+    FlapperSlot *slot;
+    if (flappers.used < flappers.capacity) {
+        slot = &flappers.slots[flappers.used++];
+        slot->count = slot->error = 0;
+    } else {
+        slot = &flappers.slots[min];
+        slot->error = slot->count;
+    }
+    slot->hash = hash;
+    slot->count += weight;
+    snprintf(slot->key, sizeof(slot->key), "%s", key);
+}
+
+// Writes the `max` busiest tracked devices into out[0..max), busiest first,
+// and returns how many there were. Only that many are kept sorted, by
+// insertion, so asking for the top ten does not sort every slot.
+// Counts are converted to events per minute at the current decay.
+static int flapper_top(FlapperSlot *out, int max) {
+    int n = 0;
+    for (int s = 0; s < flappers.used; s++) {
+        const FlapperSlot *slot = &flappers.slots[s];
+        if (n == max && (max == 0 || slot->count <= out[n - 1].count)) continue;
+        int i = n < max ? n++ : n - 1;
+        while (i > 0 && out[i - 1].count < slot->count) {
+            out[i] = out[i - 1];
+            i--;
+        }
+        out[i] = *slot;
+    }
+    double scale = 60.0 * M_LN2 / FLAPPER_HALF_LIFE / flapper_weight(now_seconds());
+    for (int i = 0; i < n; i++) {
+        out[i].count *= scale;
+        out[i].error *= scale;
+    }
+    return n;
+}
+
+// --- D-Bus signals ----------------------------------------------------------
+//
+// Desktop integrations listen for device events on D-Bus. Rather than have a
+// script run dbus-send per event, the daemon speaks the small part of the
+// wire protocol it needs over one persistent connection: SASL EXTERNAL
+// authentication, Hello, and signal emission. The header of each signal is
+// marshalled once when the connection is set up; an event only patches the
+// serial and body length and appends its body.
+//
+// Signals: path /org/hidkitd/Daemon, interface org.hidkitd.Device, members
+// Connected and Disconnected with body (tuuss): registry entry ID, vendor
+// ID, product ID, product name, serial number.
+
+#define DBUS_PATH "/org/hidkitd/Daemon"
+#define DBUS_INTERFACE "org.hidkitd.Device"
+#define DBUS_SIGNATURE "tuuss"
+#define DBUS_RECONNECT_SECONDS 5.0   // Also how long a handshake may take.
+#define DBUS_QUEUE_BYTES 16384       // Signals held while the handshake runs or the bus is slow.
+
+typedef enum { DBUS_CLOSED, DBUS_CONNECTING, DBUS_AUTHENTICATING, DBUS_READY } DBusState;
+
+typedef struct {
+    uint8_t *data;
+    size_t length, capacity;
+} DBusBuffer;
+
+static struct {
+    const char *address;
+    int fd;
+    CFFileDescriptorRef fdRef;
+    DBusState state;
+    char reply[256];      // The reply to AUTH, as far as it has arrived.
+    size_t replyLength;
+    uint32_t serial;
+    double lastAttempt;
+    DBusBuffer connected, disconnected;   // Pre-marshalled signal headers.
+    DBusBuffer queued;    // Signals emitted before the connection was ready.
+    unsigned long queuedSignals;
+    DBusBuffer outbound;  // Bytes the socket has not taken yet, sent when writable.
+    unsigned long sent, dropped;
+} dbus = { .fd = -1 };
+
+// Appends `n` bytes; returns 0 (leaving the buffer as it was) if out of memory.
+static int dbus_put(DBusBuffer *b, const void *data, size_t n) {
+    if (b->length + n > b->capacity) {
+        size_t capacity = b->capacity ? b->capacity : 256;
+        while (capacity < b->length + n) capacity *= 2;
+        uint8_t *grown = mem_realloc(MEM_DBUS, b->data, capacity);
+        if (!grown) return 0;
+        b->data = grown;
+        b->capacity = capacity;
+    }
+    memcpy(b->data + b->length, data, n);
+    b->length += n;
+    return 1;
+}
+
+static void dbus_align(DBusBuffer *b, size_t alignment) {
+    static const uint8_t zeros[8];
+    if (b->length % alignment) dbus_put(b, zeros, alignment - b->length % alignment);
+}
+
+static void dbus_put_u32(DBusBuffer *b, uint32_t v) {
+    dbus_align(b, 4);
+    uint8_t le[4] = { (uint8_t)v, (uint8_t)(v >> 8), (uint8_t)(v >> 16), (uint8_t)(v >> 24) };
+    dbus_put(b, le, 4);
+}
+
+static void dbus_put_u64(DBusBuffer *b, uint64_t v) {
+    dbus_align(b, 8);
+    dbus_put_u32(b, (uint32_t)v);
+    dbus_put_u32(b, (uint32_t)(v >> 32));
+}
+
+static void dbus_put_string(DBusBuffer *b, const char *s) {
+    dbus_put_u32(b, (uint32_t)strlen(s));
+    dbus_put(b, s, strlen(s) + 1);
+}
+
+static void dbus_put_signature(DBusBuffer *b, const char *s) {
+    uint8_t len = (uint8_t)strlen(s);
+    dbus_put(b, &len, 1);
+    dbus_put(b, s, (size_t)len + 1);
+}
+
+// One header field: code, variant signature, then the value.
+static void dbus_put_field(DBusBuffer *b, uint8_t code, const char *type, const char *value) {
+    dbus_align(b, 8);
+    dbus_put(b, &code, 1);
+    dbus_put_signature(b, type);
+    if (strcmp(type, "g") == 0) dbus_put_signature(b, value);
+    else dbus_put_string(b, value);
+}
+
+static void dbus_set_u32(DBusBuffer *b, size_t offset, uint32_t v) {
+    for (int i = 0; i < 4; i++) b->data[offset + (size_t)i] = (uint8_t)(v >> (8 * i));
+}
+
+// Marshals a little-endian message header; serial and body length are left
+// zero for the caller to patch.
+static void dbus_header(DBusBuffer *b, uint8_t type, const char *path, const char *interface, const char *member,
+                        const char *destination, const char *signature) {
+    b->length = 0;
+    uint8_t fixed[4] = { 'l', type, type == 4 ? 1 : 0, 1 };   // Signals expect no reply.
+    dbus_put(b, fixed, 4);
+    dbus_put_u32(b, 0);   // Body length.
+    dbus_put_u32(b, 0);   // Serial.
+    dbus_put_u32(b, 0);   // Header field array length, patched below.
+    size_t start = b->length + (8 - b->length % 8) % 8;
+    dbus_put_field(b, 1, "o", path);
+    dbus_put_field(b, 2, "s", interface);
+    dbus_put_field(b, 3, "s", member);
+    if (destination) dbus_put_field(b, 6, "s", destination);
+    if (signature) dbus_put_field(b, 8, "g", signature);
+    dbus_set_u32(b, 12, (uint32_t)(b->length - start));
+    dbus_align(b, 8);
+}
+
+static void dbus_close(void) {
+    if (dbus.fdRef) {
+        CFFileDescriptorInvalidate(dbus.fdRef);   // Also closes the socket.
+        CFRelease(dbus.fdRef);
+        dbus.fdRef = NULL;
+    } else if (dbus.fd >= 0) {
+        close(dbus.fd);
+    }
+    dbus.fd = -1;
+    dbus.state = DBUS_CLOSED;
+    dbus.dropped += dbus.queuedSignals;
+    dbus.queued.length = 0;
+    dbus.queuedSignals = 0;
+    dbus.outbound.length = 0;
+}
+
+// Resolves "system", "session" or a unix:path=/unix:abstract= address.
+static int dbus_socket_address(const char *address, struct sockaddr_un *addr, socklen_t *len) {
+    if (strcmp(address, "system") == 0) {
+        address = getenv("DBUS_SYSTEM_BUS_ADDRESS");
+        if (!address) address = "unix:path=/var/run/dbus/system_bus_socket";
+    } else if (strcmp(address, "session") == 0) {
+        address = getenv("DBUS_SESSION_BUS_ADDRESS");
+        if (!address) return 0;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    const char *path = strstr(address, "path=");
+    const char *abstract = strstr(address, "abstract=");
+    const char *value = path ? path + 5 : abstract ? abstract + 9 : NULL;
+    if (strncmp(address, "unix:", 5) != 0 || !value) return 0;
+    size_t n = strcspn(value, ",;");
+    size_t offset = abstract && !path ? 1 : 0;   // Abstract names start with a NUL byte.
+    if (n + offset >= sizeof(addr->sun_path)) return 0;
+    memcpy(addr->sun_path + offset, value, n);
+    *len = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + offset + n + (offset ? 0 : 1));
+    return 1;
+}
+
+// Sends as much of the outbound buffer as the socket takes without waiting,
+// and asks for a write callback to send the rest. Returns 0 if the
+// connection failed (and was closed).
+static int dbus_flush(void) {
+    size_t done = 0;
+    while (done < dbus.outbound.length) {
+        ssize_t sent = send(dbus.fd, dbus.outbound.data + done, dbus.outbound.length - done, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (sent <= 0) {
+            fprintf(stderr, "DAEMON_ERROR: D-Bus connection closed.\n");
+            dbus_close();
+            return 0;
+        }
+        done += (size_t)sent;
+    }
+    memmove(dbus.outbound.data, dbus.outbound.data + done, dbus.outbound.length - done);
+    dbus.outbound.length -= done;
+    if (dbus.outbound.length) CFFileDescriptorEnableCallBacks(dbus.fdRef, kCFFileDescriptorWriteCallBack);
+    return 1;
+}
+
+// Sends the SASL EXTERNAL request once the socket is connected; the reply is
+// read by dbusEvent.
+static int dbus_send_auth(void) {
+    char auth[64] = "", uid[16];
+    snprintf(uid, sizeof(uid), "%u", (unsigned)getuid());
+    strcpy(auth, "AUTH EXTERNAL ");
+    for (char *u = uid; *u; u++) sprintf(auth + strlen(auth), "%02x", (unsigned char)*u);
+    strcat(auth, "\r\n");
+    if (!dbus_put(&dbus.outbound, "", 1) || !dbus_put(&dbus.outbound, auth, strlen(auth))) {
+        fprintf(stderr, "DAEMON_ERROR: D-Bus authentication failed at %s.\n", dbus.address);
+        dbus_close();
+        return 0;
+    }
+    dbus.state = DBUS_AUTHENTICATING;
+    dbus.replyLength = 0;
+    return dbus_flush();
+}
+
+// Takes part of the bus's reply to AUTH. On OK, finishes the handshake with
+// BEGIN and Hello and marks the connection ready; returns 0 if it was closed.
+static int dbus_auth_reply(const char *data, size_t n) {
+    if (n > sizeof(dbus.reply) - 1 - dbus.replyLength) n = sizeof(dbus.reply) - 1 - dbus.replyLength;
+    memcpy(dbus.reply + dbus.replyLength, data, n);
+    dbus.replyLength += n;
+    dbus.reply[dbus.replyLength] = '\0';
+    if (!strstr(dbus.reply, "\r\n") && dbus.replyLength < sizeof(dbus.reply) - 1) return 1;   // Not all there yet.
+    // Hello has serial 1; the queued signals were numbered after it.
+    DBusBuffer hello = { 0 };
+    int ok = strncmp(dbus.reply, "OK ", 3) == 0 && dbus_put(&dbus.outbound, "BEGIN\r\n", 7);
+    if (ok) {
+        dbus_header(&hello, 1, "/org/freedesktop/DBus", "org.freedesktop.DBus", "Hello", "org.freedesktop.DBus", NULL);
+        dbus_set_u32(&hello, 8, 1);
+        ok = dbus_put(&dbus.outbound, hello.data, hello.length) &&
+             dbus_put(&dbus.outbound, dbus.queued.data, dbus.queued.length);
+        mem_free(hello.data);
+    }
+    if (!ok) {
+        fprintf(stderr, "DAEMON_ERROR: D-Bus authentication failed at %s.\n", dbus.address);
+        dbus_close();
+        return 0;
+    }
+    if (!dbus_flush()) return 0;
+    dbus.sent += dbus.queuedSignals;
+    dbus.queued.length = 0;
+    dbus.queuedSignals = 0;
+    dbus.state = DBUS_READY;
+    printf("DAEMON: Connected to D-Bus at %s.\n", dbus.address);
+    fflush(stdout);
+    return 1;
+}
+
+// Drives the connection from the run loop: the non-blocking connect
+// completing, the outbound buffer draining, the reply to AUTH, and after
+// that the Hello reply and NameAcquired, which are read and discarded so the
+// socket never backs up. EOF means the bus went away.
+static void dbusEvent(CFFileDescriptorRef fdRef, CFOptionFlags callBackTypes, void *info) {
+    (void)info;
+    if (dbus.state == DBUS_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(dbus.fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0) err = errno;
+        if (err != 0) {
+            fprintf(stderr, "DAEMON_ERROR: Cannot connect to D-Bus at %s.\n", dbus.address);
+            dbus_close();
+            return;
+        }
+        if (dbus_send_auth()) CFFileDescriptorEnableCallBacks(fdRef, kCFFileDescriptorReadCallBack);
+        return;
+    }
+    if ((callBackTypes & kCFFileDescriptorWriteCallBack) && !dbus_flush()) return;
+    if (!(callBackTypes & kCFFileDescriptorReadCallBack)) return;
+    char buf[4096];
+    ssize_t n = recv(dbus.fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+        fprintf(stderr, "DAEMON_ERROR: D-Bus connection closed.\n");
+        dbus_close();
+        return;
+    }
+    if (n > 0 && dbus.state == DBUS_AUTHENTICATING && !dbus_auth_reply(buf, (size_t)n)) return;
+    CFFileDescriptorEnableCallBacks(fdRef, kCFFileDescriptorReadCallBack);
+}
+
+// Starts connecting, at most once per DBUS_RECONNECT_SECONDS. The socket is
+// non-blocking and the run loop completes the connect and the handshake, so
+// an event never waits on the bus; signals before it is ready are queued.
+static void dbus_connect(void) {
+    double now = now_seconds();
+    if (dbus.lastAttempt > 0 && now - dbus.lastAttempt < DBUS_RECONNECT_SECONDS) return;
+    dbus.lastAttempt = now;
+    struct sockaddr_un addr;
+    socklen_t addrLen;
+    if (!dbus_socket_address(dbus.address, &addr, &addrLen)) {
+        fprintf(stderr, "DAEMON_ERROR: Unsupported D-Bus address %s.\n", dbus.address);
+        return;
+    }
+    dbus.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (dbus.fd >= 0) {
+        fcntl(dbus.fd, F_SETFD, FD_CLOEXEC);
+        fcntl(dbus.fd, F_SETFL, fcntl(dbus.fd, F_GETFL) | O_NONBLOCK);
+    }
+    int connected = dbus.fd >= 0 && connect(dbus.fd, (struct sockaddr *)&addr, addrLen) == 0;
+    if (!connected && (dbus.fd < 0 || errno != EINPROGRESS)) {
+        fprintf(stderr, "DAEMON_ERROR: Cannot connect to D-Bus at %s.\n", dbus.address);
+        dbus_close();
+        return;
+    }
+#ifdef SO_NOSIGPIPE
+    int one = 1;
+    setsockopt(dbus.fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+    dbus.fdRef = CFFileDescriptorCreate(kCFAllocatorDefault, dbus.fd, true, dbusEvent, NULL);
+    CFRunLoopSourceRef source = CFFileDescriptorCreateRunLoopSource(kCFAllocatorDefault, dbus.fdRef, 0);
+    CFRunLoopAddSource(CFRunLoopGetCurrent(), source, kCFRunLoopDefaultMode);
+    CFRelease(source);
+    dbus.state = DBUS_CONNECTING;
+    dbus.serial = 1;   // Taken by Hello.
+    dbus_header(&dbus.connected, 4, DBUS_PATH, DBUS_INTERFACE, "Connected", NULL, DBUS_SIGNATURE);
+    dbus_header(&dbus.disconnected, 4, DBUS_PATH, DBUS_INTERFACE, "Disconnected", NULL, DBUS_SIGNATURE);
+    if (!connected) CFFileDescriptorEnableCallBacks(dbus.fdRef, kCFFileDescriptorWriteCallBack);
+    else if (dbus_send_auth()) CFFileDescriptorEnableCallBacks(dbus.fdRef, kCFFileDescriptorReadCallBack);
+}
+
+// Emits Connected or Disconnected for a device; a no-op without --dbus.
+static void dbus_emit(int connected, const DeviceRecord *device) {
+    if (!dbus.address) return;
+    if (dbus.state != DBUS_READY) {
+        if (dbus.fd >= 0 && now_seconds() - dbus.lastAttempt >= DBUS_RECONNECT_SECONDS) {
+            fprintf(stderr, "DAEMON_ERROR: D-Bus handshake with %s timed out.\n", dbus.address);
+            dbus_close();
+        }
+        if (dbus.fd < 0) dbus_connect();
+        if (dbus.fd < 0) {
+            dbus.dropped++;
+            return;
+        }
+    }
+    static DBusBuffer message;
+    const DBusBuffer *header = connected ? &dbus.connected : &dbus.disconnected;
+    message.length = 0;
+    dbus_put(&message, header->data, header->length);
+    size_t bodyStart = message.length;
+    dbus_put_u64(&message, device->entryID);
+    dbus_put_u32(&message, (uint32_t)device->vendorID);
+    dbus_put_u32(&message, (uint32_t)device->productID);
+    dbus_put_string(&message, device->product);
+    dbus_put_string(&message, device->serial);
+    dbus_set_u32(&message, 4, (uint32_t)(message.length - bodyStart));
+    dbus_set_u32(&message, 8, ++dbus.serial);
+    if (dbus.state != DBUS_READY) {
+        // Sent after Hello once the handshake completes.
+        if (dbus.queued.length + message.length > DBUS_QUEUE_BYTES) {
+            dbus.dropped++;
+            return;
+        }
+        dbus_put(&dbus.queued, message.data, message.length);
+        dbus.queuedSignals++;
+        return;
+    }
+    // Whatever the socket does not take now goes out from the write callback,
+    // so the event loop never waits on the bus. Past DBUS_QUEUE_BYTES behind,
+    // the bus is not keeping up and signals are dropped whole.
+    int waiting = dbus.outbound.length > 0;   // The write callback is already due.
+    if (dbus.outbound.length + message.length > DBUS_QUEUE_BYTES ||
+        !dbus_put(&dbus.outbound, message.data, message.length)) {
+        dbus.dropped++;
+        return;
+    }
+    if (!waiting && !dbus_flush()) dbus.dropped++;
+    else dbus.sent++;
+}
+
+// Evaluates the rule's in-daemon predicates for one event, cheapest first:
+// the inline condition, then --attr predicates, whose properties are only
+// read from the registry (and cached) once everything before them passed.
+static int condition_passes(const AppConfig *config, DeviceRecord *device, const char *event) {
+    const char *failed = NULL;
+    EventContext ev = { device, event, wall_time() };
+    if (config->compiledCondition) {
+        uint64_t start = ruleCost.sampling ? cheap_ticks() : 0;
+        if (!condition_eval(config->compiledCondition, &ev)) failed = "Condition not met";
+        if (ruleCost.sampling) {
+            ruleCost.conditionTicks += cheap_ticks() - start;
+            ruleCost.conditionSamples++;
+        }
+    }
+    for (int i = 0; !failed && i < config->attributeFilterCount; i++) {
+        const AttributeFilter *filter = &config->attributeFilters[i];
+        if (strcmp(device_attribute(device, filter->attribute), filter->value) != 0) failed = "Attribute filter not met";
+    }
+    if (!failed) return 1;
+    flight_copy(flight_next(FLIGHT_SKIPPED)->text[0], failed);
+    if (overload.level < LEVEL_COUNT_ONLY) {
+        printf("DAEMON: %s; skipping %s action [%016llx].\n", failed, event, (unsigned long long)flight.event);
+        fflush(stdout);
+    }
+    return 0;
+}
+
+// --- Device reports ---------------------------------------------------------
+//
+// --set-report writes output and feature reports to a device as it connects,
+// from the daemon rather than through a script that launches a vendor tool
+// and opens the device again. The reports go out in the order given over a
+// single open; the first failure stops the sequence, so a later report never
+// lands on a device whose earlier configuration did not take. A device may
+// accept a feature report without applying it, so each is read back and
+// compared. Writes cost microseconds rather than a process, and are not shed
+// under overload.
+
+static struct {
+    unsigned long written;
+    unsigned long failed;
+    unsigned long mismatched;
+    double seconds;
+} reports;
+
+// Parses <output|feature>:<id>:<hex bytes>; returns 0 if malformed.
+static int report_parse(const char *spec, ReportWrite *report) {
+    const char *rest;
+    if (strncmp(spec, "output:", 7) == 0) {
+        report->feature = 0;
+        rest = spec + 7;
+    } else if (strncmp(spec, "feature:", 8) == 0) {
+        report->feature = 1;
+        rest = spec + 8;
+    } else {
+        return 0;
+    }
+    char *end;
+    report->reportID = strtol(rest, &end, 0);
+    if (end == rest || *end != ':' || report->reportID < 0 || report->reportID > 255) return 0;
+    report->spec = spec;
+    report->length = 0;
+    if (report->reportID) report->bytes[report->length++] = (uint8_t)report->reportID;
+    const char *hex = end + 1;
+    if (strncmp(hex, "0x", 2) == 0) hex += 2;
+    long length = hex_decode(hex, report->bytes + report->length, MAX_REPORT_BYTES);
+    if (length <= 0) return 0;
+    report->length += length;
+    return 1;
+}
+
+// Writes the --set-report sequence to a device that just connected.
+static void reports_write(const AppConfig *config, const DeviceRecord *device) {
+    if (config->reportCount == 0) return;
+    if (daemonClock.isVirtual) {   // Simulations only log the writes.
+        for (int i = 0; i < config->reportCount; i++) {
+            printf("DAEMON: Writing report %s [%016llx].\n", config->reports[i].spec, (unsigned long long)flight.event);
+        }
+        fflush(stdout);
+        return;
+    }
+    double start = now_seconds();
+    IOHIDDeviceRef hid = IOHIDDeviceCreate(kCFAllocatorDefault, device->service);
+    IOReturn result = hid ? IOHIDDeviceOpen(hid, kIOHIDOptionsTypeNone) : kIOReturnNoDevice;
+    int done = 0, mismatch = 0;
+    if (result != kIOReturnSuccess) {
+        fprintf(stderr, "DAEMON_ERROR: Cannot open %s to write reports (0x%08x) [%016llx].\n", device->product,
+                (unsigned)result, (unsigned long long)flight.event);
+    }
+    for (; result == kIOReturnSuccess && !mismatch && done < config->reportCount; done++) {
+        const ReportWrite *report = &config->reports[done];
+        double writeStart = now_seconds();
+        IOHIDReportType type = report->feature ? kIOHIDReportTypeFeature : kIOHIDReportTypeOutput;
+        result = IOHIDDeviceSetReport(hid, type, report->reportID, report->bytes, report->length);
+        int readBack = 0;
+        if (result == kIOReturnSuccess && report->feature) {
+            uint8_t back[MAX_REPORT_BYTES + 1];
+            CFIndex length = report->length;
+            result = IOHIDDeviceGetReport(hid, type, report->reportID, back, &length);
+            mismatch = result == kIOReturnSuccess && (length != report->length || memcmp(back, report->bytes, (size_t)length) != 0);
+            readBack = result == kIOReturnSuccess ? 1 + mismatch : 0;
+        }
+        FlightRecord *record = flight_next(FLIGHT_REPORT);
+        record->report.result = result;
+        record->report.readBack = readBack;
+        record->report.durationUs = (int64_t)((now_seconds() - writeStart) * 1e6);
+        flight_copy(record->text[0], report->spec);
+        if (result == kIOReturnSuccess && !mismatch) {
+            reports.written++;
+            continue;
+        }
+        char why[40] = "did not read back as written";
+        if (mismatch) reports.mismatched++;
+        else reports.failed++;
+        if (!mismatch) snprintf(why, sizeof(why), "failed (0x%08x)", (unsigned)result);
+        fprintf(stderr, "DAEMON_ERROR: Report %s %s on %s; %d later report(s) skipped [%016llx].\n", report->spec, why,
+                device->product, config->reportCount - done - 1, (unsigned long long)flight.event);
+    }
+    if (hid) {
+        IOHIDDeviceClose(hid, kIOHIDOptionsTypeNone);
+        CFRelease(hid);
+    }
+    double seconds = now_seconds() - start;
+    reports.seconds += seconds;
+    if (result == kIOReturnSuccess && !mismatch && overload.level < LEVEL_COUNT_ONLY) {
+        printf("DAEMON: Wrote %d report(s) in %.1f us [%016llx].\n", done, seconds * 1e6, (unsigned long long)flight.event);
+        fflush(stdout);
+    }
+}
+
+// --- Upgrade handoff --------------------------------------------------------
+//
+// The `upgrade` control command re-execs the daemon's own binary, typically
+// after a package upgrade replaced it on disk. The registry
+// (with each device's top-level collections and cached attributes), counters, rule statistics, rollups
+// and flapper counts travel in an unlinked file whose descriptor, like the
+// control socket's, survives exec. The new process arms its notifications,
+// then matches the devices present against the handed-off ones: known
+// devices are resumed silently, new ones get their connect actions, and
+// handed-off ones that are gone get their disconnect actions. No event is
+// lost or repeated.
+
+#define HANDOFF_VERSION 2
+
+typedef struct {
+    int index;
+    char *pattern;
+    unsigned long hits, deduplicated;
+    uint64_t costTicks;
+    unsigned long costSamples;
+} HandoffRule;
+
+static struct {
+    DeviceRecord *records;   // Handed-off devices not yet seen again.
+    size_t count;
+    HandoffRule *rules;      // Statistics for handoff_rules once the rules are loaded.
+    size_t ruleCount;
+} handoff;
+
+// Replaces characters that would break the tab-separated record.
+static void handoff_put_string(FILE *out, const char *s, char end) {
+    for (; *s; s++) fputc(*s == '\t' || *s == '\n' ? ' ' : *s, out);
+    fputc(end, out);
+}
+
+// Rollup entries go out least recently touched first, so that touching them
+// again in file order rebuilds the LRU list.
+static void handoff_write_rollups(FILE *out, const RollupTable *table) {
+    if (!table->entries) return;
+    for (int i = table->lruTail; i >= 0; i = table->entries[i].lruPrev) {
+        const RollupEntry *e = &table->entries[i];
+        fprintf(out, "rollup %s %ld", table->name, e->newestBucket);
+        for (int b = 0; b < ROLLUP_BUCKETS; b++) {
+            const RollupBucket *k = &e->buckets[b];
+            fprintf(out, " %u %u %u %u %llu", k->connects, k->disconnects, k->flaps, k->sessions,
+                    (unsigned long long)k->sessionMs);
+        }
+        fputc('\t', out);
+        handoff_put_string(out, e->key, '\n');
+    }
+}
+
+static void handoff_write(FILE *out) {
+    fprintf(out, "hidkitd-handoff %d\n", HANDOFF_VERSION);
+    fprintf(out, "counters %lu %lu %lu\n", counters.connects, counters.disconnects, counters.spawns);
+    for (size_t i = 0; i < deviceCount; i++) {
+        const DeviceRecord *d = &devices[i];
+        fprintf(out, "device %llu %ld %ld %ld %ld %ld %.6f\t", (unsigned long long)d->entryID, d->vendorID, d->productID,
+                d->usagePage, d->usage, d->locationID, d->connectedAt);
+        handoff_put_string(out, d->product, '\t');
+        handoff_put_string(out, d->serial, '\t');
+        handoff_put_string(out, d->address, '\n');
+        fprintf(out, "usages %d", d->collectionCount);
+        for (int c = 0; c < d->collectionCount; c++) {
+            fprintf(out, " %u:%u", d->collections[c].usagePage, d->collections[c].usage);
+        }
+        fputc('\n', out);
+        // Attributes already read, by name, so that a device that goes away
+        // during the upgrade is still judged on them. 0 marks an absent one.
+        for (int a = 0; a < attributeCount; a++) {
+            if (!(d->attributesFetched & (1u << a))) continue;
+            fprintf(out, "attr %d\t", d->attributes[a] != NULL);
+            handoff_put_string(out, attributeNames[a], '\t');
+            handoff_put_string(out, d->attributes[a] ? d->attributes[a] : "", '\n');
+        }
+    }
+    // Rules are matched up by index and pattern after the new process has
+    // loaded its rules file.
+    for (size_t i = 0; i < ruleset.count; i++) {
+        const Rule *r = &ruleset.rules[i];
+        fprintf(out, "rule %zu %lu %lu %llu %lu\t", i, r->hits, r->deduplicated, (unsigned long long)r->costTicks,
+                r->costSamples);
+        handoff_put_string(out, r->pattern, '\n');
+    }
+    fprintf(out, "rollup-seconds %ld\n", rollupBucketSeconds);
+    handoff_write_rollups(out, &modelRollups);
+    handoff_write_rollups(out, &deviceRollups);
+    // Flapper counts at weight 1, against a landmark reset on load.
+    double weight = flappers.used ? flapper_weight(now_seconds()) : 1;
+    for (int i = 0; i < flappers.used; i++) {
+        fprintf(out, "flapper %.17g %.17g\t", flappers.slots[i].count / weight, flappers.slots[i].error / weight);
+        handoff_put_string(out, flappers.slots[i].key, '\n');
+    }
+}
+
+// Copies one tab-terminated field, returning the rest of the line.
+static char *handoff_get_string(char *s, char *buf, size_t size) {
+    size_t len = strcspn(s, "\t\n");
+    snprintf(buf, size, "%.*s", (int)len, s);
+    return s + len + (s[len] != '\0');
+}
+
+// Restores one handed-off rollup entry; `fields` holds the buckets and key.
+static void handoff_load_rollup(RollupTable *table, long newestBucket, char *fields) {
+    RollupBucket buckets[ROLLUP_BUCKETS];
+    for (int b = 0; b < ROLLUP_BUCKETS; b++) {
+        unsigned long long sessionMs;
+        int offset = 0;
+        RollupBucket *k = &buckets[b];
+        if (sscanf(fields, " %u %u %u %u %llu%n", &k->connects, &k->disconnects, &k->flaps, &k->sessions, &sessionMs,
+                   &offset) != 5 || offset == 0) {
+            return;
+        }
+        k->sessionMs = sessionMs;
+        fields += offset;
+    }
+    if (*fields != '\t') return;
+    char key[ROLLUP_KEY_SIZE];
+    handoff_get_string(fields + 1, key, sizeof(key));
+    if (!rollup_touch(table, key, (time_t)(newestBucket * rollupBucketSeconds))) return;
+    memcpy(table->entries[table->lruHead].buckets, buckets, sizeof(buckets));   // Touching moved it to the front.
+}
+
+// Reads the state a previous process handed over, if this one was started
+// by an upgrade. Returns 0 only if the state is unusable.
+static int handoff_load(void) {
+    const char *fdText = getenv("HIDKITD_HANDOFF_FD");
+    if (!fdText) return 1;
+    int fd = atoi(fdText);
+    unsetenv("HIDKITD_HANDOFF_FD");
+    FILE *in = fdopen(fd, "r");
+    if (!in) {
+        fprintf(stderr, "DAEMON_ERROR: Cannot read handoff state from fd %d.\n", fd);
+        return 0;
+    }
+    rewind(in);
+    char *line = NULL;   // Rollup lines run to a few kilobytes.
+    size_t lineCapacity = 0;
+    int version = 0;
+    if (getline(&line, &lineCapacity, in) <= 0 || sscanf(line, "hidkitd-handoff %d", &version) != 1 ||
+        version != HANDOFF_VERSION) {
+        fprintf(stderr, "DAEMON_ERROR: Handoff state has an unknown format.\n");
+        free(line);
+        fclose(in);
+        return 0;
+    }
+    size_t capacity = 0, ruleCapacity = 0;
+    long rollupSeconds = 0;
+    while (getline(&line, &lineCapacity, in) > 0) {
+        DeviceRecord record = {0};
+        unsigned long long entryID, ticks;
+        long newestBucket;
+        char name[16];
+        int offset = 0, present;
+        HandoffRule rule;
+        double count, error;
+        if (sscanf(line, "counters %lu %lu %lu", &counters.connects, &counters.disconnects, &counters.spawns) == 3) continue;
+        int collectionCount;
+        if (sscanf(line, "usages %d%n", &collectionCount, &offset) == 1 && handoff.count > 0) {
+            // Belongs to the device line before it.
+            DeviceRecord *last = &handoff.records[handoff.count - 1];
+            const char *p = line + offset;
+            last->collectionCount = 0;
+            for (int c = 0; c < collectionCount && c < MAX_COLLECTIONS; c++) {
+                unsigned page, usage;
+                int n = 0;
+                if (sscanf(p, " %u:%u%n", &page, &usage, &n) != 2) break;
+                last->collections[c].usagePage = (uint16_t)page;
+                last->collections[c].usage = (uint16_t)usage;
+                last->collectionCount++;
+                p += n;
+            }
+            continue;
+        }
+        if (sscanf(line, "attr %d\t%n", &present, &offset) == 1 && offset > 0 && handoff.count > 0) {
+            // Belongs to the device line before it. Names this process does
+            // not use are dropped.
+            DeviceRecord *last = &handoff.records[handoff.count - 1];
+            char attribute[128], value[256];
+            char *rest = handoff_get_string(line + offset, attribute, sizeof(attribute));
+            handoff_get_string(rest, value, sizeof(value));
+            for (int a = 0; a < attributeCount; a++) {
+                if (strcmp(attributeNames[a], attribute) != 0 || (last->attributesFetched & (1u << a))) continue;
+                last->attributes[a] = present ? mem_strdup(MEM_REGISTRY, value) : NULL;
+                last->attributesFetched |= 1u << a;
+            }
+            continue;
+        }
+        if (sscanf(line, "rule %d %lu %lu %llu %lu\t%n", &rule.index, &rule.hits, &rule.deduplicated, &ticks,
+                   &rule.costSamples, &offset) == 5 && offset > 0) {
+            char pattern[1024];
+            handoff_get_string(line + offset, pattern, sizeof(pattern));
+            if (handoff.ruleCount == ruleCapacity) {
+                size_t grown = ruleCapacity ? ruleCapacity * 2 : 16;
+                HandoffRule *rules = mem_realloc(MEM_RULES, handoff.rules, grown * sizeof(*rules));
+                if (!rules) continue;
+                handoff.rules = rules;
+                ruleCapacity = grown;
+            }
+            rule.costTicks = ticks;
+            rule.pattern = mem_strdup(MEM_RULES, pattern);
+            if (rule.pattern) handoff.rules[handoff.ruleCount++] = rule;
+            continue;
+        }
+        if (sscanf(line, "rollup-seconds %ld", &rollupSeconds) == 1) continue;
+        if (sscanf(line, "rollup %15s %ld%n", name, &newestBucket, &offset) == 2 && offset > 0) {
+            // Buckets only line up if their width is unchanged.
+            if (rollupSeconds != rollupBucketSeconds) continue;
+            RollupTable *table = strcmp(name, "model") == 0 ? &modelRollups : strcmp(name, "device") == 0 ? &deviceRollups : NULL;
+            if (table) handoff_load_rollup(table, newestBucket, line + offset);
+            continue;
+        }
+        if (sscanf(line, "flapper %lf %lf\t%n", &count, &error, &offset) == 2 && offset > 0) {
+            if (flappers.used == flappers.capacity) continue;
+            FlapperSlot *slot = &flappers.slots[flappers.used++];
+            handoff_get_string(line + offset, slot->key, sizeof(slot->key));
+            slot->hash = hash_string(slot->key);
+            slot->count = count;
+            slot->error = error;
+            flappers.landmark = now_seconds();
+            continue;
+        }
+        // The tab is checked separately: in the format it would also skip
+        // the one ending an empty product name.
+        if (sscanf(line, "device %llu %ld %ld %ld %ld %ld %lf%n", &entryID, &record.vendorID, &record.productID,
+                   &record.usagePage, &record.usage, &record.locationID, &record.connectedAt, &offset) != 7 ||
+            line[offset] != '\t') {
+            continue;
+        }
+        record.entryID = entryID;
+        char *rest = handoff_get_string(line + offset + 1, record.product, sizeof(record.product));
+        rest = handoff_get_string(rest, record.serial, sizeof(record.serial));
+        handoff_get_string(rest, record.address, sizeof(record.address));
+        if (handoff.count == capacity) {
+            size_t grown = capacity ? capacity * 2 : 16;
+            DeviceRecord *records = mem_realloc(MEM_REGISTRY, handoff.records, grown * sizeof(*records));
+            if (!records) continue;
+            handoff.records = records;
+            capacity = grown;
+        }
+        handoff.records[handoff.count++] = record;
+    }
+    free(line);
+    fclose(in);
+    printf("DAEMON: Resuming from upgrade with %zu device(s) handed off.\n", handoff.count);
+    fflush(stdout);
+    return 1;
+}
+
+// Removes the handed-off record for `entryID`, if there is one.
+static int handoff_take(uint64_t entryID, DeviceRecord *out) {
+    for (size_t i = 0; i < handoff.count; i++) {
+        if (handoff.records[i].entryID != entryID) continue;
+        *out = handoff.records[i];
+        handoff.records[i] = handoff.records[--handoff.count];
+        return 1;
+    }
+    return 0;
+}
+
+// Takes over a freshly read device the previous process already announced:
+// it keeps its original connect time and cached attributes, and no connect
+// event is raised. A device the new binary's filters reject is dropped
+// silently, as it was never this process's to announce; returns 0 then too.
+static int handoff_claim(const AppConfig *config, DeviceRecord *record) {
+    DeviceRecord old;
+    if (!handoff_take(record->entryID, &old)) return 0;
+    if (!filters_match(config, record)) {
+        device_release(&old);
+        return 0;
+    }
+    record->connectedAt = old.connectedAt;
+    record->attributesFetched = old.attributesFetched;
+    memcpy(record->attributes, old.attributes, sizeof(record->attributes));
+    registry_add(record);
+    return 1;
+}
+
+// Carries the handed-off statistics over to the rules just loaded, for each
+// rule still at the same index with the same pattern.
+static void handoff_rules(void) {
+    for (size_t i = 0; i < handoff.ruleCount; i++) {
+        const HandoffRule *h = &handoff.rules[i];
+        if (h->index >= 0 && (size_t)h->index < ruleset.count && strcmp(ruleset.rules[h->index].pattern, h->pattern) == 0) {
+            Rule *rule = &ruleset.rules[h->index];
+            rule->hits = h->hits;
+            rule->deduplicated = h->deduplicated;
+            rule->costTicks = h->costTicks;
+            rule->costSamples = h->costSamples;
+        }
+        mem_free(h->pattern);
+    }
+    mem_free(handoff.rules);
+    handoff.rules = NULL;
+    handoff.ruleCount = 0;
+}
+
+static void disconnect_event(AppConfig *config, DeviceRecord *record);
+
+// Ends a batch of events: runs what overload control deferred and commits
+// the WAL unless a commit window is waiting for more.
+static void events_flush(AppConfig *config) {
+    latency.batchStart = 0;
+    overload_flush(config);
+    if (wal.windowMs <= 0) wal_commit();
+}
+
+// Raises disconnects for handed-off devices that went away during the
+// upgrade, once priming has claimed all that are still present.
+static void handoff_finish(AppConfig *config) {
+    while (handoff.count > 0) {
+        DeviceRecord record = handoff.records[--handoff.count];
+        disconnect_event(config, &record);
+    }
+    mem_free(handoff.records);
+    handoff.records = NULL;
+    events_flush(config);
+}
 
-// This struct will hold our parsed command-line arguments.
-typedef struct {
-    long vendorID;
-    long productID;
-    long usagePage;
-    long usage;
-    const char *productName;
-    const char *deviceAddress;
-    const char *onConnectScript;
-    const char *onDisconnectScript;
-} AppConfig;
+// Canonical keys of the actions already dispatched for the current event,
+// so that overlapping rules bound to the same script run it once.
+static struct {
+    uint64_t *slots;   // Open addressing; 0 marks an empty slot.
+    size_t capacity, used;
+    unsigned long deduplicated;
+} eventActions;
 
-// A simple function to run a user-provided script.
-void run_script(const char *scriptPath) {
-    if (!scriptPath) return; // Do nothing if the script path is not provided
-    char command[2048];
-    snprintf(command, sizeof(command), "\"%s\"", scriptPath);
-    printf("DAEMON: Executing command: %s\n", command);
-    fflush(stdout);
-    system(command);
+static void event_actions_reset(void) {
+    if (eventActions.used) memset(eventActions.slots, 0, eventActions.capacity * sizeof(*eventActions.slots));
+    eventActions.used = 0;
+}
+
+// Dispatches an event's action unless an identical one was already
+// dispatched for the same event; returns 0 if it was collapsed.
+static int dispatch_event_action(const char *scriptPath, uint64_t key, ActionPriority priority) {
+    if (!scriptPath) return 1;
+    if ((eventActions.used + 1) * 2 > eventActions.capacity) {
+        size_t capacity = eventActions.capacity ? eventActions.capacity * 2 : 16;
+        uint64_t *slots = mem_calloc(MEM_ACTIONS, capacity, sizeof(*slots));
+        if (slots) {
+            for (size_t i = 0; i < eventActions.capacity; i++) {
+                if (!eventActions.slots[i]) continue;
+                size_t slot = eventActions.slots[i] & (capacity - 1);
+                while (slots[slot]) slot = (slot + 1) & (capacity - 1);
+                slots[slot] = eventActions.slots[i];
+            }
+            mem_free(eventActions.slots);
+            eventActions.slots = slots;
+            eventActions.capacity = capacity;
+        } else if (eventActions.used + 1 >= eventActions.capacity) {
+            // Out of memory with no free slot left: better run the action
+            // twice than not at all.
+            dispatch_action(scriptPath, priority);
+            return 1;
+        }
+    }
+    size_t slot = key & (eventActions.capacity - 1);
+    while (eventActions.slots[slot]) {
+        if (eventActions.slots[slot] == key) {
+            eventActions.deduplicated++;
+            pending_raise(scriptPath, priority);
+            return 0;
+        }
+        slot = (slot + 1) & (eventActions.capacity - 1);
+    }
+    eventActions.slots[slot] = key;
+    eventActions.used++;
+    dispatch_action(scriptPath, priority);
+    return 1;
+}
+
+// Runs the event's primary action and those of the matching rules, each
+// distinct action once, and credits every matching rule.
+static void dispatch_event(const AppConfig *config, const char *serial, int connected) {
+    event_actions_reset();
+    if (connected) dispatch_event_action(config->onConnectScript, config->onConnectKey, config->priority);
+    else dispatch_event_action(config->onDisconnectScript, config->onDisconnectKey, config->priority);
+    const int *matches;
+    size_t matchCount = rule_match(serial, &matches);
+    latency.ruleCount = (int)matchCount;
+    for (size_t i = 0; i < matchCount && i < EXEMPLAR_RULES; i++) latency.rules[i] = matches[i];
+    for (size_t i = 0; i < matchCount; i++) {
+        Rule *rule = &ruleset.rules[matches[i]];
+        rule->hits++;
+        FlightRecord *record = flight_next(FLIGHT_RULE);
+        record->rule.index = matches[i];
+        flight_copy(record->text[0], rule->pattern);
+        int ran = connected ? dispatch_event_action(rule->onConnectScript, rule->onConnectKey, rule->priority)
+                            : dispatch_event_action(rule->onDisconnectScript, rule->onDisconnectKey, rule->priority);
+        record->rule.ran = ran;
+        if (!ran) rule->deduplicated++;
+    }
+}
+
+// Starts a new event in the flight recorder.
+static void flight_note_device(FlightKind kind, const DeviceRecord *device) {
+    flight.event = correlation_next();
+    flight.timeUs = flight_clock_us();
+    FlightRecord *record = flight_next(kind);
+    record->device.vendorID = device->vendorID;
+    record->device.productID = device->productID;
+    record->device.usagePage = device->usagePage;
+    record->device.usage = device->usage;
+    record->device.locationID = device->locationID;
+    flight_copy(record->text[0], device->serial);
+    flight_copy(record->text[1], device->product);
+}
+
+static void latency_begin(void) {
+    latency.active = 1;
+    latency.start = now_seconds();
+    latency.spawn = latency.action = 0;
+    latency.ruleCount = 0;
+}
+
+// Closes the event's latency sample; only slow events are copied out.
+static void latency_end(int connected, const DeviceRecord *device) {
+    double seconds = now_seconds() - latency.start;
+    int b = latency_bucket(seconds);
+    latency.active = 0;
+    latency.counts[b]++;
+    latency.sum += seconds;
+    double queueWait = latency.batchStart > 0 ? latency.start - latency.batchStart : 0;
+    latency.stageSums[0] += queueWait;
+    latency.stageSums[1] += latency.spawn;
+    latency.stageSums[2] += latency.action;
+    if (seconds < latency.thresholdSeconds || !device) return;
+    Exemplar *e = &latency.exemplars[b][latency.captured[b]++ % EXEMPLARS_PER_BUCKET];
+    *e = (Exemplar){ flight.event, flight.timeUs, connected, seconds, queueWait, latency.spawn, latency.action,
+                     device->vendorID, device->productID, device->locationID, "", "", latency.ruleCount, {0} };
+    flight_copy(e->serial, device->serial);
+    flight_copy(e->product, device->product);
+    memcpy(e->rules, latency.rules, sizeof(e->rules));
+}
+
+// Handles one connect, taking ownership of the record.
+static void connect_event(AppConfig *config, DeviceRecord *record) {
+    latency_begin();
+    rule_cost_next_event();
+    flight_note_device(FLIGHT_CONNECT, record);
+    overload_note_event(config);
+    record->connectedAt = now_seconds();
+    counters.connects++;
+    rollup_note_connect(record);
+    flapper_note(record);
+    DeviceRecord *device = registry_add(record);
+    if (overload.level < LEVEL_COUNT_ONLY) {
+        printf("DAEMON: Received connect (matched) event [%016llx].\n", (unsigned long long)flight.event);
+        fflush(stdout);
+    }
+    if (device && condition_passes(config, device, "connect")) {
+        reports_write(config, device);
+        if (overload.level < LEVEL_COUNT_ONLY) dbus_emit(1, device);
+        dispatch_event(config, device->serial, 1);
+    }
+    latency_end(1, device);
 }
 
 // Callback for device connection.
 void deviceConnected(void *refcon, io_iterator_t iterator) {
     AppConfig *config = (AppConfig *)refcon;
     io_service_t service;
+    latency.batchStart = now_seconds();
     while ((service = IOIteratorNext(iterator))) {
-        printf("DAEMON: Received connect (matched) event.\n");
-        fflush(stdout);
-        run_script(config->onConnectScript);
+        DeviceRecord record;
+        device_read(service, &record);
         IOObjectRelease(service);
+        if (handoff.count > 0 && handoff_claim(config, &record)) continue;
+        if (!filters_match(config, &record)) {
+            device_release(&record);
+            continue;
+        }
+        connect_event(config, &record);
+    }
+    events_flush(config);
+}
+
+// Handles one disconnect of a device already removed from the registry, and
+// releases its record.
+static void disconnect_event(AppConfig *config, DeviceRecord *record) {
+    latency_begin();
+    rule_cost_next_event();
+    flight_note_device(FLIGHT_DISCONNECT, record);
+    overload_note_event(config);
+    counters.disconnects++;
+    rollup_note_disconnect(record);
+    flapper_note(record);
+    if (overload.level < LEVEL_COUNT_ONLY) {
+        printf("DAEMON: Received disconnect (terminated) event [%016llx].\n", (unsigned long long)flight.event);
+        fflush(stdout);
+    }
+    if (condition_passes(config, record, "disconnect")) {
+        if (overload.level < LEVEL_COUNT_ONLY) dbus_emit(0, record);
+        dispatch_event(config, record->serial, 0);
     }
+    latency_end(0, record);
+    device_release(record);
 }
 
 // Callback for device disconnection.
 void deviceDisconnected(void *refcon, io_iterator_t iterator) {
     AppConfig *config = (AppConfig *)refcon;
     io_service_t service;
+    latency.batchStart = now_seconds();
     while ((service = IOIteratorNext(iterator))) {
-        printf("DAEMON: Received disconnect (terminated) event.\n");
-        fflush(stdout);
-        run_script(config->onDisconnectScript);
+        DeviceRecord record;
+        uint64_t entryID = 0;
+        IORegistryEntryGetRegistryEntryID(service, &entryID);
+        // Conditions see the registry as it is after the event, while the
+        // record keeps its cached attributes until it is released.
+        if (!registry_take(entryID, &record) && !handoff_take(entryID, &record)) {
+            device_read(service, &record);
+            if (!filters_match(config, &record)) {
+                IOObjectRelease(service);
+                device_release(&record);
+                continue;
+            }
+        }
         IOObjectRelease(service);
+        disconnect_event(config, &record);
     }
+    events_flush(config);
 }
 
 // Helper function to build the IOKit matching dictionary from user flags.
@@ -68,16 +3806,6 @@ CFMutableDictionaryRef createMatchingDictionary(const AppConfig *config) {
         CFDictionarySetValue(dict, CFSTR("ProductID"), num);
         CFRelease(num);
     }
-    if (config->usagePage > 0) {
-        CFNumberRef num = CFNumberCreate(kCFAllocatorDefault, kCFNumberLongType, &config->usagePage);
-        CFDictionarySetValue(dict, CFSTR("PrimaryUsagePage"), num);
-        CFRelease(num);
-    }
-    if (config->usage > 0) {
-        CFNumberRef num = CFNumberCreate(kCFAllocatorDefault, kCFNumberLongType, &config->usage);
-        CFDictionarySetValue(dict, CFSTR("PrimaryUsage"), num);
-        CFRelease(num);
-    }
     if (config->productName) {
         CFStringRef str = CFStringCreateWithCString(kCFAllocatorDefault, config->productName, kCFStringEncodingUTF8);
         CFDictionarySetValue(dict, CFSTR("Product"), str);
@@ -88,27 +3816,1377 @@ CFMutableDictionaryRef createMatchingDictionary(const AppConfig *config) {
         CFDictionarySetValue(dict, CFSTR("DeviceAddress"), str);
         CFRelease(str);
     }
+    // Port prefixes are matched by the daemon; IOKit only compares values.
+    if (config->portLocationID) {
+        CFNumberRef num = CFNumberCreate(kCFAllocatorDefault, kCFNumberLongType, &config->portLocationID);
+        CFDictionarySetValue(dict, CFSTR("LocationID"), num);
+        CFRelease(num);
+    }
     return dict;
 }
 
+// --- Control socket ---------------------------------------------------------
+//
+// A Unix stream socket on the run loop. A client writes one command line and
+// reads the reply until the daemon closes the connection, e.g.
+//   echo metrics | nc -U /var/run/hidkitd.sock
+
+typedef void (*ControlHandler)(FILE *out, const char *args);
+
+static int controlFd = -1;
+static char *const *daemonArgv;
+
+// A connected client. Its command and its reply move only as far as the
+// socket allows each time the run loop calls back, so a client that is slow
+// to write or to read never holds up event handling.
+typedef struct {
+    CFFileDescriptorRef fdRef;
+    char line[256];
+    size_t lineLength;
+    char *reply;   // From open_memstream once the command has run.
+    size_t replyLength, replySent;
+    uid_t peerUid;   // (uid_t)-1 if it could not be told.
+} ControlClient;
+
+#define CONTROL_CLIENTS 8   // Past this, a new client drops the oldest one.
+static ControlClient *controlClients[CONTROL_CLIENTS];   // Oldest first.
+static int controlClientCount;
+static int upgradeRequested;   // Set by the upgrade command, run once its client is gone.
+static uid_t controlPeerUid;   // Of the client whose command is running.
+
+// Writes one Prometheus histogram from per-bucket counts.
+static void write_histogram(FILE *out, const char *name, const double *bounds, int buckets,
+                            const unsigned long *counts, double sum) {
+    unsigned long cumulative = 0;
+    for (int b = 0; b < buckets; b++) {
+        char le[16] = "+Inf";
+        if (b < buckets - 1) snprintf(le, sizeof(le), "%g", bounds[b]);
+        cumulative += counts[b];
+        fprintf(out, "%s_bucket{le=\"%s\"} %lu\n", name, le, cumulative);
+    }
+    fprintf(out, "%s_sum %.6f\n", name, sum);
+    fprintf(out, "%s_count %lu\n", name, cumulative);
+}
+
+static void control_metrics(FILE *out, const char *args) {
+    (void)args;
+    fprintf(out, "hidkitd_events_total{kind=\"connect\"} %lu\n", counters.connects);
+    fprintf(out, "hidkitd_events_total{kind=\"disconnect\"} %lu\n", counters.disconnects);
+    fprintf(out, "hidkitd_actions_total %lu\n", counters.spawns);
+    fprintf(out, "hidkitd_actions_deduplicated_total %lu\n", eventActions.deduplicated);
+    fprintf(out, "hidkitd_startup_seconds %.6f\n", counters.startupSeconds);
+    fprintf(out, "hidkitd_devices_connected %zu\n", deviceCount);
+    fprintf(out, "hidkitd_rules %zu\n", ruleset.count);
+    fprintf(out, "hidkitd_overload_level %d\n", (int)overload.level);
+    fprintf(out, "hidkitd_overload_transitions_total %lu\n", overload.transitions);
+    fprintf(out, "hidkitd_overload_coalesced_events_total %lu\n", overload.coalescedEvents);
+    fprintf(out, "hidkitd_overload_dropped_actions_total %lu\n", overload.droppedActions);
+    write_histogram(out, "hidkitd_event_latency_seconds", latencyBounds, LATENCY_BUCKETS, latency.counts, latency.sum);
+    const char *stages[] = { "queue_wait", "spawn", "action" };
+    for (int i = 0; i < 3; i++) {
+        fprintf(out, "hidkitd_event_stage_seconds_total{stage=\"%s\"} %.6f\n", stages[i], latency.stageSums[i]);
+    }
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        if (latency.captured[b] == 0) continue;
+        char le[16] = "+Inf";
+        if (b < LATENCY_BUCKETS - 1) snprintf(le, sizeof(le), "%g", latencyBounds[b]);
+        fprintf(out, "hidkitd_event_latency_exemplars_total{le=\"%s\"} %lu\n", le, latency.captured[b]);
+    }
+#ifdef HIDKITD_STANDIN
+    write_histogram(out, "hidkitd_kernel_delivery_seconds", deliveryBounds, DELIVERY_BUCKETS, delivery.counts,
+                    delivery.sum);
+    unsigned long received, lost;
+    IOStandInKernelEventStats(&received, &lost);
+    fprintf(out, "hidkitd_kernel_events_received_total %lu\n", received);
+    fprintf(out, "hidkitd_kernel_events_lost_total %lu\n", lost);
+#endif
+    const RollupTable *tables[] = { &deviceRollups, &modelRollups };
+    for (int i = 0; i < 2; i++) {
+        fprintf(out, "hidkitd_rollup_keys{table=\"%s\"} %d\n", tables[i]->name, tables[i]->count);
+        fprintf(out, "hidkitd_rollup_evictions_total{table=\"%s\"} %lu\n", tables[i]->name, tables[i]->evictions);
+    }
+    fprintf(out, "hidkitd_reports_total{result=\"written\"} %lu\n", reports.written);
+    fprintf(out, "hidkitd_reports_total{result=\"failed\"} %lu\n", reports.failed);
+    fprintf(out, "hidkitd_reports_total{result=\"mismatched\"} %lu\n", reports.mismatched);
+    fprintf(out, "hidkitd_report_seconds_total %.6f\n", reports.seconds);
+    if (wal.fd >= 0) {
+        fprintf(out, "hidkitd_wal_records_total %lu\n", wal.records);
+        fprintf(out, "hidkitd_wal_commits_total %lu\n", wal.commits);
+        fprintf(out, "hidkitd_wal_sync_seconds_total %.6f\n", wal.syncSeconds);
+        fprintf(out, "hidkitd_wal_replayed_total %lu\n", wal.replayed);
+    }
+    if (dbus.address) {
+        fprintf(out, "hidkitd_dbus_connected %d\n", dbus.state == DBUS_READY);
+        fprintf(out, "hidkitd_dbus_signals_total %lu\n", dbus.sent);
+        fprintf(out, "hidkitd_dbus_signals_dropped_total %lu\n", dbus.dropped);
+    }
+    for (int i = 0; i < MEM_TAG_COUNT; i++) {
+        fprintf(out, "hidkitd_memory_live_bytes{subsystem=\"%s\"} %zu\n", memTagNames[i], memStats[i].live);
+        fprintf(out, "hidkitd_memory_peak_bytes{subsystem=\"%s\"} %zu\n", memTagNames[i], memStats[i].peak);
+        fprintf(out, "hidkitd_memory_allocations_total{subsystem=\"%s\"} %lu\n", memTagNames[i], memStats[i].allocations);
+    }
+    FlapperSlot top[10];
+    int n = flapper_top(top, 10);
+    for (int i = 0; i < n; i++) {
+        fprintf(out, "hidkitd_top_flapper_events_per_minute{device=\"%s\",rank=\"%d\"} %.3f\n", top[i].key, i + 1, top[i].count);
+    }
+}
+
+static void control_flappers(FILE *out, const char *args) {
+    int max = *args ? atoi(args) : 10;
+    if (max <= 0) max = 10;
+    if (max > flappers.used) max = flappers.used;
+    FlapperSlot *top = mem_alloc(MEM_OTHER, sizeof(FlapperSlot) * (max ? max : 1));
+    if (!top) return;
+    int n = flapper_top(top, max);
+    for (int i = 0; i < n; i++) {
+        fprintf(out, "%d %s events_per_minute=%.3f error=%.3f\n", i + 1, top[i].key, top[i].count, top[i].error);
+    }
+    mem_free(top);
+}
+
+static void control_rollups(FILE *out, const char *args) {
+    if (!*args || strcmp(args, "model") == 0) rollup_write(out, &modelRollups);
+    if (!*args || strcmp(args, "device") == 0) rollup_write(out, &deviceRollups);
+}
+
+static void control_help(FILE *out, const char *args);
+
+static void control_memory(FILE *out, const char *args) {
+    (void)args;
+    size_t live = 0, peak = 0;
+    fprintf(out, "%-12s %12s %12s %12s\n", "subsystem", "live", "peak", "allocations");
+    for (int i = 0; i < MEM_TAG_COUNT; i++) {
+        fprintf(out, "%-12s %12zu %12zu %12lu\n", memTagNames[i], memStats[i].live, memStats[i].peak, memStats[i].allocations);
+        live += memStats[i].live;
+        peak += memStats[i].peak;
+    }
+    fprintf(out, "%-12s %12zu %12zu\n", "total", live, peak);
+}
+
+// Rules that matched at least once, in file order.
+static void control_rules(FILE *out, const char *args) {
+    (void)args;
+    for (size_t i = 0; i < ruleset.count; i++) {
+        const Rule *rule = &ruleset.rules[i];
+        if (rule->hits == 0) continue;
+        fprintf(out, "%s hits=%lu deduplicated=%lu\n", rule->pattern, rule->hits, rule->deduplicated);
+    }
+}
+
+typedef struct {
+    const char *name;
+    uint64_t ticks;
+    unsigned long samples;
+} CostEntry;
+
+static int compare_cost(const void *a, const void *b) {
+    const CostEntry *x = a, *y = b;
+    return x->ticks < y->ticks ? 1 : x->ticks > y->ticks ? -1 : 0;
+}
+
+// Where matching time goes in sampled events, most expensive first: each
+// wildcard rule, the exact-serial lookup and the condition. Totals are
+// scaled up to all events. `args` limits the number of lines (default 20).
+static void control_rulecost(FILE *out, const char *args) {
+    long limit = *args ? strtol(args, NULL, 10) : 20;
+    CostEntry *entries = mem_alloc(MEM_OTHER, (ruleset.count + 2) * sizeof(*entries));
+    if (!entries) {
+        fprintf(out, "error: out of memory\n");
+        return;
+    }
+    size_t count = 0;
+    uint64_t total = 0;
+    if (ruleset.count) entries[count++] = (CostEntry){ "(exact serial lookup)", ruleCost.exactTicks, ruleCost.sampled };
+    if (ruleCost.conditionSamples) {
+        entries[count++] = (CostEntry){ "(condition)", ruleCost.conditionTicks, ruleCost.conditionSamples };
+    }
+    for (size_t i = 0; i < ruleset.count; i++) {
+        const Rule *rule = &ruleset.rules[i];
+        if (rule->costSamples) entries[count++] = (CostEntry){ rule->pattern, rule->costTicks, rule->costSamples };
+    }
+    for (size_t i = 0; i < count; i++) total += entries[i].ticks;
+    qsort(entries, count, sizeof(*entries), compare_cost);
+    double perNs = ticks_per_ns();
+    fprintf(out, "# 1 in %lu events sampled, %lu so far; est_total scales samples to all events\n",
+            ruleCost.every, ruleCost.sampled);
+    fprintf(out, "%-5s %7s %10s %13s %9s  %s\n", "rank", "share", "mean_ns", "est_total_ms", "samples", "rule");
+    for (size_t i = 0; i < count && (long)i < limit; i++) {
+        const CostEntry *e = &entries[i];
+        double ns = (double)e->ticks / perNs;
+        fprintf(out, "%-5zu %6.1f%% %10.1f %13.3f %9lu  %s\n", i + 1, total ? 100.0 * (double)e->ticks / (double)total : 0,
+                e->samples ? ns / (double)e->samples : 0, ns * (double)ruleCost.every / 1e6, e->samples, e->name);
+    }
+    mem_free(entries);
+}
+
+// The exemplars of slow events, newest first per bucket; `args` may name one
+// bucket by its le label as shown in metrics.
+static void control_exemplars(FILE *out, const char *args) {
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+        char le[16] = "+Inf";
+        if (b < LATENCY_BUCKETS - 1) snprintf(le, sizeof(le), "%g", latencyBounds[b]);
+        if (*args && strcmp(args, le) != 0) continue;
+        unsigned long kept = latency.captured[b] < EXEMPLARS_PER_BUCKET ? latency.captured[b] : EXEMPLARS_PER_BUCKET;
+        for (unsigned long k = 1; k <= kept; k++) {
+            const Exemplar *e = &latency.exemplars[b][(latency.captured[b] - k) % EXEMPLARS_PER_BUCKET];
+            fprintf(out, "le=%s event=#%016llx %s time=%lld.%06lld latency=%.6f queue_wait=%.6f spawn=%.6f action=%.6f"
+                         " vid=%ld pid=%ld location=0x%lx serial=\"%s\" product=\"%s\" rules=",
+                    le, (unsigned long long)e->event, e->connected ? "connect" : "disconnect", (long long)(e->timeUs / 1000000),
+                    (long long)(e->timeUs % 1000000), e->latency, e->queueWait, e->spawn, e->action,
+                    e->vendorID, e->productID, (unsigned long)e->locationID, e->serial, e->product);
+            for (int r = 0; r < e->ruleCount && r < EXEMPLAR_RULES; r++) {
+                fprintf(out, "%s%s", r ? "," : "", ruleset.rules[e->rules[r]].pattern);
+            }
+            if (e->ruleCount > EXEMPLAR_RULES) fprintf(out, ",+%d", e->ruleCount - EXEMPLAR_RULES);
+            if (e->ruleCount == 0) fprintf(out, "-");
+            fprintf(out, "\n");
+        }
+    }
+}
+
+// Dumps the flight recorder to this connection (-) or to the file SIGUSR1
+// and crashes use. Clients cannot name a file: the daemon may be root.
+static void control_flight(FILE *out, const char *args) {
+    if (strcmp(args, "-") == 0) flight_dump(-1, out);
+    else if (*args) fprintf(out, "error: flight takes - or nothing; dumps go to %s\n", flight.path);
+    else if (flight_dump_file(flight.path)) fprintf(out, "wrote %s\n", flight.path);
+    else fprintf(out, "error: cannot write %s: %s\n", flight.path, strerror(errno));
+}
+
+// Only the daemon's own binary is exec'd, and only for a client running as
+// the daemon's user (or root): anyone else who can reach the socket must
+// not be able to replace the daemon.
+static void control_upgrade(FILE *out, const char *args) {
+    if (*args) {
+        fprintf(out, "error: upgrade takes no arguments; it re-execs %s\n", daemonArgv[0]);
+    } else if (controlPeerUid != geteuid() && controlPeerUid != 0) {
+        fprintf(out, "error: upgrade is only allowed for uid %u\n", (unsigned)geteuid());
+    } else {
+        upgradeRequested = 1;
+        fprintf(out, "upgrading to %s\n", daemonArgv[0]);
+    }
+}
+
+static const struct {
+    const char *name;
+    ControlHandler handler;
+    const char *help;
+} controlCommands[] = {
+    { "metrics", control_metrics, "counters and gauges in Prometheus text format" },
+    { "rollups", control_rollups, "[model|device] per-key activity over the rollup window" },
+    { "rules", control_rules, "per-rule hits, and how often a rule's action was merged with another's" },
+    { "memory", control_memory, "live and peak heap bytes by subsystem" },
+    { "flappers", control_flappers, "[n] devices with the highest recent event rate" },
+    { "rulecost", control_rulecost, "[n] the rules (and lookup, condition) taking the most matching time" },
+    { "exemplars", control_exemplars, "[le] slow events kept per latency bucket, with where their time went" },
+    { "flight", control_flight, "[-] dump the flight recorder of recent events (- to this connection)" },
+    { "upgrade", control_upgrade, "re-exec the daemon's binary, keeping all state" },
+    { "help", control_help, "this list" },
+};
+
+static void control_help(FILE *out, const char *args) {
+    (void)args;
+    for (size_t i = 0; i < sizeof(controlCommands) / sizeof(controlCommands[0]); i++) {
+        fprintf(out, "%-10s %s\n", controlCommands[i].name, controlCommands[i].help);
+    }
+}
+
+static void control_client_close(ControlClient *client) {
+    int i = 0;
+    while (i < controlClientCount && controlClients[i] != client) i++;
+    memmove(&controlClients[i], &controlClients[i + 1], sizeof(*controlClients) * (size_t)(controlClientCount - i - 1));
+    controlClientCount--;
+    CFFileDescriptorInvalidate(client->fdRef);   // Also closes the socket.
+    CFRelease(client->fdRef);
+    free(client->reply);
+    mem_free(client);
+}
+
+// Runs the client's command into its reply buffer; returns 0 if out of memory.
+static int control_run(ControlClient *client) {
+    char *line = client->line;
+    line[client->lineLength] = '\0';
+    line[strcspn(line, "\r\n")] = '\0';
+    controlPeerUid = client->peerUid;
+    char *args = line + strcspn(line, " ");
+    if (*args) *args++ = '\0';
+    FILE *out = open_memstream(&client->reply, &client->replyLength);
+    if (!out) return 0;
+    size_t i = 0, count = sizeof(controlCommands) / sizeof(controlCommands[0]);
+    while (i < count && strcmp(controlCommands[i].name, line) != 0) i++;
+    if (i < count) controlCommands[i].handler(out, args);
+    else fprintf(out, "error: unknown command '%s' (try help)\n", line);
+    return fclose(out) == 0;
+}
+
+// Sends as much of the reply as the socket takes; returns 0 while some is
+// left. A client that went away counts as done.
+static int control_send(ControlClient *client) {
+    int fd = CFFileDescriptorGetNativeDescriptor(client->fdRef);
+    while (client->replySent < client->replyLength) {
+        ssize_t sent = send(fd, client->reply + client->replySent, client->replyLength - client->replySent, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if (sent <= 0) return 1;
+        client->replySent += (size_t)sent;
+    }
+    return 1;
+}
+
+// Execs `binary` with the same arguments, handing over the state. Only
+// returns if the exec failed, in which case this process carries on.
+static void upgrade_exec(const char *binary) {
+    wal_commit();
+    FILE *state = tmpfile();
+    if (!state) {
+        fprintf(stderr, "DAEMON_ERROR: Cannot create handoff state: %s.\n", strerror(errno));
+        return;
+    }
+    handoff_write(state);
+    fflush(state);
+    char fdText[16];
+    snprintf(fdText, sizeof(fdText), "%d", fileno(state));
+    setenv("HIDKITD_HANDOFF_FD", fdText, 1);
+    if (controlFd >= 0) {
+        char controlText[16];
+        snprintf(controlText, sizeof(controlText), "%d", controlFd);
+        setenv("HIDKITD_CONTROL_FD", controlText, 1);
+        fcntl(controlFd, F_SETFD, 0);
+    }
+    printf("DAEMON: Upgrading to %s with %zu device(s).\n", binary, deviceCount);
+    fflush(stdout);
+    execvp(binary, daemonArgv);
+
+    fprintf(stderr, "DAEMON_ERROR: Cannot exec %s: %s.\n", binary, strerror(errno));
+    if (controlFd >= 0) fcntl(controlFd, F_SETFD, FD_CLOEXEC);
+    unsetenv("HIDKITD_HANDOFF_FD");
+    unsetenv("HIDKITD_CONTROL_FD");
+    fclose(state);
+}
+
+// Reads the command line until its newline (or EOF), runs it, then writes
+// the reply and closes the connection.
+static void controlClientEvent(CFFileDescriptorRef fdRef, CFOptionFlags callBackTypes, void *info) {
+    (void)callBackTypes;
+    ControlClient *client = info;
+    if (!client->reply) {
+        size_t room = sizeof(client->line) - 1 - client->lineLength;
+        ssize_t n = recv(CFFileDescriptorGetNativeDescriptor(fdRef), client->line + client->lineLength, room, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            CFFileDescriptorEnableCallBacks(fdRef, kCFFileDescriptorReadCallBack);
+            return;
+        }
+        if (n > 0) client->lineLength += (size_t)n;
+        if (n > 0 && (size_t)n < room && !memchr(client->line, '\n', client->lineLength)) {
+            CFFileDescriptorEnableCallBacks(fdRef, kCFFileDescriptorReadCallBack);
+            return;
+        }
+        if (n < 0 || !control_run(client)) {
+            control_client_close(client);
+            return;
+        }
+    }
+    if (!control_send(client)) {
+        CFFileDescriptorEnableCallBacks(fdRef, kCFFileDescriptorWriteCallBack);
+        return;
+    }
+    control_client_close(client);
+    if (upgradeRequested) {
+        upgradeRequested = 0;
+        upgrade_exec(daemonArgv[0]);
+    }
+}
+
+// The uid of the process at the other end of `fd`, or (uid_t)-1.
+static uid_t control_peer_uid(int fd) {
+#ifdef __APPLE__
+    uid_t uid;
+    gid_t gid;
+    if (getpeereid(fd, &uid, &gid) == 0) return uid;
+#else
+    struct ucred cred;
+    socklen_t length = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &length) == 0) return cred.uid;
+#endif
+    return (uid_t)-1;
+}
+
+static void controlAccept(CFFileDescriptorRef fdRef, CFOptionFlags callBackTypes, void *info) {
+    (void)callBackTypes;
+    (void)info;
+    CFFileDescriptorEnableCallBacks(fdRef, kCFFileDescriptorReadCallBack);
+    int fd = accept(CFFileDescriptorGetNativeDescriptor(fdRef), NULL, NULL);
+    if (fd < 0) return;
+    ControlClient *client = mem_calloc(MEM_OTHER, 1, sizeof(*client));
+    if (!client) {
+        close(fd);
+        return;
+    }
+    client->peerUid = control_peer_uid(fd);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+#ifdef SO_NOSIGPIPE
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+    CFFileDescriptorContext context = { 0, client, NULL, NULL, NULL };
+    client->fdRef = CFFileDescriptorCreate(kCFAllocatorDefault, fd, true, controlClientEvent, &context);
+    CFRunLoopSourceRef source = CFFileDescriptorCreateRunLoopSource(kCFAllocatorDefault, client->fdRef, 0);
+    CFRunLoopAddSource(CFRunLoopGetCurrent(), source, kCFRunLoopDefaultMode);
+    CFRelease(source);
+    CFFileDescriptorEnableCallBacks(client->fdRef, kCFFileDescriptorReadCallBack);
+    if (controlClientCount == CONTROL_CLIENTS) control_client_close(controlClients[0]);
+    controlClients[controlClientCount++] = client;
+}
+
+// Returns the listening socket handed over by a previous process on upgrade
+// or by a socket-activating service manager (the LISTEN_FDS protocol), or
+// -1. With several sockets, the one named "control" in LISTEN_FDNAMES is
+// used, otherwise the first.
+static int inherited_control_socket(void) {
+    const char *upgraded = getenv("HIDKITD_CONTROL_FD");
+    if (upgraded) {
+        int fd = atoi(upgraded);
+        unsetenv("HIDKITD_CONTROL_FD");
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        return fd;
+    }
+    const char *pid = getenv("LISTEN_PID"), *fds = getenv("LISTEN_FDS"), *names = getenv("LISTEN_FDNAMES");
+    if (!pid || !fds || strtol(pid, NULL, 10) != (long)getpid()) return -1;
+    int count = atoi(fds), index = 0;
+    for (int i = 0; names && *names; i++) {
+        size_t len = strcspn(names, ":");
+        if (len == 7 && strncmp(names, "control", 7) == 0) index = i;
+        names += len + (names[len] == ':');
+    }
+    // Scripts must not see the variables or inherit the socket.
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+    if (index >= count) return -1;
+    fcntl(3 + index, F_SETFD, FD_CLOEXEC);
+    return 3 + index;
+}
+
+// Adds the control socket to the run loop: the inherited one if the daemon
+// was socket-activated, otherwise a new one at `path` (if given).
+static int control_open(const char *path) {
+    int fd = inherited_control_socket();
+    if (fd < 0 && !path) return 1;
+    if (fd < 0) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        if (strlen(path) >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "DAEMON_ERROR: Control socket path %s is too long.\n", path);
+            return 0;
+        }
+        strcpy(addr.sun_path, path);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        unlink(path);
+        // Created 0600: the commands are for the daemon's own user.
+        mode_t mask = umask(0177);
+        int bound = fd >= 0 && bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        umask(mask);
+        if (!bound || listen(fd, 8) != 0) {
+            fprintf(stderr, "DAEMON_ERROR: Cannot listen on control socket %s.\n", path);
+            if (fd >= 0) close(fd);
+            return 0;
+        }
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+    controlFd = fd;
+    CFFileDescriptorRef fdRef = CFFileDescriptorCreate(kCFAllocatorDefault, fd, true, controlAccept, NULL);
+    CFFileDescriptorEnableCallBacks(fdRef, kCFFileDescriptorReadCallBack);
+    CFRunLoopSourceRef source = CFFileDescriptorCreateRunLoopSource(kCFAllocatorDefault, fdRef, 0);
+    CFRunLoopAddSource(CFRunLoopGetCurrent(), source, kCFRunLoopDefaultMode);
+    CFRelease(source);
+    return 1;
+}
+
+// Loads the rules and starts the timers and the WAL: everything event
+// handling needs besides the event source itself.
+static int services_start(AppConfig *config) {
+    config->onConnectKey = action_key(config->onConnectScript);
+    config->onDisconnectKey = action_key(config->onDisconnectScript);
+    if (config->rulesPath) {
+        if (!rules_load(config->rulesPath, config->priority)) return 0;
+        if (config->ruleThreads <= 0) {
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            config->ruleThreads = cpus < 1 ? 1 : cpus > 8 ? 8 : (int)cpus;
+        }
+        if (ruleset.patternCount < PARALLEL_MIN_RULES) config->ruleThreads = 1;
+        if (!rule_pool_start(config->ruleThreads)) return 0;
+        printf("DAEMON: Loaded %zu rules (%zu wildcard) from %s, matching on %d thread(s).\n",
+               ruleset.count, ruleset.patternCount, config->rulesPath, config->ruleThreads);
+    }
+    handoff_rules();
+
+    if (dbus.address) dbus_connect();   // Ready by the first event, normally.
+
+    overload.windowStart = now_seconds();
+    overload.nextTick = overload.windowStart + OVERLOAD_TICK_SECONDS;
+    timer_add(OVERLOAD_TICK_SECONDS, OVERLOAD_TICK_SECONDS, overloadTick, config);
+    if (config->rollupExportPath) {
+        double interval = config->rollupExportSeconds > 0 ? config->rollupExportSeconds : rollupBucketSeconds;
+        timer_add(interval, interval, rollupExportTick, (void *)config->rollupExportPath);
+    }
+
+    // Unfinished actions from before a crash run before any new event's.
+    return !wal.path || wal_open();
+}
+
+// --- Simulation -------------------------------------------------------------
+//
+// --simulate replays a trace of device events against a virtual clock,
+// through the same handlers as live notifications, with timers firing in
+// between as time advances. Scripts are logged rather than run and there is
+// no D-Bus, so a trace of days replays in milliseconds with identical
+// output every time. A trace has one event per line:
+//
+//   epoch 1718000000                        (optional) Unix time of t=0
+//   0.000  connect kb VendorID=1133 ProductID=0xc52b SerialNumber=ABC Product="USB Receiver"
+//   +12.5  disconnect kb                    (+ is relative to the previous line)
+//
+// Properties other than the matching ones are served to --attr and attr().
+
+#define SIM_DEFAULT_EPOCH 1704067200   // 2024-01-01T00:00:00Z
+
+typedef struct {
+    char tag[64];
+    uint64_t entryID;
+    int matched;
+} SimDevice;
+
+// Splits off the next whitespace-separated token; double quotes group words.
+static char *sim_token(char **cursor) {
+    char *s = *cursor + strspn(*cursor, " \t\r\n");
+    if (!*s) return NULL;
+    char *out = s, *token = s;
+    int quoted = 0;
+    for (; *s && (quoted || !strchr(" \t\r\n", *s)); s++) {
+        if (*s == '"') quoted = !quoted;
+        else *out++ = *s;
+    }
+    *cursor = *s ? s + 1 : s;
+    *out = '\0';
+    return token;
+}
+
+// Fills a record from key=value properties, like device_read() does from
+// the registry.
+static void sim_device_read(char *cursor, DeviceRecord *record) {
+    char *token;
+    uint8_t descriptor[MAX_DESCRIPTOR_BYTES];
+    long descriptorLength = 0;
+    while ((token = sim_token(&cursor))) {
+        char *value = strchr(token, '=');
+        if (!value) continue;
+        *value++ = '\0';
+        if (strcmp(token, "VendorID") == 0) record->vendorID = strtol(value, NULL, 0);
+        else if (strcmp(token, "ProductID") == 0) record->productID = strtol(value, NULL, 0);
+        else if (strcmp(token, "PrimaryUsagePage") == 0) record->usagePage = strtol(value, NULL, 0);
+        else if (strcmp(token, "PrimaryUsage") == 0) record->usage = strtol(value, NULL, 0);
+        else if (strcmp(token, "LocationID") == 0) record->locationID = strtol(value, NULL, 0);
+        else if (strcmp(token, "Product") == 0) snprintf(record->product, sizeof(record->product), "%s", value);
+        else if (strcmp(token, "SerialNumber") == 0) snprintf(record->serial, sizeof(record->serial), "%s", value);
+        else if (strcmp(token, "DeviceAddress") == 0) snprintf(record->address, sizeof(record->address), "%s", value);
+        else if (strcmp(token, "ReportDescriptor") == 0) {
+            if (strncmp(value, "hex:", 4) == 0) value += 4;
+            descriptorLength = hex_decode(value, descriptor, sizeof(descriptor));
+            if (descriptorLength < 0) descriptorLength = 0;
+        }
+        for (int i = 0; i < attributeCount; i++) {
+            if (strcmp(attributeNames[i], token) != 0) continue;
+            mem_free(record->attributes[i]);
+            record->attributes[i] = mem_strdup(MEM_REGISTRY, value);
+            record->attributesFetched |= 1u << i;
+        }
+    }
+    device_parse_collections(record, descriptor, (size_t)descriptorLength);
+}
+
+// The matching dictionary's job: whether a device passes the filters.
+static int sim_matches(const AppConfig *config, const DeviceRecord *record) {
+    return (config->vendorID <= 0 || record->vendorID == config->vendorID) &&
+           (config->productID <= 0 || record->productID == config->productID) &&
+           (!config->productName || strcmp(record->product, config->productName) == 0) &&
+           (!config->deviceAddress || strcmp(record->address, config->deviceAddress) == 0) &&
+           filters_match(config, record);
+}
+
+static int simulate(AppConfig *config, const char *path) {
+    FILE *in = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!in) {
+        fprintf(stderr, "Error: Cannot read trace %s.\n", path);
+        return 1;
+    }
+    double realStart = now_seconds();
+    daemonClock.isVirtual = 1;
+    daemonClock.now = SIM_DEFAULT_EPOCH;
+    dbus.address = NULL;
+
+    SimDevice *sims = NULL;
+    size_t simCount = 0, simCapacity = 0, events = 0;
+    uint64_t nextEntryID = 1;
+    int started = 0;
+    double epoch = daemonClock.now, t = 0;
+    char line[2048];
+    for (int lineNo = 1; fgets(line, sizeof(line), in); lineNo++) {
+        char *cursor = line, *when = sim_token(&cursor);
+        if (!when || when[0] == '#') continue;
+        // The epoch has to be known before the timers are started.
+        char *value;
+        if (!started && strcmp(when, "epoch") == 0 && (value = sim_token(&cursor))) {
+            daemonClock.now = epoch = strtod(value, NULL);
+            continue;
+        }
+        if (!started && !(started = services_start(config))) return 1;
+        char *end;
+        double at = strtod(when, &end) + (when[0] == '+' ? t : 0);
+        char *kind = sim_token(&cursor), *tag = sim_token(&cursor);
+        if (*end || !kind || !tag || at < t || strlen(tag) >= sizeof(sims->tag)) {
+            fprintf(stderr, "Error: %s:%d: expected `<time> connect|disconnect <tag> [Key=value...]`.\n", path, lineNo);
+            return 1;
+        }
+        t = at;
+        clock_advance(epoch + t);
+        SimDevice *sim = NULL;
+        for (size_t i = 0; i < simCount && !sim; i++) {
+            if (strcmp(sims[i].tag, tag) == 0) sim = &sims[i];
+        }
+        if (strcmp(kind, "connect") == 0) {
+            if (sim && sim->entryID) continue;   // Already connected.
+            if (!sim) {
+                if (simCount == simCapacity) {
+                    size_t capacity = simCapacity ? simCapacity * 2 : 16;
+                    SimDevice *grown = mem_realloc(MEM_OTHER, sims, capacity * sizeof(*sims));
+                    if (!grown) {
+                        fprintf(stderr, "Error: %s:%d: out of memory.\n", path, lineNo);
+                        return 1;
+                    }
+                    sims = grown;
+                    simCapacity = capacity;
+                }
+                sim = &sims[simCount++];
+                snprintf(sim->tag, sizeof(sim->tag), "%s", tag);
+            }
+            DeviceRecord record = {0};
+            record.entryID = sim->entryID = nextEntryID++;
+            sim_device_read(cursor, &record);
+            sim->matched = sim_matches(config, &record);
+            events++;
+            printf("SIM: %12.3f connect %s\n", t, tag);
+            if (sim->matched) connect_event(config, &record);
+            else device_release(&record);
+        } else if (strcmp(kind, "disconnect") == 0) {
+            if (!sim || !sim->entryID) continue;
+            DeviceRecord record;
+            events++;
+            printf("SIM: %12.3f disconnect %s\n", t, tag);
+            if (sim->matched && registry_take(sim->entryID, &record)) disconnect_event(config, &record);
+            sim->entryID = 0;
+        } else {
+            fprintf(stderr, "Error: %s:%d: unknown event %s.\n", path, lineNo, kind);
+            return 1;
+        }
+        events_flush(config);
+    }
+    if (in != stdin) fclose(in);
+    if (!started && !services_start(config)) return 1;
+    // Let pending timers (WAL window, overload recovery) settle.
+    clock_advance(epoch + t + OVERLOAD_TICK_SECONDS * OVERLOAD_RECOVERY_TICKS * LEVEL_COUNT);
+    printf("SIM: %zu events over %.3f simulated seconds.\n", events, t);
+    control_metrics(stdout, "");
+    daemonClock.isVirtual = 0;
+    fprintf(stderr, "SIM: Replayed in %.1f ms.\n", (now_seconds() - realStart) * 1000.0);
+    mem_free(sims);
+    return 0;
+}
+
+// --- Discovery --------------------------------------------------------------
+//
+// `hidkitd discover` lists the devices the daemon can match, one entry per
+// physical device (its interfaces grouped by LocationID), each with the
+// smallest set of filter flags that matches that device and no other.
+
+#define DISCOVER_PARALLEL_MIN 64   // Fewer services are read on one thread.
+#define FILTER_FIELDS 6
+
+static const char *const filterFlags[FILTER_FIELDS] = {
+    "--vendor-id", "--product-id", "--usage-page", "--usage", "--name", "--address"
+};
+
+typedef struct {
+    const io_service_t *services;
+    DeviceRecord *records;
+    size_t begin, end;
+} DiscoverSlice;
+
+static void *discover_read(void *arg) {
+    DiscoverSlice *slice = arg;
+    for (size_t i = slice->begin; i < slice->end; i++) device_read(slice->services[i], &slice->records[i]);
+    return NULL;
+}
+
+// Whether a filter flag can select on field `f` of `r` (0 and "" mean unset).
+static int filter_usable(const DeviceRecord *r, int f) {
+    switch (f) {
+    case 0: return r->vendorID > 0;
+    case 1: return r->productID > 0;
+    case 2: return r->usagePage > 0;
+    case 3: return r->usage > 0;
+    case 4: return r->product[0] != '\0';
+    default: return r->address[0] != '\0';
+    }
+}
+
+// Whether a top-level collection of `r` has usage page `page` and usage
+// `usage` (-1: any), as the usage filters test.
+static int device_has_usage(const DeviceRecord *r, long page, long usage) {
+    for (int i = 0; i < r->collectionCount; i++) {
+        if ((page < 0 || r->collections[i].usagePage == page) && (usage < 0 || r->collections[i].usage == usage)) return 1;
+    }
+    return 0;
+}
+
+// Whether the filters in `mask`, set from `a`, match interface `b`.
+static int filter_matches(const DeviceRecord *a, const DeviceRecord *b, int mask) {
+    return (!(mask & 1) || a->vendorID == b->vendorID) && (!(mask & 2) || a->productID == b->productID) &&
+           (!(mask & 12) || device_has_usage(b, mask & 4 ? a->usagePage : -1, mask & 8 ? a->usage : -1)) &&
+           (!(mask & 16) || strcmp(a->product, b->product) == 0) && (!(mask & 32) || strcmp(a->address, b->address) == 0);
+}
+
+static int same_device(const DeviceRecord *a, const DeviceRecord *b) {
+    if (a->vendorID != b->vendorID || a->productID != b->productID) return 0;
+    if (a->locationID || b->locationID) return a->locationID == b->locationID;
+    return a->serial[0] && strcmp(a->serial, b->serial) == 0;
+}
+
+static void print_shell_quoted(const char *s) {
+    putchar('\'');
+    for (; *s; s++) {
+        if (*s == '\'') fputs("'\\''", stdout);
+        else putchar(*s);
+    }
+    putchar('\'');
+}
+
+static void print_filter(const DeviceRecord *r, int mask) {
+    const long numbers[4] = { r->vendorID, r->productID, r->usagePage, r->usage };
+    for (int f = 0; f < FILTER_FIELDS; f++) {
+        if (!(mask & (1 << f))) continue;
+        printf(" %s ", filterFlags[f]);
+        if (f < 4) printf("%ld", numbers[f]);
+        else print_shell_quoted(f == 4 ? r->product : r->address);
+    }
+}
+
+static int popcount_order(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    int px = __builtin_popcount((unsigned)x), py = __builtin_popcount((unsigned)y);
+    return px != py ? px - py : x - y;
+}
+
+static int discover(void) {
+    double start = now_seconds();
+    io_iterator_t iterator;
+    if (IOServiceGetMatchingServices(kIOMainPortDefault, IOServiceMatching("IOHIDUserDevice"), &iterator) != KERN_SUCCESS) {
+        fprintf(stderr, "Error: Cannot enumerate HID devices.\n");
+        return 1;
+    }
+    io_service_t *services = NULL;
+    size_t count = 0, capacity = 0;
+    io_service_t service;
+    while ((service = IOIteratorNext(iterator))) {
+        if (count == capacity) {
+            size_t grown = capacity ? capacity * 2 : 64;
+            io_service_t *more = mem_realloc(MEM_OTHER, services, grown * sizeof(*services));
+            if (!more) {
+                IOObjectRelease(service);   // List what fits.
+                continue;
+            }
+            services = more;
+            capacity = grown;
+        }
+        services[count++] = service;
+    }
+    IOObjectRelease(iterator);
+    DeviceRecord *records = mem_calloc(MEM_REGISTRY, count ? count : 1, sizeof(*records));
+    size_t *group = mem_alloc(MEM_OTHER, (count ? count : 1) * sizeof(*group));
+    if (!records || !group) {
+        fprintf(stderr, "Error: Out of memory reading %zu HID services.\n", count);
+        for (size_t i = 0; i < count; i++) IOObjectRelease(services[i]);
+        mem_free(group);
+        mem_free(records);
+        mem_free(services);
+        return 1;
+    }
+
+    // Each property read is a round trip to the kernel, so large hosts read
+    // their services on several threads.
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = count < DISCOVER_PARALLEL_MIN || cpus < 2 ? 1 : cpus > 8 ? 8 : (int)cpus;
+    pthread_t tids[8];
+    DiscoverSlice slices[8];
+    int started = 1;
+    for (int t = 0; t < threads; t++) {
+        slices[t] = (DiscoverSlice){ services, records, count * t / threads, count * (t + 1) / threads };
+    }
+    while (started < threads && pthread_create(&tids[started], NULL, discover_read, &slices[started]) == 0) started++;
+    discover_read(&slices[0]);
+    for (int t = started; t < threads; t++) discover_read(&slices[t]);   // Threads that failed to start.
+    for (int t = 1; t < started; t++) pthread_join(tids[t], NULL);
+
+    size_t groups = 0;
+    for (size_t i = 0; i < count; i++) {
+        group[i] = groups;
+        for (size_t j = 0; j < i; j++) {
+            if (same_device(&records[i], &records[j])) {
+                group[i] = group[j];
+                break;
+            }
+        }
+        if (group[i] == groups) groups++;
+    }
+
+    int masks[(1 << FILTER_FIELDS) - 1];
+    for (int m = 1; m < 1 << FILTER_FIELDS; m++) masks[m - 1] = m;
+    qsort(masks, (1 << FILTER_FIELDS) - 1, sizeof(int), popcount_order);
+
+    for (size_t g = 0; g < groups; g++) {
+        size_t first = 0, interfaces = 0;
+        while (group[first] != g) first++;
+        const DeviceRecord *d = &records[first];
+        printf("%04lx:%04lx \"%s\"", d->vendorID, d->productID, d->product);
+        if (d->serial[0]) printf(" serial=%s", d->serial);
+        if (d->locationID) {
+            char port[32];
+            port_path(d->locationID, port, sizeof(port));
+            printf(" location=0x%08lx port=%s", d->locationID, port);
+        }
+        if (d->address[0]) printf(" address=%s", d->address);
+        printf("\n  usages:");
+        for (size_t i = first; i < count; i++) {
+            if (group[i] != g) continue;
+            if (records[i].collectionCount == 0) printf(" 0x%lx:0x%lx", records[i].usagePage, records[i].usage);
+            for (int c = 0; c < records[i].collectionCount; c++) {
+                printf("%s0x%x:0x%x", c ? "," : " ", records[i].collections[c].usagePage, records[i].collections[c].usage);
+            }
+            interfaces++;
+        }
+
+        // Smallest filter set, then the one covering most interfaces, that
+        // matches no interface of another device.
+        int bestMask = 0, bestCovered = 0;
+        const DeviceRecord *bestFrom = NULL;
+        for (int m = 0; m < (1 << FILTER_FIELDS) - 1; m++) {
+            int mask = masks[m];
+            if (bestMask && __builtin_popcount((unsigned)mask) > __builtin_popcount((unsigned)bestMask)) break;
+            for (size_t i = first; i < count; i++) {
+                if (group[i] != g) continue;
+                int usable = 1, covered = 0;
+                for (int f = 0; f < FILTER_FIELDS; f++) {
+                    if ((mask & (1 << f)) && !filter_usable(&records[i], f)) usable = 0;
+                }
+                for (size_t j = 0; usable && j < count; j++) {
+                    if (!filter_matches(&records[i], &records[j], mask)) continue;
+                    if (group[j] != g) usable = 0;
+                    else covered++;
+                }
+                if (usable && covered > bestCovered) {
+                    bestMask = mask;
+                    bestCovered = covered;
+                    bestFrom = &records[i];
+                }
+            }
+        }
+        printf("\n  filters:");
+        if (bestFrom) {
+            print_filter(bestFrom, bestMask);
+            printf("   (%d of %zu interfaces)\n", bestCovered, interfaces);
+        } else {
+            // An identical device is attached too; only a condition on
+            // something unique can tell them apart.
+            print_filter(d, (d->vendorID > 0) | (d->productID > 0) << 1);
+            if (d->serial[0]) printf(" --condition 'serial == \"%s\"'\n", d->serial);
+            else printf(" --condition 'location == 0x%lx'\n", d->locationID);
+        }
+    }
+    printf("Found %zu device(s) with %zu interface(s) in %.1f ms.\n", groups, count, (now_seconds() - start) * 1000.0);
+    for (size_t i = 0; i < count; i++) {
+        device_release(&records[i]);
+        IOObjectRelease(services[i]);
+    }
+    mem_free(group);
+    mem_free(records);
+    mem_free(services);
+    return 0;
+}
+
+// Times the condition VM against a synthetic device and registry.
+static int bench_condition(const AppConfig *config) {
+    const char *source = config->condition ? config->condition
+                                           : "serial ^= \"LAB\" && vid == 0x46d && (pid == 0xc52b || present(0x46d, 0xc077) > 0)";
+    Condition *cond = condition_compile(source);
+    if (!cond) return 1;
+    DeviceRecord device = { .entryID = 1, .vendorID = 0x46d, .productID = 0xc52b, .usagePage = 1, .usage = 6 };
+    snprintf(device.serial, sizeof(device.serial), "LAB-0042");
+    snprintf(device.product, sizeof(device.product), "USB Receiver");
+    for (int i = 0; i < 8; i++) {
+        DeviceRecord other = device;
+        other.entryID = 100 + i;
+        other.productID = 0xc000 + i * 0x11;
+        registry_add(&other);
+    }
+    EventContext ev = { &device, "connect", time(NULL) };
+    const long iterations = 5000000;
+    long passed = 0;
+    double start = now_seconds();
+    for (long i = 0; i < iterations; i++) passed += condition_eval(cond, &ev);
+    double elapsed = now_seconds() - start;
+    printf("BENCH: condition \"%s\": %d instructions, %.1f ns/eval (%s)\n", source, cond->length,
+           elapsed * 1e9 / iterations, passed ? "true" : "false");
+    return 0;
+}
+
+// Adds a bench rule with no actions; returns 0 (after saying so) if out of memory.
+static int bench_rule_add(const char *pattern) {
+    if (rule_add(mem_strdup(MEM_RULES, pattern), NULL, NULL, 0, PRIORITY_NORMAL)) return 1;
+    fprintf(stderr, "Error: Out of memory after %zu rules.\n", ruleset.count);
+    return 0;
+}
+
+static int bench_rules_index(void) {
+    if (rules_index()) return 1;
+    fprintf(stderr, "Error: Out of memory indexing %zu rules.\n", ruleset.count);
+    return 0;
+}
+
+// Scaling curve of wildcard rule matching over rule count and worker threads.
+static int bench_rules(void) {
+    static const size_t sizes[] = { 1000, 10000, 100000, 1000000 };
+    static const int threads[] = { 1, 2, 4, 8 };
+    const size_t threadCases = sizeof(threads) / sizeof(threads[0]);
+    printf("BENCH: wildcard rules, us/event by worker threads\n");
+    printf("BENCH: %8s", "rules");
+    for (size_t t = 0; t < threadCases; t++) printf(" %9d", threads[t]);
+    printf("\n");
+    for (size_t n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++) {
+        while (ruleset.count < sizes[n]) {
+            char pattern[32];
+            snprintf(pattern, sizeof(pattern), "LAB-%07zu-*", ruleset.count);
+            if (!bench_rule_add(pattern)) return 1;
+        }
+        if (!bench_rules_index()) return 1;
+        printf("BENCH: %8zu", sizes[n]);
+        for (size_t t = 0; t < threadCases; t++) {
+            if (!rule_pool_start(threads[t])) return 1;
+            long iterations = (long)(20000000 / sizes[n]) + 20;
+            const int *matches;
+            size_t found = 0;
+            double start = now_seconds();
+            for (long i = 0; i < iterations; i++) found += rule_match("LAB-0000042-A", &matches);
+            double elapsed = now_seconds() - start;
+            if (found != (size_t)iterations) {
+                fprintf(stderr, "BENCH: rule matching returned %zu matches, expected %ld.\n", found, iterations);
+                return 1;
+            }
+            printf(" %9.2f", elapsed * 1e6 / iterations);
+            fflush(stdout);
+        }
+        printf("\n");
+    }
+    rule_pool_stop();
+    return 0;
+}
+
+// An ordered policy (specific reader, other readers, catch-all) evaluated
+// with every rule matched and again with each rule terminal, for an event
+// the first rule takes and one that falls through to the catch-all.
+static int bench_chains(void) {
+    static const size_t sizes[] = { 1000, 10000, 100000 };
+    printf("BENCH: ordered rule chains, ns/event (one thread)\n");
+    printf("BENCH: %8s %12s %12s %12s\n", "rules", "match-all", "first-match", "fallthrough");
+    if (!rule_pool_start(1)) return 1;
+    for (size_t n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++) {
+        for (size_t i = 0; i < ruleset.count; i++) mem_free(ruleset.rules[i].pattern);
+        ruleset.count = 0;
+        if (!bench_rule_add("LAB-0000042-*")) return 1;
+        while (ruleset.count < sizes[n] - 1) {
+            char pattern[32];
+            snprintf(pattern, sizeof(pattern), "LAB-%07zu-*", ruleset.count);
+            if (!bench_rule_add(pattern)) return 1;
+        }
+        if (!bench_rule_add("*") || !bench_rules_index()) return 1;
+        printf("BENCH: %8zu", sizes[n]);
+        const char *serials[] = { "LAB-0000042-A", "LAB-0000042-A", "OTHER-1" };
+        for (int c = 0; c < 3; c++) {
+            for (size_t i = 0; i < ruleset.count; i++) ruleset.rules[i].terminal = c > 0;
+            long iterations = (long)(20000000 / sizes[n]) + 20;
+            const int *matches;
+            size_t found = 0;
+            double start = now_seconds();
+            for (long i = 0; i < iterations; i++) found += rule_match(serials[c], &matches);
+            double elapsed = now_seconds() - start;
+            size_t expected = c == 0 ? 3 : 1;
+            if (found != (size_t)iterations * expected) {
+                fprintf(stderr, "BENCH: rule chains returned %zu matches, expected %zu.\n", found, (size_t)iterations * expected);
+                return 1;
+            }
+            printf(" %12.1f", elapsed * 1e9 / iterations);
+            fflush(stdout);
+        }
+        printf("\n");
+    }
+    rule_pool_stop();
+    return 0;
+}
+
+// Durability cost per event for several group-commit batch sizes. The log
+// goes to --wal if given, so the numbers reflect the disk it will live on.
+static int bench_wal(void) {
+    static const int batches[] = { 1, 2, 4, 8, 16, 64, 256 };
+    const char *path = wal.path ? wal.path : "hidkitd-bench.wal";
+    wal.path = path;
+    wal.fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_TRUNC, 0600);
+    if (wal.fd < 0) {
+        fprintf(stderr, "BENCH: Cannot open %s: %s.\n", path, strerror(errno));
+        return 1;
+    }
+    printf("BENCH: WAL on %s, durability cost per event by events per sync\n", path);
+    printf("BENCH: %8s %12s %12s\n", "batch", "us/event", "syncs/s");
+    for (size_t b = 0; b < sizeof(batches) / sizeof(batches[0]); b++) {
+        const int events = 1024;
+        unsigned long syncs = wal.commits;
+        double start = now_seconds();
+        for (int i = 0; i < events; i++) {
+            wal_queue("/usr/local/bin/badge-audit", (uint64_t)i + 1);
+            if (wal.batchCount < batches[b] && i + 1 < events) continue;
+            // What wal_commit() does, minus running the scripts.
+            if (!wal_sync()) return 1;
+            wal.batchCount = 0;
+            if (ftruncate(wal.fd, 0) != 0) return 1;
+        }
+        double elapsed = now_seconds() - start;
+        printf("BENCH: %8d %12.2f %12.0f\n", batches[b], elapsed * 1e6 / events, (wal.commits - syncs) / elapsed);
+        fflush(stdout);
+    }
+    close(wal.fd);
+    unlink(path);
+    return 0;
+}
+
+// Range filter lookups against growing numbers of disjoint ranges, next to
+// a linear scan of the same ranges for scale.
+static int bench_ranges(void) {
+    static const size_t sizes[] = { 10, 1000, 100000, 1000000 };
+    printf("BENCH: numeric range filter, ns/lookup\n");
+    printf("BENCH: %8s %12s %12s\n", "ranges", "indexed", "linear");
+    for (size_t n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++) {
+        NumericSet set = {0};
+        long unused = 0;
+        char spec[64];
+        srand(42);
+        for (size_t i = 0; i < sizes[n]; i++) {
+            long low = (long)i * 64 + rand() % 16;
+            snprintf(spec, sizeof(spec), "%ld-%ld", low, low + rand() % 32);
+            numeric_set_add(&set, spec);
+        }
+        numeric_set_finish(&set, &unused);
+        const long lookups = 2000000;
+        long range = (long)sizes[n] * 64, hits = 0;
+        double start = now_seconds();
+        for (long i = 0; i < lookups; i++) hits += numeric_set_contains(&set, (i * 7919) % range);
+        double indexed = (now_seconds() - start) * 1e9 / lookups;
+        printf("BENCH: %8zu %12.1f", sizes[n], indexed);
+        if (sizes[n] <= 100000) {
+            const long linearLookups = (long)(20000000 / sizes[n]) + 100;
+            long linearHits = 0;
+            start = now_seconds();
+            for (long i = 0; i < linearLookups; i++) {
+                long v = (i * 7919) % range;
+                for (size_t r = 0; r < set.count; r++) {
+                    if (v >= set.ranges[r].low && v <= set.ranges[r].high) {
+                        linearHits++;
+                        break;
+                    }
+                }
+            }
+            printf(" %12.1f", (now_seconds() - start) * 1e9 / linearLookups);
+            hits += linearHits;
+        }
+        printf("\n");
+        fflush(stdout);
+        if (hits < 0) return 1;   // Keeps the lookups from being optimized away.
+        mem_free(set.ranges);
+    }
+    return 0;
+}
+
+#ifdef HIDKITD_STANDIN
+static CFDictionaryRef bench_device(long vendorID, long productID, long n) {
+    CFMutableDictionaryRef props = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks,
+                                                             &kCFTypeDictionaryValueCallBacks);
+    char text[32];
+    long location = 0x14100000 + (n % 15 + 1) * 0x10000;
+    const struct { CFStringRef key; const long *value; } numbers[] = {
+        { CFSTR("VendorID"), &vendorID }, { CFSTR("ProductID"), &productID }, { CFSTR("LocationID"), &location },
+    };
+    for (size_t i = 0; i < sizeof(numbers) / sizeof(numbers[0]); i++) {
+        CFNumberRef num = CFNumberCreate(kCFAllocatorDefault, kCFNumberLongType, numbers[i].value);
+        CFDictionarySetValue(props, numbers[i].key, num);
+        CFRelease(num);
+    }
+    snprintf(text, sizeof(text), "BENCH-%06ld", n);
+    CFStringRef str = CFStringCreateWithCString(kCFAllocatorDefault, text, kCFStringEncodingUTF8);
+    CFDictionarySetValue(props, CFSTR("SerialNumber"), str);
+    CFRelease(str);
+    CFDictionarySetValue(props, CFSTR("Product"), CFSTR("Bench Keyboard"));
+    return props;
+}
+
+// Per-event cost of the real notification callbacks (device_read, filters,
+// registry, rules, logging) on the stand-in registry, with 0 and 1000 other
+// devices attached. Scripts are only logged, as under --simulate, and the
+// log goes to /dev/null; run_script's spawn is timed on its own. Uses the
+// given filters, --rules and --condition, or a VendorID/ProductID filter.
+static int bench_events(const AppConfig *given) {
+    static AppConfig config;
+    config = *given;
+    if (!config.vendorID && !config.productID) {
+        config.vendorID = 0x46d;
+        config.productID = 0xc52b;
+    }
+    if (!config.onConnectScript) config.onConnectScript = "/bin/true";
+    if (!config.onDisconnectScript) config.onDisconnectScript = "/bin/true";
+    config.maxEventRate = config.maxSpawnRate = 0;   // Keep overload handling out of the way.
+    dbus.address = NULL;
+    const double perNs = ticks_per_ns();
+
+    const long dictionaries = 100000;
+    uint64_t start = cheap_ticks();
+    for (long i = 0; i < dictionaries; i++) CFRelease(createMatchingDictionary(&config));
+    printf("BENCH: createMatchingDictionary %10.1f ns\n", (double)(cheap_ticks() - start) / perNs / dictionaries);
+
+    daemonClock.isVirtual = 1;
+    if (!services_start(&config)) return 1;
+    IONotificationPortRef port = IONotificationPortCreate(kIOMainPortDefault);
+    CFMutableDictionaryRef matching = createMatchingDictionary(&config);
+    CFRetain(matching);
+    io_iterator_t matched, terminated;
+    IOServiceAddMatchingNotification(port, kIOMatchedNotification, matching, deviceConnected, &config, &matched);
+    IOServiceAddMatchingNotification(port, kIOTerminatedNotification, matching, deviceDisconnected, &config, &terminated);
+    deviceConnected(&config, matched);
+    deviceDisconnected(&config, terminated);
+
+    fflush(stdout);
+    int savedStdout = dup(STDOUT_FILENO), devNull = open("/dev/null", O_WRONLY);
+    io_service_t background[1000];
+    long serial = 0;
+    double results[2][2];
+    for (int phase = 0; phase < 2; phase++) {
+        dup2(devNull, STDOUT_FILENO);
+        for (int i = 0; phase == 1 && i < 1000; i++) {
+            CFDictionaryRef props = bench_device(config.vendorID, config.productID, serial++);
+            background[i] = IOStandInAddDevice(props);
+            CFRelease(props);
+            IOStandInDispatch();
+        }
+        const long iterations = 20000;
+        uint64_t connectTicks = 0, disconnectTicks = 0;
+        for (long i = 0; i < iterations; i++) {
+            CFDictionaryRef props = bench_device(config.vendorID, config.productID, serial++);
+            io_service_t service = IOStandInAddDevice(props);
+            CFRelease(props);
+            start = cheap_ticks();
+            IOStandInDispatch();
+            connectTicks += cheap_ticks() - start;
+            IOStandInRemoveDevice(service);
+            start = cheap_ticks();
+            IOStandInDispatch();
+            disconnectTicks += cheap_ticks() - start;
+        }
+        for (int i = 0; phase == 1 && i < 1000; i++) IOStandInRemoveDevice(background[i]);
+        IOStandInDispatch();
+        fflush(stdout);
+        dup2(savedStdout, STDOUT_FILENO);
+        results[phase][0] = (double)connectTicks / perNs / iterations;
+        results[phase][1] = (double)disconnectTicks / perNs / iterations;
+    }
+    printf("BENCH: %-30s %10s %10s\n", "ns/event, devices attached", "0", "1000");
+    printf("BENCH: %-30s %10.1f %10.1f\n", "deviceConnected", results[0][0], results[1][0]);
+    printf("BENCH: %-30s %10.1f %10.1f\n", "deviceDisconnected", results[0][1], results[1][1]);
+
+    daemonClock.isVirtual = 0;
+    const long spawns = 200;
+    fflush(stdout);
+    dup2(devNull, STDOUT_FILENO);
+    start = cheap_ticks();
+    for (long i = 0; i < spawns; i++) run_script("/bin/true", (uint64_t)i + 1);
+    fflush(stdout);
+    dup2(savedStdout, STDOUT_FILENO);
+    printf("BENCH: run_script(/bin/true)      %10.1f us\n", (double)(cheap_ticks() - start) / perNs / spawns / 1000.0);
+    close(devNull);
+    close(savedStdout);
+    return 0;
+}
+#endif
+
+// Cost of recording one event: a device record, which reads the clock, and a
+// rule decision, which does not.
+static int bench_flight(void) {
+    DeviceRecord device = { .vendorID = 1133, .productID = 49200, .usagePage = 1, .usage = 6, .locationID = 0x14100000 };
+    snprintf(device.serial, sizeof(device.serial), "LAB-0000042-A");
+    snprintf(device.product, sizeof(device.product), "USB Receiver");
+    const long iterations = 10000000;
+    double start = now_seconds();
+    for (long i = 0; i < iterations; i++) {
+        flight_note_device(FLIGHT_CONNECT, &device);
+        FlightRecord *record = flight_next(FLIGHT_RULE);
+        record->rule.index = 3;
+        record->rule.ran = 1;
+        flight_copy(record->text[0], "LAB-*");
+    }
+    double elapsed = now_seconds() - start;
+    printf("BENCH: flight recorder, %.1f ns/event (device + rule record)\n", elapsed * 1e9 / iterations);
+    return 0;
+}
+
+// Micro-benchmarks for the daemon's hot paths, run with --bench <name>.
+static int run_benchmark(const char *name, const AppConfig *config) {
+    if (strcmp(name, "vm") == 0) return bench_condition(config);
+    if (strcmp(name, "rules") == 0) return bench_rules();
+    if (strcmp(name, "chains") == 0) return bench_chains();
+    if (strcmp(name, "wal") == 0) return bench_wal();
+    if (strcmp(name, "ranges") == 0) return bench_ranges();
+    if (strcmp(name, "flight") == 0) return bench_flight();
+#ifdef HIDKITD_STANDIN
+    if (strcmp(name, "events") == 0) return bench_events(config);
+#else
+    if (strcmp(name, "events") == 0) {
+        fprintf(stderr, "Error: The events benchmark needs the IOKit stand-in (build with -Icompat).\n");
+        return 1;
+    }
+#endif
+    fprintf(stderr, "Error: Unknown benchmark %s. Use --help.\n", name);
+    return 1;
+}
+
 void print_help(const char *prog_name) {
     printf("hidkitd: A persistent daemon to run scripts on device events.\n");
     printf("NOTE: This tool is specifically designed to monitor `IOHIDUserDevice` objects,\n");
     printf("      such as keyboards, mice, game controllers, and other custom HID hardware.\n\n");
-    printf("Usage: %s [FILTERS] [ACTIONS]\n\n", prog_name);
+    printf("Usage: %s [FILTERS] [ACTIONS]\n", prog_name);
+    printf("       %s discover\n\n", prog_name);
     printf("FILTERS (at least one is required, multiple are combined with AND logic):\n");
     printf("  --vendor-id <id>       Match by USB Vendor ID (number).\n");
     printf("  --product-id <id>      Match by USB Product ID (number).\n");
     printf("  --name <string>        Match by Product Name (string).\n");
     printf("  --address <mac_string> Match by Bluetooth Device Address (string).\n");
-    printf("  --usage-page <id>      Match by HID Primary Usage Page (number).\n");
-    printf("  --usage <id>           Match by HID Primary Usage (number).\n\n");
+    printf("  --usage-page <id>      Match by HID Usage Page (number).\n");
+    printf("  --usage <id>           Match by HID Usage (number). Both match any top-level collection\n");
+    printf("                         of the report descriptor, not only the primary one.\n");
+    printf("                         The four numeric filters also take a range (49152-49407 or\n");
+    printf("                         0xc000-0xc0ff), a comma-separated list of values and ranges, or\n");
+    printf("                         @file with one per line; may be repeated to extend the set.\n");
+    printf("  --port <path>          Match by USB port: 14-3.2 is port 2 of the hub on port 3 of bus\n");
+    printf("                         0x14 (LocationID 0x14320000); 14-3.* is every port below 14-3.\n");
+    printf("                         May be repeated; a device on any of the ports matches.\n\n");
     printf("ACTIONS (at least one is required):\n");
     printf("  --on-connect <path>    Script to run when the device connects.\n");
-    printf("  --on-disconnect <path> Script to run when the device disconnects.\n\n");
+    printf("  --on-disconnect <path> Script to run when the device disconnects.\n");
+    printf("                         Every action gets its event's ID in $HIDKITD_CORRELATION_ID; the\n");
+    printf("                         same ID tags the event's log lines, flight records and exemplars.\n");
+    printf("  --dbus <address>       Also emit org.hidkitd.Device Connected/Disconnected signals for\n");
+    printf("                         events that pass the filters, over a persistent connection to\n");
+    printf("                         the bus: system, session or a unix:path=... address.\n");
+    printf("  --set-report output|feature:<id>:<hex bytes>\n");
+    printf("                         Write a HID report to the device when it connects, before the\n");
+    printf("                         other actions, e.g. --set-report feature:2:0104 (id 0 if the\n");
+    printf("                         device has no report IDs). May be repeated: reports are written\n");
+    printf("                         in order and the first failure skips the rest. Feature reports\n");
+    printf("                         are read back to check the device kept them.\n\n");
+    printf("ATTRIBUTE FILTERS (checked in the daemon after the filters above):\n");
+    printf("  --attr <key>=<value>   Match any other registry property, e.g. --attr Transport=USB.\n");
+    printf("                         May be repeated. Properties are read only for devices that\n");
+    printf("                         passed every cheaper filter, and cached until disconnect.\n\n");
+    printf("CONDITIONS:\n");
+    printf("  --condition <expr>     Run actions only for events where the expression holds. It is\n");
+    printf("                         checked inside the daemon, so a skipped event costs no process.\n");
+    printf("                         Fields: vid pid usage_page usage location name serial address\n");
+    printf("                         event (\"connect\"/\"disconnect\") weekday (0=Sunday) hour minute\n");
+    printf("                         connected (number of matching devices attached).\n");
+    printf("                         present(vid[, pid]) counts attached matching devices.\n");
+    printf("                         attr(\"Key\") is any registry property, read only if reached.\n");
+    printf("                         Operators: == != < <= > >= ^= (prefix) $= (suffix) *= (contains)\n");
+    printf("                         ! && || and parentheses. Example:\n");
+    printf("                           --condition '!serial ^= \"LAB\" && weekday >= 1 && weekday <= 5'\n\n");
+    printf("RULES:\n");
+    printf("  --rules <path>         Per-serial actions for matching devices, one rule per line:\n");
+    printf("                           <serial pattern> <on-connect|-> [<on-disconnect|->]\n");
+    printf("                           <serial pattern> <on-connect|-> [<on-disconnect|->] stop\n");
+    printf("                         Patterns may use * and ?; every matching rule runs, in file order,\n");
+    printf("                         but a script bound to several of them runs once per event. A rule\n");
+    printf("                         ending in `stop` is the last one considered when it matches, and\n");
+    printf("                         priority=low|normal|high after the scripts overrides --priority.\n");
+    printf("  --rule-threads <n>     Threads that scan large sets of wildcard rules (default: CPUs, max 8).\n");
+    printf("  --rule-sample <n>      Time rule matching in one event out of n (default %d, 0: never);\n", DEFAULT_RULE_SAMPLE);
+    printf("                         the `rulecost` control command ranks rules by the time they take.\n\n");
+    printf("DURABILITY:\n");
+    printf("  --wal <path>           Log event actions to this file and sync it before they run;\n");
+    printf("                         actions a crash interrupted are run again on the next start.\n");
+    printf("  --wal-window <ms>      Let actions wait up to this long so more events share a sync\n");
+    printf("                         (default 0: one sync per notification callback).\n\n");
+    printf("MONITORING:\n");
+    printf("  --control-socket <path> Serve queries on a Unix socket: send one command line, e.g.\n");
+    printf("                         `echo metrics | nc -U <path>`. Send `help` for the command list;\n");
+    printf("                         `upgrade` re-execs the daemon without missing events.\n");
+    printf("                         A socket passed by a service manager (LISTEN_FDS) is used instead.\n");
+    printf("  --exemplar-threshold <ms>\n");
+    printf("                         Events slower than this (default %d) are kept as exemplars of\n", DEFAULT_EXEMPLAR_THRESHOLD_MS);
+    printf("                         their latency bucket: `exemplars [le]` lists the device, rules,\n");
+    printf("                         queue wait, spawn and action time of each.\n");
+    printf("  --rollup-keys <n>      Devices and models tracked by the rollups (default %d each);\n", DEFAULT_ROLLUP_KEYS);
+    printf("                         the least recently active key is evicted beyond that.\n");
+    printf("  --rollup-bucket <s>    Width of a rollup time bucket in seconds (default %d); the\n", DEFAULT_ROLLUP_BUCKET_SECONDS);
+    printf("                         rollups keep the last %d buckets.\n", ROLLUP_BUCKETS);
+    printf("  --top-flappers <k>     Counters in the sketch of the busiest devices (default %d, max %d).\n",
+           DEFAULT_FLAPPER_SLOTS, MAX_FLAPPER_SLOTS);
+    printf("  --rollup-export <path> Periodically write all rollups to this file.\n");
+    printf("  --rollup-interval <s>  Seconds between rollup exports (default: the bucket width).\n\n");
+    printf("OVERLOAD CONTROL:\n");
+    printf("  --priority <level>     low, normal (default) or high, for the --on-connect/--on-disconnect\n");
+    printf("                         actions and rules without their own. Under load, low-priority\n");
+    printf("                         actions are shed first and only high-priority ones survive.\n");
+    printf("  --max-event-rate <n>   Events per second before bursts are coalesced (default %d).\n", DEFAULT_MAX_EVENT_RATE);
+    printf("  --max-spawn-rate <n>   Script launches per second before bursts are coalesced (default %d).\n", DEFAULT_MAX_SPAWN_RATE);
+    printf("  --on-overload <path>   Script to run on every overload level change; the new level\n");
+    printf("                         (normal, coalesce, shed-low, count-only) is in $HIDKITD_OVERLOAD_LEVEL.\n\n");
+    printf("DIAGNOSTICS:\n");
+    printf("  --simulate <trace>     Replay a trace of device events (- for stdin) on a virtual clock\n");
+    printf("                         through the normal event handling and exit. Scripts are only\n");
+    printf("                         logged and timers fire as virtual time passes, so the output is\n");
+    printf("                         deterministic. Lines: `<seconds|+delta> connect <tag> Key=value...`\n");
+    printf("                         or `<seconds|+delta> disconnect <tag>`.\n");
+    printf("  --bench <name>         Run a micro-benchmark and exit. vm: condition evaluation\n");
+    printf("                         (uses --condition when given). rules: wildcard rule matching\n");
+    printf("                         for 1k to 1M rules on 1 to 8 threads. chains: an ordered policy\n");
+    printf("                         with and without `stop`. wal: sync cost per event\n");
+    printf("                         by group-commit batch size (on --wal's disk when given).\n");
+    printf("                         ranges: numeric range filters with 10 to 1M ranges.\n");
+    printf("                         flight: cost of a flight recorder record. events: the real\n");
+    printf("                         connect/disconnect callbacks per event (IOKit stand-in builds).\n");
+    printf("  --flight-recorder <path>\n");
+    printf("                         Where the flight recorder (the last %d event records: device\n", FLIGHT_RECORDS);
+    printf("                         properties, rule decisions, action pids, exit codes and timings)\n");
+    printf("                         is dumped on SIGUSR1, on a crash or by the `flight` control\n");
+    printf("                         command. Default: /tmp/hidkitd-flight.<pid>. Each dump replaces\n");
+    printf("                         the file without following a link planted at the path.\n\n");
     printf("HELP:\n");
     printf("  --help                 Display this help message and exit.\n\n");
     printf("HOW TO FIND FILTER VALUES:\n");
+    printf("  Connect your device and run `%s discover`. It lists every device the daemon can\n", prog_name);
+    printf("  see with the fewest filters that match it alone. To read the registry by hand:\n");
     printf("  1. Connect your device.\n");
     printf("  2. Open the Terminal application.\n");
     printf("  3. Run the command: `ioreg -r -c IOHIDDevice`\n");
@@ -128,54 +5206,194 @@ void print_help(const char *prog_name) {
     printf("    --on-disconnect /path/to/disconnect_script.sh\n\n");
 }
 
+// Wall-clock time the process was exec'd. macOS records it per process;
+// elsewhere the earliest available point, entry to main, stands in.
+static double exec_time(void) {
+    struct timeval start;
+    gettimeofday(&start, NULL);
+#ifdef __APPLE__
+    struct kinfo_proc info;
+    size_t size = sizeof(info);
+    int mib[4] = { CTL_KERN, KERN_PROC, KERN_PROC_PID, getpid() };
+    // After an upgrade the recorded start is the original process's.
+    if (!getenv("HIDKITD_HANDOFF_FD") && sysctl(mib, 4, &info, &size, NULL, 0) == 0 && size > 0) {
+        start = info.kp_proc.p_starttime;
+    }
+#endif
+    return (double)start.tv_sec + (double)start.tv_usec / 1e6;
+}
+
+static double wall_seconds(void) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (double)now.tv_sec + (double)now.tv_usec / 1e6;
+}
+
 int main(int argc, const char * argv[]) {
+    double execTime = exec_time();
     if (argc == 1 || (argc == 2 && strcmp(argv[1], "--help") == 0)) {
         print_help(argv[0]);
         return 0;
     }
+    if (argc == 2 && strcmp(argv[1], "discover") == 0) return discover();
 
     AppConfig config = {0};
+    const char *benchName = NULL, *simulatePath = NULL, *flightPath = NULL;
+    config.priority = PRIORITY_NORMAL;
+    config.maxEventRate = DEFAULT_MAX_EVENT_RATE;
+    config.maxSpawnRate = DEFAULT_MAX_SPAWN_RATE;
     for (int i = 1; i < argc; i += 2) {
         if (i + 1 >= argc) { fprintf(stderr, "Error: Flag %s is missing a value. Use --help.\n", argv[i]); return 1; }
         const char *flag = argv[i];
         const char *val = argv[i+1];
-        if (strcmp(flag, "--vendor-id") == 0) config.vendorID = strtol(val, NULL, 10);
-        else if (strcmp(flag, "--product-id") == 0) config.productID = strtol(val, NULL, 10);
-        else if (strcmp(flag, "--usage-page") == 0) config.usagePage = strtol(val, NULL, 10);
-        else if (strcmp(flag, "--usage") == 0) config.usage = strtol(val, NULL, 10);
+        if (strcmp(flag, "--vendor-id") == 0 || strcmp(flag, "--product-id") == 0 ||
+            strcmp(flag, "--usage-page") == 0 || strcmp(flag, "--usage") == 0) {
+            NumericSet *set = flag[2] == 'v' ? &config.vendorIDs : flag[2] == 'p' ? &config.productIDs
+                            : strcmp(flag, "--usage") == 0 ? &config.usages : &config.usagePages;
+            if (!numeric_set_add(set, val)) {
+                fprintf(stderr, "Error: Invalid %s %s (expected n, n-m, a list of those or @file). Use --help.\n", flag, val);
+                return 1;
+            }
+        }
         else if (strcmp(flag, "--name") == 0) config.productName = val;
         else if (strcmp(flag, "--address") == 0) config.deviceAddress = val;
+        else if (strcmp(flag, "--port") == 0) {
+            int added = port_filter_add(&config, val);
+            if (added < 0) {
+                fprintf(stderr, "Error: Out of memory adding --port %s.\n", val);
+                return 1;
+            }
+            if (!added) {
+                fprintf(stderr, "Error: Invalid --port %s (expected e.g. 14-3.2 or 14-3.*). Use --help.\n", val);
+                return 1;
+            }
+        }
         else if (strcmp(flag, "--on-connect") == 0) config.onConnectScript = val;
         else if (strcmp(flag, "--on-disconnect") == 0) config.onDisconnectScript = val;
+        else if (strcmp(flag, "--max-event-rate") == 0) config.maxEventRate = strtol(val, NULL, 10);
+        else if (strcmp(flag, "--max-spawn-rate") == 0) config.maxSpawnRate = strtol(val, NULL, 10);
+        else if (strcmp(flag, "--on-overload") == 0) config.onOverloadScript = val;
+        else if (strcmp(flag, "--condition") == 0) config.condition = val;
+        else if (strcmp(flag, "--bench") == 0) benchName = val;
+        else if (strcmp(flag, "--simulate") == 0) simulatePath = val;
+        else if (strcmp(flag, "--flight-recorder") == 0) flightPath = val;
+        else if (strcmp(flag, "--rules") == 0) config.rulesPath = val;
+        else if (strcmp(flag, "--rule-sample") == 0) ruleCost.every = strtoul(val, NULL, 10);
+        else if (strcmp(flag, "--rule-threads") == 0) config.ruleThreads = (int)strtol(val, NULL, 10);
+        else if (strcmp(flag, "--dbus") == 0) dbus.address = val;
+        else if (strcmp(flag, "--wal") == 0) wal.path = val;
+        else if (strcmp(flag, "--wal-window") == 0) wal.windowMs = strtod(val, NULL);
+        else if (strcmp(flag, "--exemplar-threshold") == 0) latency.thresholdSeconds = strtod(val, NULL) / 1000.0;
+        else if (strcmp(flag, "--control-socket") == 0) config.controlSocketPath = val;
+        else if (strcmp(flag, "--rollup-keys") == 0) rollupKeyCap = (int)strtol(val, NULL, 10);
+        else if (strcmp(flag, "--rollup-bucket") == 0) rollupBucketSeconds = strtol(val, NULL, 10);
+        else if (strcmp(flag, "--top-flappers") == 0) flappers.capacity = (int)strtol(val, NULL, 10);
+        else if (strcmp(flag, "--rollup-export") == 0) config.rollupExportPath = val;
+        else if (strcmp(flag, "--rollup-interval") == 0) config.rollupExportSeconds = strtol(val, NULL, 10);
+        else if (strcmp(flag, "--attr") == 0) {
+            const char *eq = strchr(val, '=');
+            char *name = eq && eq != val ? mem_strndup(MEM_CONDITIONS, val, (size_t)(eq - val)) : NULL;
+            if (eq && eq != val && !name) {
+                fprintf(stderr, "Error: Out of memory adding --attr %s.\n", val);
+                return 1;
+            }
+            int attribute = name ? attribute_intern(name) : -1;
+            if (attribute < 0 || config.attributeFilterCount == MAX_ATTRIBUTES) {
+                fprintf(stderr, "Error: Invalid --attr %s (expected key=value, at most %d). Use --help.\n", val, MAX_ATTRIBUTES);
+                return 1;
+            }
+            config.attributeFilters[config.attributeFilterCount++] = (AttributeFilter){ attribute, eq + 1 };
+        }
+        else if (strcmp(flag, "--set-report") == 0) {
+            if (config.reportCount == MAX_REPORTS || !report_parse(val, &config.reports[config.reportCount])) {
+                fprintf(stderr, "Error: Invalid --set-report %s (expected output|feature:<id>:<hex bytes>, at most %d of up to %d bytes). Use --help.\n",
+                        val, MAX_REPORTS, MAX_REPORT_BYTES);
+                return 1;
+            }
+            config.reportCount++;
+        }
+        else if (strcmp(flag, "--priority") == 0) {
+            if (strcmp(val, "low") == 0) config.priority = PRIORITY_LOW;
+            else if (strcmp(val, "normal") == 0) config.priority = PRIORITY_NORMAL;
+            else if (strcmp(val, "high") == 0) config.priority = PRIORITY_HIGH;
+            else { fprintf(stderr, "Error: Unknown priority %s. Use --help.\n", val); return 1; }
+        }
         else { fprintf(stderr, "Error: Unknown flag %s. Use --help.\n", flag); return 1; }
     }
 
-    if (config.vendorID == 0 && config.productID == 0 && !config.productName && !config.deviceAddress && config.usagePage == 0 && config.usage == 0) {
+    numeric_set_finish(&config.vendorIDs, &config.vendorID);
+    numeric_set_finish(&config.productIDs, &config.productID);
+    numeric_set_finish(&config.usagePages, &config.usagePage);
+    numeric_set_finish(&config.usages, &config.usage);
+    if (benchName) return run_benchmark(benchName, &config);
+
+    if (config.vendorID == 0 && config.productID == 0 && !config.productName && !config.deviceAddress && config.usagePage == 0 && config.usage == 0 && !config.ports &&
+        !config.vendorIDs.count && !config.productIDs.count && !config.usagePages.count && !config.usages.count) {
         fprintf(stderr, "Error: You must provide at least one filter. Use --help.\n"); return 1;
     }
-    if (!config.onConnectScript && !config.onDisconnectScript) {
-        fprintf(stderr, "Error: You must provide at least one action script. Use --help.\n"); return 1;
+    if (!config.onConnectScript && !config.onDisconnectScript && !config.rulesPath && !dbus.address && !config.reportCount) {
+        fprintf(stderr, "Error: You must provide at least one action (script, rules file, --dbus or --set-report). Use --help.\n"); return 1;
+    }
+    if (rollupKeyCap < 1 || rollupBucketSeconds < 1) {
+        fprintf(stderr, "Error: --rollup-keys and --rollup-bucket must be positive. Use --help.\n"); return 1;
+    }
+    if (flappers.capacity < 1 || flappers.capacity > MAX_FLAPPER_SLOTS) {
+        fprintf(stderr, "Error: --top-flappers must be between 1 and %d. Use --help.\n", MAX_FLAPPER_SLOTS); return 1;
+    }
+    if (latency.thresholdSeconds < 0) {
+        fprintf(stderr, "Error: --exemplar-threshold must not be negative. Use --help.\n"); return 1;
+    }
+    if (wal.windowMs < 0) {
+        fprintf(stderr, "Error: --wal-window must not be negative. Use --help.\n"); return 1;
     }
+    if (config.condition && !(config.compiledCondition = condition_compile(config.condition))) return 1;
+    if (config.rulesPath && access(config.rulesPath, R_OK) != 0) {
+        fprintf(stderr, "Error: Cannot read rules file %s.\n", config.rulesPath); return 1;
+    }
+
+    flight_start(flightPath);
+    if (simulatePath) return simulate(&config, simulatePath);
+#ifdef HIDKITD_STANDIN
+    IOStandInMeasureDelivery(deliveryBounds, DELIVERY_BUCKETS, delivery.counts, &delivery.sum);
+#endif
 
     printf("DAEMON: Starting up...\n");
     fflush(stdout);
+    correlation_seed();
+    daemonArgv = (char *const *)argv;
+    if (!handoff_load()) return 1;
 
+    // Only the event source is set up before monitoring starts. Both
+    // notifications are armed first; devices already present wait in the
+    // matched iterator and anything arriving later waits in the port, so
+    // the rest of startup delays actions but loses no events.
     IONotificationPortRef notifyPort = IONotificationPortCreate(kIOMainPortDefault);
     CFRunLoopSourceRef runLoopSource = IONotificationPortGetRunLoopSource(notifyPort);
     CFRunLoopAddSource(CFRunLoopGetCurrent(), runLoopSource, kCFRunLoopDefaultMode);
 
     CFMutableDictionaryRef matchDict = createMatchingDictionary(&config);
+    CFRetain(matchDict);   // Each notification consumes one reference.
     io_iterator_t matchedIterator;
     IOServiceAddMatchingNotification(notifyPort, kIOMatchedNotification, matchDict, deviceConnected, &config, &matchedIterator);
-    deviceConnected(&config, matchedIterator);
-
-    CFMutableDictionaryRef termDict = createMatchingDictionary(&config);
     io_iterator_t terminatedIterator;
-    IOServiceAddMatchingNotification(notifyPort, kIOTerminatedNotification, termDict, deviceDisconnected, &config, &terminatedIterator);
-    deviceDisconnected(&config, terminatedIterator);
+    IOServiceAddMatchingNotification(notifyPort, kIOTerminatedNotification, matchDict, deviceDisconnected, &config, &terminatedIterator);
 
-    printf("DAEMON: Monitoring started.\n");
+    // The D-Bus handshake finishes on the run loop, and the rollup and
+    // flapper tables are allocated on their first event. Monitoring is only
+    // reported as started once nothing else can make startup fail.
+    if (!services_start(&config)) return 1;
+    if (!control_open(config.controlSocketPath)) return 1;
+    counters.startupSeconds = wall_seconds() - execTime;
+    printf("DAEMON: Monitoring started (%.1f ms after exec).\n", counters.startupSeconds * 1000.0);
     fflush(stdout);
+
+    // Drain (which also arms) the terminated iterator, then prime with the
+    // devices that were already connected. Both run only now, so startup
+    // events get the rules and the WAL like any other. After an upgrade only
+    // the differences from the handed-off registry raise events.
+    deviceDisconnected(&config, terminatedIterator);
+    deviceConnected(&config, matchedIterator);
+    handoff_finish(&config);
     CFRunLoopRun();
 
     return 0; // Never reached